@@ -0,0 +1,390 @@
+#include "base64.h"
+#include <stdexcept>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define BASE64_X86
+
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC allows any intrinsic in any function.
+#define BASE64_TARGET(isa)
+#else
+#define BASE64_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+#endif
+
+namespace {
+
+static char const digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Maps characters to their six-bit values; characters outside
+// of the alphabet, including the padding, map to 0x80.
+struct decode_table
+{
+	uint8_t values[256];
+
+	decode_table()
+	{
+		memset(values, 0x80, sizeof values);
+		for (uint8_t i = 0; i < 64; ++i)
+			values[(uint8_t)digits[i]] = i;
+	}
+};
+
+static decode_table const dtab;
+
+static void encode_scalar(uint8_t const * p, size_t groups, char * out)
+{
+	for (size_t i = 0; i < groups; ++i, p += 3, out += 4)
+	{
+		uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+		out[0] = digits[v >> 18];
+		out[1] = digits[(v >> 12) & 0x3f];
+		out[2] = digits[(v >> 6) & 0x3f];
+		out[3] = digits[v & 0x3f];
+	}
+}
+
+// Returns false if a character outside of the alphabet is found.
+static bool decode_scalar(char const * s, size_t groups, uint8_t * out)
+{
+	for (size_t i = 0; i < groups; ++i, s += 4, out += 3)
+	{
+		uint32_t a = dtab.values[(uint8_t)s[0]];
+		uint32_t b = dtab.values[(uint8_t)s[1]];
+		uint32_t c = dtab.values[(uint8_t)s[2]];
+		uint32_t d = dtab.values[(uint8_t)s[3]];
+		if ((a | b | c | d) & 0x80)
+			return false;
+
+		uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+		out[0] = (uint8_t)(v >> 16);
+		out[1] = (uint8_t)(v >> 8);
+		out[2] = (uint8_t)v;
+	}
+
+	return true;
+}
+
+#ifdef BASE64_X86
+
+// The vector paths follow Wojciech Muła's and Daniel Lemire's algorithms:
+// encoding spreads each 3-byte group over four bytes, splits it into
+// six-bit indices with two multiplications and maps the indices to digits
+// by adding an offset looked up by range; decoding validates the digits
+// with two nibble-indexed lookups and packs them back with
+// multiply-adds.
+//
+// The encoders consume 12 (SSSE3) or 24 (AVX2) bytes per iteration, but
+// read 16 or 28. The decoders consume 16 or 32 digits and produce 12 or
+// 24 bytes, but store 16 or 32. Each returns the number of input
+// bytes consumed; the decoders stop at the first block with an invalid
+// digit and leave it to the scalar code to report the error.
+
+BASE64_TARGET("ssse3")
+static __m128i encode_indices_ssse3(__m128i in)
+{
+	in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+
+	__m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	__m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	__m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	__m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	__m128i indices = _mm_or_si128(t1, t3);
+
+	__m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	__m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+	range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+
+	__m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	return _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, range));
+}
+
+BASE64_TARGET("ssse3")
+static size_t encode_ssse3(uint8_t const * p, size_t size, char * out)
+{
+	size_t i = 0;
+	for (; i + 16 <= size; i += 12, out += 16)
+	{
+		__m128i in = _mm_loadu_si128((__m128i const *)(p + i));
+		_mm_storeu_si128((__m128i *)out, encode_indices_ssse3(in));
+	}
+	return i;
+}
+
+BASE64_TARGET("avx2")
+static size_t encode_avx2(uint8_t const * p, size_t size, char * out)
+{
+	__m256i const spread = _mm256_setr_epi8(
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	__m256i const offsets = _mm256_setr_epi8(
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+	size_t i = 0;
+	for (; i + 28 <= size; i += 24, out += 32)
+	{
+		__m128i lo = _mm_loadu_si128((__m128i const *)(p + i));
+		__m128i hi = _mm_loadu_si128((__m128i const *)(p + i + 12));
+		__m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		in = _mm256_shuffle_epi8(in, spread);
+
+		__m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+		__m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		__m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+		__m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		__m256i indices = _mm256_or_si256(t1, t3);
+
+		__m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		__m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+		range = _mm256_or_si256(range, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+
+		__m256i res = _mm256_add_epi8(indices, _mm256_shuffle_epi8(offsets, range));
+		_mm256_storeu_si256((__m256i *)out, res);
+	}
+	return i;
+}
+
+BASE64_TARGET("ssse3")
+static size_t decode_ssse3(char const * s, size_t size, uint8_t * out)
+{
+	__m128i const lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	__m128i const lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	__m128i const lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	__m128i const pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16, out += 12)
+	{
+		__m128i in = _mm_loadu_si128((__m128i const *)(s + i));
+
+		__m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+		__m128i lo_nibbles = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+		__m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+		__m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff)
+			break;
+
+		__m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+		__m128i values = _mm_add_epi8(in, _mm_shuffle_epi8(lut_roll, _mm_add_epi8(slash, hi_nibbles)));
+
+		__m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+		__m128i triples = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+		_mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(triples, pack));
+	}
+	return i;
+}
+
+BASE64_TARGET("avx2")
+static size_t decode_avx2(char const * s, size_t size, uint8_t * out)
+{
+	__m256i const lut_lo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	__m256i const lut_hi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	__m256i const lut_roll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	__m256i const pack = _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	__m256i const join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32, out += 24)
+	{
+		__m256i in = _mm256_loadu_si256((__m256i const *)(s + i));
+
+		__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0f));
+		__m256i lo_nibbles = _mm256_and_si256(in, _mm256_set1_epi8(0x0f));
+		__m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		__m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256())) != -1)
+			break;
+
+		__m256i slash = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/'));
+		__m256i values = _mm256_add_epi8(in, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(slash, hi_nibbles)));
+
+		__m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+		__m256i triples = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+		triples = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(triples, pack), join);
+		_mm256_storeu_si256((__m256i *)out, triples);
+	}
+	return i;
+}
+
+#endif
+
+static base64_isa detect_isa()
+{
+#ifdef BASE64_X86
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+
+	__cpuid(info, 1);
+	bool ssse3 = (info[2] & (1 << 9)) != 0;
+	bool avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+
+	bool avx2 = false;
+	if (avx && max_leaf >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+#else
+	__builtin_cpu_init();
+	bool ssse3 = __builtin_cpu_supports("ssse3") != 0;
+	bool avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+
+	if (avx2)
+		return base64_isa::avx2;
+	if (ssse3)
+		return base64_isa::ssse3;
+#endif
+
+	return base64_isa::scalar;
+}
+
+struct isa_state
+{
+	base64_isa supported;
+	base64_isa current;
+};
+
+static isa_state & get_isa()
+{
+	static isa_state state = { detect_isa(), detect_isa() };
+	return state;
+}
+
+}
+
+base64_isa base64_select_isa(base64_isa max)
+{
+	isa_state & state = get_isa();
+	state.current = max < state.supported? max: state.supported;
+	return state.current;
+}
+
+std::string to_base64(uint8_t const * p, size_t size)
+{
+	std::string res((size + 2) / 3 * 4, '\0');
+	char * out = &res[0];
+
+	size_t done = 0;
+	switch (get_isa().current)
+	{
+#ifdef BASE64_X86
+	case base64_isa::avx2:
+		done = encode_avx2(p, size, out);
+		break;
+	case base64_isa::ssse3:
+		done = encode_ssse3(p, size, out);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	out += done / 3 * 4;
+	p += done;
+	size -= done;
+
+	encode_scalar(p, size / 3, out);
+	out += size / 3 * 4;
+	p += size / 3 * 3;
+
+	switch (size % 3)
+	{
+	case 1:
+		out[0] = digits[p[0] >> 2];
+		out[1] = digits[(p[0] << 4) & 0x30];
+		out[2] = '=';
+		out[3] = '=';
+		break;
+	case 2:
+		out[0] = digits[p[0] >> 2];
+		out[1] = digits[((p[0] << 4) & 0x30) | (p[1] >> 4)];
+		out[2] = digits[(p[1] << 2) & 0x3c];
+		out[3] = '=';
+		break;
+	}
+
+	return res;
+}
+
+std::vector<uint8_t> from_base64(string_view s)
+{
+	if (s.size() % 4 != 0)
+		throw std::invalid_argument("base64 strings must be a multiple of 4 characters long");
+
+	if (s.empty())
+		return std::vector<uint8_t>();
+
+	char const * first = s.begin();
+	size_t size = s.size();
+
+	size_t padding = first[size - 1] != '='? 0: first[size - 2] != '='? 1: 2;
+	size_t out_size = size / 4 * 3 - padding;
+
+	// The vector decoders store up to eight bytes past their output.
+	std::vector<uint8_t> res(out_size + 8);
+	uint8_t * out = res.data();
+
+	// All groups but the last one, which may be padded.
+	size_t body = size - 4;
+
+	size_t done = 0;
+	switch (get_isa().current)
+	{
+#ifdef BASE64_X86
+	case base64_isa::avx2:
+		done = decode_avx2(first, body, out);
+		break;
+	case base64_isa::ssse3:
+		done = decode_ssse3(first, body, out);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	if (!decode_scalar(first + done, (body - done) / 4, out + done / 4 * 3))
+		throw std::invalid_argument("unexpected characters");
+	out += body / 4 * 3;
+
+	char const * tail = first + body;
+	uint32_t a = dtab.values[(uint8_t)tail[0]];
+	uint32_t b = dtab.values[(uint8_t)tail[1]];
+	uint32_t c = padding < 2? dtab.values[(uint8_t)tail[2]]: 0;
+	uint32_t d = padding < 1? dtab.values[(uint8_t)tail[3]]: 0;
+	if ((a | b | c | d) & 0x80)
+		throw std::invalid_argument("unexpected characters");
+
+	uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+	if ((v & ((1u << (padding * 8)) - 1)) != 0)
+		throw std::invalid_argument("non-zero padding bits");
+
+	out[0] = (uint8_t)(v >> 16);
+	if (padding < 2)
+		out[1] = (uint8_t)(v >> 8);
+	if (padding < 1)
+		out[2] = (uint8_t)v;
+
+	res.resize(out_size);
+	return res;
+}
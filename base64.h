@@ -0,0 +1,28 @@
+#ifndef BASE64_H
+#define BASE64_H
+
+#include "string_view.h"
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+std::string to_base64(uint8_t const * p, size_t size);
+
+// Decodes padded base64; throws std::invalid_argument if `s` isn't
+// canonically encoded.
+std::vector<uint8_t> from_base64(string_view s);
+
+// The instruction sets the codec can use, in increasing order.
+enum class base64_isa
+{
+	scalar,
+	ssse3,
+	avx2,
+};
+
+// Restricts the codec to instruction sets up to `max` and returns the one
+// it's going to use. By default, the best one the processor supports is
+// used; this is mostly useful for testing and benchmarking.
+base64_isa base64_select_isa(base64_isa max);
+
+#endif // BASE64_H
@@ -0,0 +1,87 @@
+#include "basic_blocks.h"
+#include "x86_decode.h"
+
+bool split_function(uint8_t const * code, uint64_t first, uint64_t last, bool x64,
+	uint64_t const * lines, size_t line_count, uint64_t * leaders)
+{
+	enum : uint8_t
+	{
+		insn_start = 1,
+		block_start = 2,
+	};
+
+	size_t size = (size_t)(last - first);
+
+	// The marks of each byte of the function and of the one past its end.
+	std::vector<uint8_t> marks(size + 1, 0);
+	marks[0] = block_start;
+
+	std::vector<size_t> targets;
+
+	size_t pos = 0;
+	while (pos < size)
+	{
+		x86_insn insn;
+		if (!x86_decode(code + pos, size - pos, x64, insn))
+			return false;
+
+		marks[pos] |= insn_start;
+		size_t next = pos + insn.length;
+
+		switch (insn.flow)
+		{
+		case x86_flow::next:
+			break;
+
+		case x86_flow::indirect_jump:
+			return false;
+
+		case x86_flow::jump:
+		case x86_flow::cond_jump:
+		case x86_flow::call:
+			{
+				// Jumps out of the function are tail calls.
+				int64_t target = (int64_t)next + insn.rel;
+				if (target >= 0 && target < (int64_t)size)
+					targets.push_back((size_t)target);
+			}
+			marks[next] |= block_start;
+			break;
+
+		default:
+			marks[next] |= block_start;
+			break;
+		}
+
+		pos = next;
+	}
+
+	for (size_t target: targets)
+	{
+		if ((marks[target] & insn_start) == 0)
+			return false;
+		marks[target] |= block_start;
+	}
+
+	for (size_t i = 0; i < line_count; ++i)
+	{
+		if ((marks[(size_t)(lines[i] - first)] & insn_start) == 0)
+			return false;
+	}
+
+	size_t leader = 0;
+	size_t scan = 0;
+	for (size_t i = 0; i < line_count; ++i)
+	{
+		size_t offset = (size_t)(lines[i] - first);
+		for (; scan <= offset; ++scan)
+		{
+			if (marks[scan] & block_start)
+				leader = scan;
+		}
+
+		leaders[i] = first + leader;
+	}
+
+	return true;
+}
@@ -0,0 +1,74 @@
+#ifndef BASIC_BLOCKS_H
+#define BASIC_BLOCKS_H
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <stdint.h>
+
+// Finds the block leader of each of the sorted `lines` that lie in
+// the function at [first, last), whose code is `code`, and stores it
+// into the corresponding element of `leaders`.
+//
+// A block is entered only at its leader and, once entered, runs to its end.
+// Blocks therefore end not only at branches, but after calls too, as
+// a callee need not return.
+//
+// Returns false and leaves `leaders` alone if the function can't be split
+// reliably: if it doesn't decode, if a branch target or a line doesn't
+// start an instruction, or if it jumps indirectly, possibly into the middle
+// of a block.
+bool split_function(uint8_t const * code, uint64_t first, uint64_t last, bool x64,
+	uint64_t const * lines, size_t line_count, uint64_t * leaders);
+
+// Splits the functions of a module into basic blocks and returns
+// the (leader, line) pairs of each of the `lines`, sorted.
+// Lines outside of functions, or in functions that can't be split,
+// lead their own blocks.
+//
+// `read` is called as
+//
+//     bool read(uint64_t offset, uint8_t * buf, size_t size);
+//
+// to get the code of each function; functions it fails for aren't split.
+template <typename Read>
+std::vector<std::pair<uint64_t, uint64_t>> find_basic_blocks(std::vector<uint64_t> lines,
+	std::vector<std::pair<uint64_t, uint64_t>> functions, bool x64, Read read)
+{
+	std::sort(lines.begin(), lines.end());
+	lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+
+	std::vector<uint64_t> leaders = lines;
+
+	std::sort(functions.begin(), functions.end());
+
+	std::vector<uint8_t> code;
+	uint64_t prev_last = 0;
+	for (auto const & fn: functions)
+	{
+		if (fn.first < prev_last || fn.second <= fn.first)
+			continue;
+		prev_last = fn.second;
+
+		size_t line_first = std::lower_bound(lines.begin(), lines.end(), fn.first) - lines.begin();
+		size_t line_last = std::lower_bound(lines.begin(), lines.end(), fn.second) - lines.begin();
+		if (line_last - line_first <= 1)
+			continue;
+
+		code.resize((size_t)(fn.second - fn.first));
+		if (!read(fn.first, code.data(), code.size()))
+			continue;
+
+		split_function(code.data(), fn.first, fn.second, x64,
+			lines.data() + line_first, line_last - line_first, leaders.data() + line_first);
+	}
+
+	std::vector<std::pair<uint64_t, uint64_t>> res;
+	res.reserve(lines.size());
+	for (size_t i = 0; i < lines.size(); ++i)
+		res.push_back(std::make_pair(leaders[i], lines[i]));
+	std::sort(res.begin(), res.end());
+	return res;
+}
+
+#endif // BASIC_BLOCKS_H
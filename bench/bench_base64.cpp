@@ -0,0 +1,224 @@
+// Compares the base64 codec against the scalar implementation it replaced.
+//
+// Encodes and decodes random buffers of several sizes with each instruction
+// set the processor supports, checks the results against the old code and
+// prints the throughput. Build it together with base64.cpp, e.g.
+//
+//     g++ -std=c++14 -O2 -I.. -o bench_base64 bench_base64.cpp ../base64.cpp
+//
+// Usage: bench_base64 [<total MB per size>]
+
+#include "../base64.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <iostream>
+#include <cstdlib>
+
+static std::string legacy_to_base64(uint8_t const * p, size_t size)
+{
+	static char const digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	std::string res;
+	res.reserve(size / 3 * 4 + 4);
+
+	while (size >= 3)
+	{
+		res.push_back(digits[p[0] >> 2]);
+		res.push_back(digits[((p[0] << 4) & 0x30) | (p[1] >> 4)]);
+		res.push_back(digits[((p[1] << 2) & 0x3c) | (p[2] >> 6)]);
+		res.push_back(digits[p[2] & 0x3f]);
+		p += 3;
+		size -= 3;
+	}
+
+	switch (size)
+	{
+	case 1:
+		res.push_back(digits[p[0] >> 2]);
+		res.push_back(digits[(p[0] << 4) & 0x30]);
+		res.append("==");
+		break;
+	case 2:
+		res.push_back(digits[p[0] >> 2]);
+		res.push_back(digits[((p[0] << 4) & 0x30) | (p[1] >> 4)]);
+		res.push_back(digits[(p[1] << 2) & 0x3c]);
+		res.push_back('=');
+		break;
+	}
+
+	return res;
+}
+
+static std::vector<uint8_t> legacy_from_base64(string_view s)
+{
+	if (s.size() % 4 != 0)
+		throw std::invalid_argument("base64 strings must be a multiple of 4 characters long");
+
+	auto extract_digit = [](char ch) -> uint8_t {
+		if ('A' <= ch && ch <= 'Z')
+			return ch - 'A';
+		if ('a' <= ch && ch <= 'z')
+			return ch - 'a' + 26;
+		if ('0' <= ch && ch <= '9')
+			return ch - '0' + 52;
+		if (ch == '+')
+			return 62;
+		if (ch == '/')
+			return 63;
+		if (ch == '=')
+			return 0;
+		throw std::invalid_argument("unexpected characters");
+	};
+
+	char const * first = s.begin();
+	char const * last = s.end();
+
+	size_t eq_suffix = 0;
+	if (first != last && last[-1] == '=')
+	{
+		if (last[-2] == '=')
+			eq_suffix = 2;
+		else
+			eq_suffix = 1;
+	}
+
+	if (std::find(first, last - eq_suffix, '=') != last - eq_suffix)
+		throw std::invalid_argument("stray equal signs");
+
+	std::vector<uint8_t> res;
+	res.reserve(s.size() / 4 * 3);
+
+	while (!s.empty())
+	{
+		uint32_t v = 0;
+		for (int i = 0; i < 4; ++i)
+			v = (v << 6) | extract_digit(s[i]);
+		s.remove_prefix(4);
+
+		res.push_back(v >> 16);
+		res.push_back(v >> 8);
+		res.push_back(v);
+	}
+
+	res.erase(res.end() - eq_suffix, res.end());
+	return res;
+}
+
+template <typename F>
+static double best_of(int runs, F && f)
+{
+	double best = 1e30;
+	for (int i = 0; i < runs; ++i)
+	{
+		auto start = std::chrono::steady_clock::now();
+		f();
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		if (elapsed.count() < best)
+			best = elapsed.count();
+	}
+	return best;
+}
+
+static void fail(char const * what, size_t size)
+{
+	std::cerr << what << " mismatch at size " << size << "\n";
+	std::exit(1);
+}
+
+static bool rejects(std::string const & s)
+{
+	try
+	{
+		from_base64(s);
+		return false;
+	}
+	catch (std::invalid_argument const &)
+	{
+		return true;
+	}
+}
+
+// Every instruction set must agree with the old code, including on
+// the sizes around the vector block boundaries.
+static void check(std::mt19937_64 & rng)
+{
+	for (size_t size = 0; size < 200; ++size)
+	{
+		std::vector<uint8_t> data(size);
+		for (uint8_t & b: data)
+			b = (uint8_t)rng();
+
+		std::string expected = legacy_to_base64(data.data(), data.size());
+		std::string encoded = to_base64(data.data(), data.size());
+		if (encoded != expected)
+			fail("encode", size);
+		if (from_base64(encoded) != data)
+			fail("decode", size);
+
+		for (size_t i = 0; i < encoded.size(); ++i)
+		{
+			std::string bad = encoded;
+			bad[i] = '*';
+			if (!rejects(bad))
+				fail("validation", size);
+		}
+	}
+
+	if (!rejects("QQ==QQ==") || !rejects("QR==") || !rejects("QUJ=") || !rejects("QUJD="))
+		fail("validation", 0);
+}
+
+static void bench(char const * isa, size_t size, size_t total)
+{
+	std::mt19937_64 rng(size);
+	std::vector<uint8_t> data(size);
+	for (uint8_t & b: data)
+		b = (uint8_t)rng();
+
+	size_t reps = std::max<size_t>(1, total / std::max<size_t>(1, size));
+	std::string encoded;
+	std::vector<uint8_t> decoded;
+
+	double enc_old = best_of(5, [&]() {
+		for (size_t i = 0; i < reps; ++i)
+			encoded = legacy_to_base64(data.data(), data.size());
+	});
+	double dec_old = best_of(5, [&]() {
+		for (size_t i = 0; i < reps; ++i)
+			decoded = legacy_from_base64(encoded);
+	});
+	double enc = best_of(5, [&]() {
+		for (size_t i = 0; i < reps; ++i)
+			encoded = to_base64(data.data(), data.size());
+	});
+	double dec = best_of(5, [&]() {
+		for (size_t i = 0; i < reps; ++i)
+			decoded = from_base64(encoded);
+	});
+
+	double mb = size * reps / 1e6;
+	std::cout << isa << " " << size << " bytes: encode " << mb / enc_old << " -> " << mb / enc
+		<< " MB/s, decode " << mb / dec_old << " -> " << mb / dec << " MB/s\n";
+}
+
+int main(int argc, char * argv[])
+{
+	size_t total = (argc > 1? std::strtoul(argv[1], nullptr, 10): 64) * 1000000;
+
+	static char const * const names[] = { "scalar", "ssse3", "avx2" };
+	static size_t const sizes[] = { 20, 256, 4096, 1 << 20 };
+
+	std::mt19937_64 rng(1);
+	base64_isa const isas[] = { base64_isa::scalar, base64_isa::ssse3, base64_isa::avx2 };
+	for (base64_isa isa: isas)
+	{
+		if (base64_select_isa(isa) != isa)
+			continue;
+
+		check(rng);
+		for (size_t size: sizes)
+			bench(names[(int)isa], size, total);
+	}
+}
@@ -0,0 +1,435 @@
+// Measures loading, storing, merging and reporting coverage at scale.
+//
+// Generates synthetic programs and coverage files with synthetic_coverage.h,
+// from a single module to a thousand, from a thousand line addresses per
+// module to ten million, and up to thousands of files to merge, and times
+//
+//  - `coverage_info::store` and `store_binary`,
+//  - `coverage_info::load` on both formats and `load_file` on the binary one,
+//  - `coverage_info::merge` of two runs and `merge_all` of many,
+//  - `report` and `store_report`, with the line tables in a line cache.
+//
+// The results are printed and, with `--json`, also written as JSON, one
+// record per benchmark and case, to be compared across changes. Build it
+// together with the sources `report` needs, e.g.
+//
+//     g++ -std=c++14 -O2 -pthread -I.. -o bench_coverage bench_coverage.cpp
+//         ../base64.cpp ../coverage_info.cpp ../dwarf_line.cpp ../elf_file.cpp
+//         ../line_cache.cpp ../line_table.cpp ../mapped_file.cpp ../pdb_file.cpp
+//         ../report.cpp ../stats.cpp ../utf.cpp ../utils.cpp
+//
+// Usage: bench_coverage [--full] [--filter <name>] [-j <threads>] [--tmp <dir>] [--json <file>]
+//
+// Without `--full`, the largest cases are skipped. Temporary files go
+// to `--tmp`, by default the current directory.
+
+#include "synthetic_coverage.h"
+#include "../json.h"
+#include <chrono>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <streambuf>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+struct timing
+{
+	int runs;
+	double best;
+	double mean;
+};
+
+struct result
+{
+	std::string benchmark;
+	size_t modules;
+	size_t addrs;
+	size_t files;
+	uint64_t bytes;
+	timing t;
+};
+
+// Counts what's written to it and throws it away.
+struct null_buf
+	: std::streambuf
+{
+	uint64_t size;
+
+	null_buf()
+		: size(0)
+	{
+	}
+
+protected:
+	int_type overflow(int_type ch) override
+	{
+		++size;
+		return traits_type::not_eof(ch);
+	}
+
+	std::streamsize xsputn(char const *, std::streamsize n) override
+	{
+		size += (uint64_t)n;
+		return n;
+	}
+};
+
+struct bench_opts
+{
+	bool full;
+	std::string filter;
+	unsigned threads;
+	std::string tmp_dir;
+	std::string json_fname;
+
+	bench_opts()
+		: full(false), threads(0), tmp_dir(".")
+	{
+	}
+};
+
+}
+
+// Runs `f` at least three times and until half a second has passed, but
+// no more than twenty times, or just once if that alone takes more than
+// two seconds. `setup` is called before each run, untimed.
+template <typename Setup, typename F>
+static timing measure(Setup && setup, F && f)
+{
+	timing res = { 0, 1e30, 0 };
+	double total = 0;
+	while (res.runs < 20 && (res.runs < 3 || total < 0.5) && total < 2)
+	{
+		setup();
+
+		auto start = std::chrono::steady_clock::now();
+		f();
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		++res.runs;
+		total += elapsed.count();
+		if (elapsed.count() < res.best)
+			res.best = elapsed.count();
+	}
+
+	res.mean = total / res.runs;
+	return res;
+}
+
+template <typename F>
+static timing measure(F && f)
+{
+	return measure([]() {}, f);
+}
+
+static size_t count_addrs(coverage_info const & ci)
+{
+	size_t res = 0;
+	for (auto && kv: ci.pdbs)
+		res += kv.second.addrs_covered.size();
+	return res;
+}
+
+static void check(bool cond, char const * what)
+{
+	if (!cond)
+	{
+		std::cerr << "error: " << what << "\n";
+		std::exit(1);
+	}
+}
+
+static void report_result(std::vector<result> & results, result const & r)
+{
+	std::cout << r.benchmark << " " << r.modules << " x " << r.addrs;
+	if (r.files > 1)
+		std::cout << " x " << r.files << " files";
+	std::cout << ": " << r.t.best * 1e3 << " ms";
+
+	size_t total = r.modules * r.addrs * r.files;
+	std::cout << ", " << total / 1e6 / r.t.best << " M addresses/s";
+	if (r.bytes != 0)
+		std::cout << ", " << r.bytes / 1e6 / r.t.best << " MB/s";
+	std::cout << "\n";
+
+	results.push_back(r);
+}
+
+static bool selected(bench_opts const & opts, char const * name)
+{
+	return opts.filter.empty() || std::strstr(name, opts.filter.c_str()) != nullptr;
+}
+
+// Benchmarks a single coverage file of `modules` modules with `addrs`
+// line addresses each, about a third of them covered.
+static void bench_single(std::vector<result> & results, bench_opts const & opts, size_t modules, size_t addrs)
+{
+	synthetic_program prog = make_program(modules, addrs);
+	coverage_info ci = make_run(prog, 0.3, 1);
+	coverage_info other = make_run(prog, 0.3, 2);
+	size_t covered = count_addrs(ci);
+
+	auto add = [&](char const * name, uint64_t bytes, timing const & t) {
+		result r = { name, modules, addrs, 1, bytes, t };
+		report_result(results, r);
+	};
+
+	std::string json;
+	std::string binary;
+	{
+		std::ostringstream out;
+		ci.store(out);
+		json = out.str();
+	}
+	{
+		std::ostringstream out;
+		ci.store_binary(out);
+		binary = out.str();
+	}
+
+	if (selected(opts, "store_json"))
+	{
+		add("store_json", json.size(), measure([&]() {
+			null_buf buf;
+			std::ostream out(&buf);
+			ci.store(out);
+		}));
+	}
+
+	if (selected(opts, "store_binary"))
+	{
+		add("store_binary", binary.size(), measure([&]() {
+			null_buf buf;
+			std::ostream out(&buf);
+			ci.store_binary(out);
+		}));
+	}
+
+	if (selected(opts, "load_json"))
+	{
+		add("load_json", json.size(), measure([&]() {
+			std::istringstream in(json);
+			check(count_addrs(coverage_info::load(in)) == covered, "load_json lost addresses");
+		}));
+	}
+
+	if (selected(opts, "load_binary"))
+	{
+		add("load_binary", binary.size(), measure([&]() {
+			std::istringstream in(binary);
+			check(count_addrs(coverage_info::load(in)) == covered, "load_binary lost addresses");
+		}));
+	}
+
+	if (selected(opts, "load_file"))
+	{
+		std::string fname = opts.tmp_dir + "/bench_coverage.bin";
+		{
+			std::ofstream out(fname, std::ios::binary);
+			out.write(binary.data(), binary.size());
+			check((bool)out, "cannot write a temporary file");
+		}
+
+		add("load_file", binary.size(), measure([&]() {
+			coverage_info res;
+			check(coverage_info::load_file(utf8_to_utf16(fname), res), "cannot open a temporary file");
+			check(count_addrs(res) == covered, "load_file lost addresses");
+		}));
+
+		std::remove(fname.c_str());
+	}
+
+	if (selected(opts, "merge_pair"))
+	{
+		coverage_info lhs, rhs;
+		add("merge_pair", 0, measure([&]() { lhs = ci; rhs = other; }, [&]() {
+			lhs.merge(std::move(rhs));
+		}));
+	}
+
+	if (selected(opts, "report_memory") || selected(opts, "report_stream"))
+	{
+		std::wstring cache_dir = utf8_to_utf16(opts.tmp_dir + "/bench_coverage.cache");
+		check(store_program_lines(prog, cache_dir), "cannot write the line cache");
+
+		report_options ropts;
+		ropts.cache_dir = cache_dir;
+		ropts.threads = opts.threads;
+
+		if (selected(opts, "report_memory"))
+		{
+			add("report_memory", 0, measure([&]() {
+				coverage_report cr = report(ci, ropts);
+				check(!cr.files.empty(), "empty report");
+			}));
+		}
+
+		if (selected(opts, "report_stream"))
+		{
+			add("report_stream", 0, measure([&]() {
+				null_buf buf;
+				std::ostream out(&buf);
+				store_report(ci, ropts, out);
+			}));
+		}
+
+		for (synthetic_module const & mod: prog.modules)
+			std::remove(utf16_to_utf8(cache_dir + L"/" + utf8_to_utf16(mod.id.to_string()) + L".lines").c_str());
+		std::remove(utf16_to_utf8(cache_dir).c_str());
+	}
+}
+
+// Benchmarks merging `files` runs of a program of `modules` modules
+// with `addrs` line addresses each.
+static void bench_merge(std::vector<result> & results, bench_opts const & opts, size_t modules, size_t addrs, size_t files)
+{
+	if (!selected(opts, "merge_all") && !selected(opts, "merge_runs") && !selected(opts, "merge_seq"))
+		return;
+
+	synthetic_program prog = make_program(modules, addrs);
+
+	std::vector<coverage_info> runs;
+	for (size_t i = 0; i < files; ++i)
+		runs.push_back(make_run(prog, 0.3, i + 1));
+
+	auto add = [&](char const * name, timing const & t) {
+		result r = { name, modules, addrs, files, 0, t };
+		report_result(results, r);
+	};
+
+	std::vector<coverage_info> inputs;
+	auto copy_runs = [&]() { inputs = runs; };
+
+	if (selected(opts, "merge_all"))
+	{
+		add("merge_all", measure(copy_runs, [&]() {
+			coverage_info::merge_all(std::move(inputs), false, opts.threads);
+		}));
+	}
+
+	if (selected(opts, "merge_runs"))
+	{
+		add("merge_runs", measure(copy_runs, [&]() {
+			coverage_info::merge_all(std::move(inputs), true, opts.threads);
+		}));
+	}
+
+	// What merging a file at a time, as `merge` used to, costs.
+	if (selected(opts, "merge_seq"))
+	{
+		add("merge_seq", measure(copy_runs, [&]() {
+			coverage_info res;
+			for (coverage_info & ci: inputs)
+				res.merge(std::move(ci));
+		}));
+	}
+}
+
+static void store_results(std::vector<result> const & results, std::string const & fname)
+{
+	std::ofstream out(fname, std::ios::binary);
+	check((bool)out, "cannot open the results file");
+
+	json_writer w(out);
+	w.open_array();
+	for (result const & r: results)
+	{
+		w.open_object();
+		w.write_key("benchmark");
+		w.write_str(r.benchmark);
+		w.write_key("modules");
+		w.write_num(r.modules);
+		w.write_key("addresses");
+		w.write_num(r.addrs);
+		w.write_key("files");
+		w.write_num(r.files);
+		w.write_key("bytes");
+		w.write_num(r.bytes);
+		w.write_key("runs");
+		w.write_num(r.t.runs);
+		w.write_key("best_ns");
+		w.write_num((uint64_t)(r.t.best * 1e9));
+		w.write_key("mean_ns");
+		w.write_num((uint64_t)(r.t.mean * 1e9));
+		w.close_object();
+	}
+	w.close_array();
+}
+
+int main(int argc, char * argv[])
+{
+	bench_opts opts;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--full")
+			opts.full = true;
+		else if (arg == "--filter" && i + 1 < argc)
+			opts.filter = argv[++i];
+		else if (arg == "-j" && i + 1 < argc)
+			opts.threads = (unsigned)std::strtoul(argv[++i], nullptr, 10);
+		else if (arg == "--tmp" && i + 1 < argc)
+			opts.tmp_dir = argv[++i];
+		else if (arg == "--json" && i + 1 < argc)
+			opts.json_fname = argv[++i];
+		else
+		{
+			std::cerr << "Usage: bench_coverage [--full] [--filter <name>] [-j <threads>] [--tmp <dir>] [--json <file>]\n";
+			return 2;
+		}
+	}
+
+	struct single_case
+	{
+		size_t modules;
+		size_t addrs;
+		bool full;
+	};
+
+	static single_case const single_cases[] = {
+		{ 1, 1000, false },
+		{ 1, 100000, false },
+		{ 1, 1000000, false },
+		{ 1, 10000000, true },
+		{ 10, 1000000, true },
+		{ 100, 10000, false },
+		{ 1000, 1000, false },
+		{ 1000, 10000, true },
+	};
+
+	struct merge_case
+	{
+		size_t modules;
+		size_t addrs;
+		size_t files;
+		bool full;
+	};
+
+	static merge_case const merge_cases[] = {
+		{ 10, 1000, 100, false },
+		{ 10, 1000, 1000, false },
+		{ 1, 100000, 1000, true },
+		{ 10, 2000, 4000, true },
+	};
+
+	std::vector<result> results;
+
+	for (single_case const & c: single_cases)
+	{
+		if (!c.full || opts.full)
+			bench_single(results, opts, c.modules, c.addrs);
+	}
+
+	for (merge_case const & c: merge_cases)
+	{
+		if (!c.full || opts.full)
+			bench_merge(results, opts, c.modules, c.addrs, c.files);
+	}
+
+	if (!opts.json_fname.empty())
+		store_results(results, opts.json_fname);
+}
@@ -0,0 +1,110 @@
+// Measures how fast coverage files are written and parsed.
+//
+// Generates a synthetic coverage file, stores it as JSON and in the binary
+// format, and times `coverage_info::store` and `coverage_info::load`
+// on both. Build it together with base64.cpp,
+// coverage_info.cpp, mapped_file.cpp, utf.cpp and utils.cpp, e.g.
+//
+//     g++ -std=c++14 -O2 -I.. -o bench_json bench_json.cpp ../base64.cpp
+//         ../coverage_info.cpp ../mapped_file.cpp ../utf.cpp ../utils.cpp
+//
+// Usage: bench_json [<modules> [<addresses per module>]]
+
+#include "../debugger_loop.h"
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <iostream>
+#include <cstdlib>
+
+static coverage_info make_coverage(size_t modules, size_t addrs)
+{
+	std::mt19937_64 rng(1);
+
+	coverage_info ci;
+	for (size_t i = 0; i < modules; ++i)
+	{
+		guid g;
+		for (uint8_t & b: g.data)
+			b = (uint8_t)rng();
+
+		pdb_coverage_info & pci = ci.pdbs[g];
+		pci.filename = L"C:\\build\\module" + std::to_wstring(i) + L".pdb";
+		pci.image_size = 0x4000000;
+		pci.timestamp = (uint32_t)rng();
+		pci.cv.assign(40, 0x42);
+
+		uint64_t addr = 0x1000;
+		for (size_t j = 0; j < addrs; ++j)
+		{
+			addr += 1 + rng() % 24;
+			pci.addrs_covered.push_back(addr);
+		}
+	}
+
+	return ci;
+}
+
+template <typename F>
+static double best_of(int runs, F && f)
+{
+	double best = 1e30;
+	for (int i = 0; i < runs; ++i)
+	{
+		auto start = std::chrono::steady_clock::now();
+		f();
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		if (elapsed.count() < best)
+			best = elapsed.count();
+	}
+	return best;
+}
+
+static void bench_load(char const * name, std::string const & data, size_t addr_count)
+{
+	size_t loaded = 0;
+	double secs = best_of(5, [&]() {
+		std::istringstream in(data);
+		coverage_info ci = coverage_info::load(in);
+		loaded = 0;
+		for (auto && kv: ci.pdbs)
+			loaded += kv.second.addrs_covered.size();
+	});
+
+	if (loaded != addr_count)
+	{
+		std::cerr << name << ": loaded " << loaded << " addresses, expected " << addr_count << "\n";
+		std::exit(1);
+	}
+
+	std::cout << name << " load: " << data.size() / 1e6 << " MB in " << secs * 1e3 << " ms, "
+		<< data.size() / 1e6 / secs << " MB/s, " << addr_count / 1e6 / secs << " M addresses/s\n";
+}
+
+static std::string bench_store(char const * name, coverage_info & ci, void (coverage_info::*store)(std::ostream &))
+{
+	std::string data;
+	double secs = best_of(5, [&]() {
+		std::ostringstream out;
+		(ci.*store)(out);
+		data = out.str();
+	});
+
+	std::cout << name << " store: " << data.size() / 1e6 << " MB in " << secs * 1e3 << " ms, "
+		<< data.size() / 1e6 / secs << " MB/s\n";
+	return data;
+}
+
+int main(int argc, char * argv[])
+{
+	size_t modules = argc > 1? std::strtoul(argv[1], nullptr, 10): 16;
+	size_t addrs = argc > 2? std::strtoul(argv[2], nullptr, 10): 250000;
+
+	coverage_info ci = make_coverage(modules, addrs);
+
+	std::string json = bench_store("json", ci, &coverage_info::store);
+	std::string binary = bench_store("binary", ci, &coverage_info::store_binary);
+
+	bench_load("json", json, modules * addrs);
+	bench_load("binary", binary, modules * addrs);
+}
@@ -0,0 +1,149 @@
+#ifndef BENCH_SYNTHETIC_COVERAGE_H
+#define BENCH_SYNTHETIC_COVERAGE_H
+
+// Generators of synthetic programs and of coverage captured from them,
+// for the benchmarks.
+//
+// A program is a set of modules with line tables. Its coverage files are
+// drawn from it like those of a test suite: each run covers a random subset
+// of every module's line addresses, with the same module ids, so that they
+// can be merged and reported. The line tables can be stored into a line
+// cache, which lets `report` run without the binaries or their symbols.
+
+#include "../debugger_loop.h"
+#include "../line_table.h"
+#include "../line_cache.h"
+#include "../utf.h"
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+struct synthetic_module
+{
+	guid id;
+	std::wstring filename;
+	std::vector<uint8_t> cv;
+	uint32_t image_size;
+	uint32_t timestamp;
+
+	// Rows sorted by address; a source line has one to three addresses.
+	module_lines lines;
+};
+
+struct synthetic_program
+{
+	std::vector<synthetic_module> modules;
+};
+
+// Makes a program of `modules` modules with `addrs` line addresses each,
+// spread over one source file per `addrs_per_file` addresses.
+inline synthetic_program make_program(size_t modules, size_t addrs, size_t addrs_per_file = 200, uint64_t seed = 1)
+{
+	std::mt19937_64 rng(seed);
+
+	synthetic_program res;
+	res.modules.resize(modules);
+	for (size_t i = 0; i < modules; ++i)
+	{
+		synthetic_module & mod = res.modules[i];
+		for (uint8_t & b: mod.id.data)
+			b = (uint8_t)rng();
+
+		std::string name = "module" + std::to_string(i);
+		mod.filename = utf8_to_utf16("/build/" + name + ".pdb");
+		mod.timestamp = (uint32_t)rng();
+
+		// A CodeView RSDS record: signature, guid, age and the PDB path.
+		static char const rsds[] = { 'R', 'S', 'D', 'S' };
+		mod.cv.assign(rsds, rsds + 4);
+		mod.cv.insert(mod.cv.end(), mod.id.data, mod.id.data + 16);
+		mod.cv.insert(mod.cv.end(), { 1, 0, 0, 0 });
+		std::string path = utf16_to_utf8(mod.filename);
+		mod.cv.insert(mod.cv.end(), path.begin(), path.end());
+		mod.cv.push_back(0);
+
+		mod.lines.filename = mod.filename;
+
+		line_table & lt = mod.lines.lines;
+		size_t file_count = (std::max)(addrs / (std::max)(addrs_per_file, (size_t)1), (size_t)1);
+		for (size_t j = 0; j < file_count; ++j)
+			lt.files.push_back("/src/" + name + "/file" + std::to_string(j) + ".cpp");
+
+		lt.rows.reserve(addrs);
+		uint64_t addr = 0x1000;
+		uint32_t file = 0;
+		uint32_t line = 1;
+		while (lt.rows.size() < addrs)
+		{
+			size_t file_end = (size_t)(file + 1) * addrs / file_count;
+			size_t per_line = 1 + rng() % 3;
+			for (size_t k = 0; k < per_line && lt.rows.size() < addrs; ++k)
+			{
+				line_table_row row = { addr, file, line };
+				lt.rows.push_back(row);
+				addr += 1 + rng() % 8;
+			}
+
+			line += 1 + (uint32_t)(rng() % 4);
+			if (lt.rows.size() >= file_end && file + 1 < file_count)
+			{
+				++file;
+				line = 1;
+			}
+		}
+
+		mod.image_size = (uint32_t)(addr + 0x1000);
+	}
+
+	return res;
+}
+
+// Makes the coverage of one run of `prog`, covering each line address
+// with probability `density`. If `with_hits` is set, the covered
+// addresses get hit counts as with `capture --sample`.
+inline coverage_info make_run(synthetic_program const & prog, double density, uint64_t seed, bool with_hits = false)
+{
+	std::mt19937_64 rng(seed);
+	uint64_t threshold = density >= 1? UINT64_MAX: (uint64_t)(density * 18446744073709551616.0);
+
+	coverage_info ci;
+	for (synthetic_module const & mod: prog.modules)
+	{
+		pdb_coverage_info & pci = ci.pdbs[mod.id];
+		pci.filename = mod.filename;
+		pci.image_size = mod.image_size;
+		pci.timestamp = mod.timestamp;
+		pci.cv = mod.cv;
+
+		std::vector<line_table_row> const & rows = mod.lines.lines.rows;
+		pci.addrs_covered.reserve((size_t)(rows.size() * density) + 16);
+		for (line_table_row const & row: rows)
+		{
+			if (rng() > threshold)
+				continue;
+
+			pci.addrs_covered.push_back(row.address);
+			if (with_hits)
+				pci.hit_counts.push_back(1 + (uint32_t)(rng() % 1000));
+		}
+	}
+
+	return ci;
+}
+
+// Stores the line tables of `prog` into the line cache at `cache_dir`,
+// where `report_options::cache_dir` picks them up.
+inline bool store_program_lines(synthetic_program const & prog, std::wstring const & cache_dir)
+{
+	for (synthetic_module const & mod: prog.modules)
+	{
+		if (!store_line_cache(cache_dir, mod.id, mod.cv, mod.lines))
+			return false;
+	}
+
+	return true;
+}
+
+#endif // BENCH_SYNTHETIC_COVERAGE_H
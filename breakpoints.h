@@ -0,0 +1,748 @@
+#ifndef BREAKPOINTS_H
+#define BREAKPOINTS_H
+
+#include "debugger_loop.h"
+#include "stats.h"
+#include "guid.h"
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <chrono>
+#include <ostream>
+#include <cassert>
+#include <stdint.h>
+
+// The one-shot breakpoint state shared by the capture backends.
+//
+// `Process` identifies a debuggee (a `HANDLE` on Windows, a pid on Linux).
+// Memory is accessed through an object providing
+//
+//     bool read(Process p, uint64_t addr, uint8_t * buf, size_t size);
+//     bool write(Process p, uint64_t addr, uint8_t const * buf, size_t size);
+template <typename Process>
+struct breakpoints
+{
+	// What one process image covered of one module, with per-process
+	// coverage; parallel to `pdb_info::offsets`.
+	struct process_state
+	{
+		std::vector<bool> covered;
+		std::vector<uint32_t> hits;
+	};
+
+	struct pdb_info
+	{
+		uint32_t image_size;
+		uint32_t timestamp;
+		std::wstring filename;
+		std::vector<uint8_t> cv;
+		std::map<Process, uint64_t> processes;
+
+		// The breakpoint addresses as sorted offsets into the image,
+		// with the per-address state in parallel arrays.
+		std::vector<uint64_t> offsets;
+		std::vector<uint8_t> orig_bytes;
+		std::vector<bool> covered;
+
+		// How many times each address was hit, if hits are counted;
+		// empty otherwise. Allocated when the module is first armed.
+		std::vector<uint32_t> hits;
+
+		// Addresses that are to be armed in every process the module
+		// is loaded into; cleared for the body of lazily armed functions.
+		std::vector<bool> armed;
+
+		// Lazily armed functions as [entry, last) ranges of indices into
+		// `offsets`, sorted by entry.
+		std::vector<std::pair<size_t, size_t>> functions;
+
+		// If breakpoints are set on block leaders only, the lines of
+		// the block led by `offsets[i]` are the range of `block_lines`
+		// starting at `block_starts[i]` and ending at `block_starts[i + 1]`.
+		std::vector<uint64_t> block_lines;
+		std::vector<size_t> block_starts;
+
+		// With per-process coverage, the state of each process image
+		// the module was loaded into, keyed by its index into
+		// `breakpoints::process_records`.
+		std::map<size_t, process_state> process_coverage;
+
+		static size_t const npos = ~(size_t)0;
+
+		// Takes the (unsorted, possibly repeated) breakpoint offsets.
+		void set_offsets(std::vector<uint64_t> offs)
+		{
+			std::sort(offs.begin(), offs.end());
+			offs.erase(std::unique(offs.begin(), offs.end()), offs.end());
+
+			offsets = std::move(offs);
+			orig_bytes.assign(offsets.size(), 0);
+			covered.assign(offsets.size(), false);
+			hits.clear();
+			armed.assign(offsets.size(), true);
+			functions.clear();
+			block_lines.clear();
+			block_starts.clear();
+		}
+
+		// Takes the sorted (leader, line) pairs of `find_basic_blocks`
+		// and sets breakpoints on the leaders only.
+		void set_blocks(std::vector<std::pair<uint64_t, uint64_t>> const & blocks)
+		{
+			std::vector<uint64_t> leaders;
+			for (auto const & block: blocks)
+				leaders.push_back(block.first);
+			this->set_offsets(std::move(leaders));
+
+			block_lines.reserve(blocks.size());
+			block_starts.reserve(offsets.size() + 1);
+			for (size_t i = 0; i < blocks.size(); ++i)
+			{
+				if (i == 0 || blocks[i].first != blocks[i - 1].first)
+					block_starts.push_back(block_lines.size());
+				block_lines.push_back(blocks[i].second);
+			}
+			block_starts.push_back(block_lines.size());
+		}
+
+		// The number of lines the breakpoints stand for.
+		size_t line_count() const
+		{
+			return block_starts.empty()? offsets.size(): block_lines.size();
+		}
+
+		// Defers arming the body of each of the [first, last) offset ranges
+		// in `funcs` until its first address is hit. Functions whose entry
+		// has no breakpoint, or which overlap a previous one, stay armed.
+		void set_functions(std::vector<std::pair<uint64_t, uint64_t>> funcs)
+		{
+			std::sort(funcs.begin(), funcs.end());
+
+			uint64_t prev_last = 0;
+			for (auto const & fn: funcs)
+			{
+				if (fn.first < prev_last)
+					continue;
+
+				size_t entry = this->find(fn.first);
+				if (entry == npos)
+					continue;
+
+				size_t last = std::lower_bound(offsets.begin(), offsets.end(), fn.second) - offsets.begin();
+				prev_last = fn.second;
+
+				if (last - entry <= 1)
+					continue;
+
+				functions.push_back(std::make_pair(entry, last));
+				for (size_t i = entry + 1; i < last; ++i)
+					armed[i] = false;
+			}
+		}
+
+		size_t find(uint64_t offset) const
+		{
+			auto it = std::lower_bound(offsets.begin(), offsets.end(), offset);
+			if (it == offsets.end() || *it != offset)
+				return npos;
+			return it - offsets.begin();
+		}
+
+		// Appends the line addresses that `cov` marks as covered to `addrs`
+		// and, if `with_hits` is set, their counts in `counts` to `hit_counts`.
+		// A covered leader covers its whole block.
+		void get_lines(std::vector<bool> const & cov, std::vector<uint32_t> const & counts, bool with_hits,
+			std::vector<uint64_t> & addrs, std::vector<uint32_t> & hit_counts) const
+		{
+			for (size_t i = 0; i < offsets.size(); ++i)
+			{
+				if (!cov[i])
+					continue;
+
+				size_t first = i, last = i + 1;
+				if (!block_starts.empty())
+				{
+					first = block_starts[i];
+					last = block_starts[i + 1];
+				}
+
+				for (size_t j = first; j < last; ++j)
+				{
+					addrs.push_back(block_starts.empty()? offsets[j]: block_lines[j]);
+					if (with_hits)
+						hit_counts.push_back(counts[i]);
+				}
+			}
+		}
+	};
+
+	// A module mapped into a process, occupying [base, base + image_size).
+	struct module_range
+	{
+		uint64_t base;
+		pdb_info * pi;
+
+		// The module's state in the process, with per-process coverage.
+		process_state * state;
+
+		friend bool operator<(module_range const & lhs, module_range const & rhs)
+		{
+			return lhs.base < rhs.base;
+		}
+	};
+
+	static uint64_t const page_size = 0x1000;
+
+	std::map<guid, pdb_info> pdbs;
+
+	// If set, arming times are reported here.
+	std::wostream * log;
+
+	// If set, breakpoints armed and pages patched are counted there,
+	// and arming is timed.
+	run_stats * stats;
+
+	// If set, the backends defer arming function bodies
+	// until the function is entered, see `pdb_info::set_functions`.
+	bool lazy;
+
+	// If set, every hit is counted and the breakpoints that were hit are
+	// queued for `rearm`.
+	bool count_hits;
+
+	// If set, each process image keeps its own coverage, and a hit only
+	// removes the breakpoint from the process that hit it. The backends
+	// must call `start_process` for every process and after every exec.
+	bool per_process;
+
+	// A breakpoint hit since the last call to `rearm`, in process `p`.
+	struct rearm_entry
+	{
+		pdb_info * pi;
+		size_t index;
+		Process p;
+	};
+
+	std::vector<rearm_entry> rearm_queue;
+
+	// A process from its creation or exec to its exit or next exec.
+	struct process_record
+	{
+		uint32_t pid;
+		std::wstring image;
+		std::wstring cmdline;
+	};
+
+	// With per-process coverage, every process image seen so far and
+	// the index of the current image of each live process.
+	std::vector<process_record> process_records;
+	std::map<Process, size_t> process_ids;
+
+	breakpoints()
+		: log(nullptr), stats(nullptr), lazy(false), count_hits(false), per_process(false)
+	{
+	}
+
+	// The modules of each process, sorted by base address.
+	std::map<Process, std::vector<module_range>> modules;
+
+	// Records that `pi` is mapped at `base` in process `p`.
+	void add_module(Process p, uint64_t base, pdb_info & pi, process_state * state)
+	{
+		std::vector<module_range> & mods = modules[p];
+
+		module_range mod = { base, &pi, state };
+		mods.insert(std::upper_bound(mods.begin(), mods.end(), mod), mod);
+	}
+
+	// Starts a new process record for `p`; coverage of the modules `p`
+	// loads from now on is attributed to it.
+	void start_process(Process p, uint32_t pid, std::wstring image, std::wstring cmdline)
+	{
+		process_record rec = { pid, std::move(image), std::move(cmdline) };
+		process_ids[p] = process_records.size();
+		process_records.push_back(std::move(rec));
+	}
+
+	// Returns the state of `pi` in `p`, or null without per-process coverage.
+	process_state * get_state(Process p, pdb_info & pi)
+	{
+		if (!per_process)
+			return nullptr;
+
+		auto it = process_ids.find(p);
+		if (it == process_ids.end())
+		{
+			this->start_process(p, 0, std::wstring(), std::wstring());
+			it = process_ids.find(p);
+		}
+
+		process_state & state = pi.process_coverage[it->second];
+		if (state.covered.size() != pi.offsets.size())
+		{
+			state.covered.assign(pi.offsets.size(), false);
+			if (count_hits)
+				state.hits.assign(pi.offsets.size(), 0);
+		}
+		return &state;
+	}
+
+	// Arms a breakpoint on every address of `pi` that hasn't been covered
+	// yet in the module mapped at `base` in process `p`.
+	//
+	// A module is tracked at a single base in each process, so if a process
+	// maps the same module twice, e.g. by loading one library from two paths,
+	// only the first mapping is armed and the second one is left alone.
+	template <typename Memory>
+	void arm(Memory & mem, Process p, pdb_info & pi, uint64_t base, bool orig_bytes_known)
+	{
+		if (pi.processes.find(p) != pi.processes.end())
+		{
+			if (log)
+				*log << pi.filename << L": already mapped in this process, not armed again\n";
+			return;
+		}
+
+		pi.processes[p] = base;
+
+		if (count_hits && pi.hits.size() != pi.offsets.size())
+			pi.hits.assign(pi.offsets.size(), 0);
+
+		process_state * state = this->get_state(p, pi);
+		this->add_module(p, base, pi, state);
+
+		std::vector<bool> const & covered = state? state->covered: pi.covered;
+
+		auto start_time = std::chrono::steady_clock::now();
+		size_t pages = 0;
+		size_t armed = this->patch(mem, p, pi, base, 0, pi.offsets.size(), covered, orig_bytes_known, pages);
+		auto end_time = std::chrono::steady_clock::now();
+
+		if (stats)
+		{
+			stats->count(counter_modules_armed);
+			stats->count(counter_breakpoints_armed, armed);
+			stats->count(counter_pages_patched, pages);
+			stats->time("arm", start_time, end_time, pi.filename);
+		}
+
+		if (log)
+		{
+			std::chrono::duration<double, std::milli> elapsed = end_time - start_time;
+			*log << pi.filename << L": armed " << armed << L" breakpoints on " << pages << L" pages in "
+				<< elapsed.count() << L" ms";
+			if (!pi.block_starts.empty())
+				*log << L" for " << pi.line_count() << L" lines";
+			if (!pi.functions.empty())
+				*log << L", deferred " << pi.functions.size() << L" functions";
+			*log << L"\n";
+		}
+	}
+
+	// Handles a breakpoint exception at `addr`. Returns true if the breakpoint
+	// was ours and the original instruction has been restored; the caller must
+	// then rewind the instruction pointer.
+	template <typename Memory>
+	bool hit(Memory & mem, Process p, uint64_t addr)
+	{
+		module_range const * mod = this->find_module(p, addr);
+		if (!mod)
+			return false;
+
+		pdb_info * pi = mod->pi;
+		uint64_t offset = addr - mod->base;
+
+		size_t idx = pi->find(offset);
+		if (idx == pdb_info::npos)
+			return false;
+
+		process_state * state = mod->state;
+
+		pi->covered[idx] = true;
+		if (state)
+			state->covered[idx] = true;
+		this->expand(mem, *pi, idx);
+
+		uint8_t orig_byte = pi->orig_bytes[idx];
+		if (orig_byte == 0xcc)
+			return false;
+
+		if (count_hits)
+		{
+			if (pi->hits[idx] != UINT32_MAX)
+				++pi->hits[idx];
+			if (state && state->hits[idx] != UINT32_MAX)
+				++state->hits[idx];
+
+			rearm_entry entry = { pi, idx, p };
+			rearm_queue.push_back(entry);
+		}
+
+		if (state)
+		{
+			mem.write(p, addr, &orig_byte, 1);
+		}
+		else
+		{
+			for (auto process_base: pi->processes)
+				mem.write(process_base.first, process_base.second + offset, &orig_byte, 1);
+		}
+
+		return true;
+	}
+
+	// Arms the body of the lazily armed function entered at index `entry`
+	// in every process that has the module loaded.
+	template <typename Memory>
+	void expand(Memory & mem, pdb_info & pi, size_t entry)
+	{
+		auto it = std::lower_bound(pi.functions.begin(), pi.functions.end(), std::make_pair(entry, (size_t)0));
+		if (it == pi.functions.end() || it->first != entry || pi.armed[entry + 1])
+			return;
+
+		for (size_t i = it->first + 1; i < it->second; ++i)
+			pi.armed[i] = true;
+
+		bool orig_bytes_known = false;
+		for (auto process_base: pi.processes)
+		{
+			module_range const * mod = this->find_module(process_base.first, process_base.second);
+			std::vector<bool> const & covered = mod && mod->state? mod->state->covered: pi.covered;
+
+			size_t pages = 0;
+			size_t armed = this->patch(mem, process_base.first, pi, process_base.second, it->first + 1, it->second, covered, orig_bytes_known, pages);
+			orig_bytes_known = true;
+
+			if (stats)
+			{
+				stats->count(counter_breakpoints_armed, armed);
+				stats->count(counter_pages_patched, pages);
+			}
+		}
+
+		if (stats)
+			stats->count(counter_functions_expanded);
+	}
+
+	// Puts the breakpoints hit since the last call back in place in every
+	// process, or with per-process coverage in the process that hit them,
+	// so that their next hit is counted too. Processes that are gone are
+	// skipped.
+	template <typename Memory>
+	void rearm(Memory & mem)
+	{
+		if (stats)
+			stats->count(counter_breakpoints_rearmed, rearm_queue.size());
+
+		uint8_t const int3 = 0xcc;
+		for (auto const & entry: rearm_queue)
+		{
+			pdb_info & pi = *entry.pi;
+			uint64_t offset = pi.offsets[entry.index];
+
+			if (per_process)
+			{
+				auto it = pi.processes.find(entry.p);
+				if (it != pi.processes.end())
+					mem.write(it->first, it->second + offset, &int3, 1);
+				continue;
+			}
+
+			for (auto process_base: pi.processes)
+				mem.write(process_base.first, process_base.second + offset, &int3, 1);
+		}
+		rearm_queue.clear();
+	}
+
+	// Registers `child` as a copy of `parent`, as happens after a fork.
+	// The child's memory already holds the parent's breakpoints; with
+	// per-process coverage, the ones the parent has hit are put back,
+	// so that the child's own hits are seen.
+	template <typename Memory>
+	void clone_process(Memory & mem, Process parent, Process child)
+	{
+		for (auto && pdb_kv: pdbs)
+		{
+			pdb_info & pi = pdb_kv.second;
+
+			auto it = pi.processes.find(parent);
+			if (it == pi.processes.end())
+				continue;
+
+			pi.processes[child] = it->second;
+		}
+
+		auto mod_it = modules.find(parent);
+		if (mod_it == modules.end())
+			return;
+
+		// Like in `rearm`, writes to images that are gone are ignored.
+		uint8_t const int3 = 0xcc;
+
+		std::vector<module_range> mods = mod_it->second;
+		for (module_range & mod: mods)
+		{
+			if (!mod.state)
+				continue;
+
+			pdb_info & pi = *mod.pi;
+			process_state const & parent_state = *mod.state;
+			mod.state = this->get_state(child, pi);
+
+			for (size_t i = 0; i < pi.offsets.size(); ++i)
+			{
+				if (parent_state.covered[i] && pi.armed[i] && pi.orig_bytes[i] != 0xcc)
+					mem.write(child, mod.base + pi.offsets[i], &int3, 1);
+			}
+		}
+
+		modules[child] = std::move(mods);
+	}
+
+	// Forgets all modules mapped into `p`, without touching its memory.
+	// The coverage of its process record is kept.
+	void remove_process(Process p)
+	{
+		auto mod_it = modules.find(p);
+		if (mod_it != modules.end())
+		{
+			for (module_range const & mod: mod_it->second)
+				mod.pi->processes.erase(p);
+			modules.erase(mod_it);
+		}
+
+		process_ids.erase(p);
+	}
+
+	// Forgets the module mapped at `base` in `p`, as it's being unmapped,
+	// without touching its memory. The coverage gathered so far is kept,
+	// and the module is armed anew if it gets mapped again.
+	void remove_module(Process p, uint64_t base)
+	{
+		auto mod_it = modules.find(p);
+		if (mod_it == modules.end())
+			return;
+
+		std::vector<module_range> & mods = mod_it->second;
+
+		module_range key = { base, nullptr, nullptr };
+		auto it = std::lower_bound(mods.begin(), mods.end(), key);
+		if (it == mods.end() || it->base != base)
+			return;
+
+		auto proc_it = it->pi->processes.find(p);
+		if (proc_it != it->pi->processes.end() && proc_it->second == base)
+			it->pi->processes.erase(proc_it);
+
+		mods.erase(it);
+	}
+
+	// Puts the original bytes back at every armed address of the modules
+	// mapped into `p`, so that it can run on without us, a page at a time
+	// like `patch`. The modules stay registered, but won't trap anymore.
+	// Images that are gone are skipped.
+	template <typename Memory>
+	void disarm(Memory & mem, Process p)
+	{
+		auto mod_it = modules.find(p);
+		if (mod_it == modules.end())
+			return;
+
+		std::vector<uint8_t> buf;
+		for (module_range const & mod: mod_it->second)
+		{
+			pdb_info const & pi = *mod.pi;
+
+			size_t i = 0;
+			while (i < pi.offsets.size())
+			{
+				if (!pi.armed[i])
+				{
+					++i;
+					continue;
+				}
+
+				uint64_t span_first = mod.base + pi.offsets[i];
+				uint64_t page_end = (span_first | (page_size - 1)) + 1;
+
+				size_t page_first = i;
+				size_t page_last = i;
+				for (; i < pi.offsets.size() && mod.base + pi.offsets[i] < page_end; ++i)
+				{
+					if (pi.armed[i])
+						page_last = i;
+				}
+
+				uint64_t span_last = mod.base + pi.offsets[page_last] + 1;
+
+				buf.resize((size_t)(span_last - span_first));
+				if (!mem.read(p, span_first, buf.data(), buf.size()))
+					continue;
+
+				for (size_t j = page_first; j <= page_last; ++j)
+				{
+					if (pi.armed[j] && pi.orig_bytes[j] != 0xcc)
+						buf[(size_t)(mod.base + pi.offsets[j] - span_first)] = pi.orig_bytes[j];
+				}
+
+				mem.write(p, span_first, buf.data(), buf.size());
+			}
+		}
+	}
+
+	// Returns true if `addr` in `p` is the address of one of our
+	// breakpoints, without handling it like `hit` would.
+	bool owns(Process p, uint64_t addr) const
+	{
+		module_range const * mod = this->find_module(p, addr);
+		if (!mod)
+			return false;
+
+		size_t idx = mod->pi->find(addr - mod->base);
+		return idx != pdb_info::npos && mod->pi->armed[idx] && mod->pi->orig_bytes[idx] != 0xcc;
+	}
+
+	// Writes a breakpoint to each armed address of `pi` with index in
+	// [first, last) that isn't marked in `covered`, in the module mapped
+	// at `base` in process `p`. Returns the number of breakpoints and adds
+	// the number of pages touched to `pages`.
+	//
+	// The addresses are patched a page at a time: the span of each page
+	// holding breakpoints is read with one call, patched locally and written
+	// back with another.
+	//
+	// The module may be unmapped, or the process may exit, while we're at it,
+	// so spans that can't be read or written are skipped and counted as
+	// `patch_failures`. If their original bytes weren't known, they're marked
+	// as int3s of the program's own, so that nothing is restored over them.
+	template <typename Memory>
+	size_t patch(Memory & mem, Process p, pdb_info & pi, uint64_t base, size_t first, size_t last,
+		std::vector<bool> const & covered, bool orig_bytes_known, size_t & pages)
+	{
+		size_t armed = 0;
+		std::vector<uint8_t> buf;
+
+		size_t i = first;
+		while (i < last)
+		{
+			if (covered[i] || !pi.armed[i])
+			{
+				++i;
+				continue;
+			}
+
+			// Find the addresses to patch sharing a page with the current one.
+			uint64_t span_first = base + pi.offsets[i];
+			uint64_t page_end = (span_first | (page_size - 1)) + 1;
+
+			size_t page_first = i;
+			size_t page_last = i;
+			for (; i < last && base + pi.offsets[i] < page_end; ++i)
+			{
+				if (!covered[i] && pi.armed[i])
+					page_last = i;
+			}
+
+			uint64_t span_last = base + pi.offsets[page_last] + 1;
+
+			buf.resize((size_t)(span_last - span_first));
+			if (!mem.read(p, span_first, buf.data(), buf.size()))
+			{
+				if (!orig_bytes_known)
+				{
+					for (size_t j = page_first; j <= page_last; ++j)
+					{
+						if (!covered[j] && pi.armed[j])
+							pi.orig_bytes[j] = 0xcc;
+					}
+				}
+
+				if (stats)
+					stats->count(counter_patch_failures);
+				continue;
+			}
+
+			bool dirty = false;
+			size_t span_armed = 0;
+			for (size_t j = page_first; j <= page_last; ++j)
+			{
+				if (covered[j] || !pi.armed[j])
+					continue;
+
+				uint8_t & byte = buf[(size_t)(base + pi.offsets[j] - span_first)];
+
+				// Spans that couldn't be read before have 0xcc for original bytes.
+				assert(!orig_bytes_known || byte == pi.orig_bytes[j] || pi.orig_bytes[j] == 0xcc);
+				pi.orig_bytes[j] = byte;
+
+				if (byte != 0xcc)
+				{
+					byte = 0xcc;
+					dirty = true;
+				}
+
+				++span_armed;
+			}
+
+			if (dirty && !mem.write(p, span_first, buf.data(), buf.size()))
+			{
+				if (stats)
+					stats->count(counter_patch_failures);
+				continue;
+			}
+
+			armed += span_armed;
+			++pages;
+		}
+
+		return armed;
+	}
+
+	// Finds the module of `p` containing `addr`, if any.
+	module_range const * find_module(Process p, uint64_t addr) const
+	{
+		auto mod_it = modules.find(p);
+		if (mod_it == modules.end())
+			return nullptr;
+
+		std::vector<module_range> const & mods = mod_it->second;
+
+		module_range key = { addr, nullptr, nullptr };
+		auto it = std::upper_bound(mods.begin(), mods.end(), key);
+		if (it == mods.begin() || addr - it[-1].base >= it[-1].pi->image_size)
+			return nullptr;
+		return &it[-1];
+	}
+
+	coverage_info get_coverage()
+	{
+		coverage_info ci;
+		for (auto && pdb_kv: pdbs)
+		{
+			pdb_coverage_info & pdb_info = ci.pdbs[pdb_kv.first];
+			pdb_info.image_size = pdb_kv.second.image_size;
+			pdb_info.timestamp = pdb_kv.second.timestamp;
+			pdb_info.filename = pdb_kv.second.filename;
+			pdb_info.cv = pdb_kv.second.cv;
+
+			auto const & pi = pdb_kv.second;
+			pi.get_lines(pi.covered, pi.hits, count_hits, pdb_info.addrs_covered, pdb_info.hit_counts);
+
+			for (auto const & state_kv: pi.process_coverage)
+			{
+				process_record const & rec = process_records[state_kv.first];
+
+				process_coverage_info pci;
+				pci.pid = rec.pid;
+				pci.image = rec.image;
+				pci.cmdline = rec.cmdline;
+				pi.get_lines(state_kv.second.covered, state_kv.second.hits, count_hits, pci.addrs_covered, pci.hit_counts);
+				pdb_info.processes.push_back(std::move(pci));
+			}
+		}
+		return ci;
+	}
+};
+
+#endif // BREAKPOINTS_H
@@ -64,3 +64,22 @@ std::wstring win_split_cmdline_arg(wstring_view & cmdline)
 	cmdline = wstring_view();
 	return res;
 }
+
+void win_append_cmdline_arg(std::wstring & cmdline, wstring_view arg)
+{
+	if (!cmdline.empty())
+		cmdline.push_back(' ');
+
+	if (arg.empty())
+	{
+		cmdline.append(L"\"\"");
+		return;
+	}
+
+	for (wchar_t ch: arg)
+	{
+		if (ch == ' ' || ch == '\t' || ch == '"' || ch == '^')
+			cmdline.push_back('^');
+		cmdline.push_back(ch);
+	}
+}
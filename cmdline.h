@@ -6,4 +6,8 @@
 
 std::wstring win_split_cmdline_arg(wstring_view & cmdline);
 
+// Appends `arg` to `cmdline` such that `win_split_cmdline_arg`
+// will recover it unchanged.
+void win_append_cmdline_arg(std::wstring & cmdline, wstring_view arg);
+
 #endif // CMDLINE_H
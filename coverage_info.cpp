@@ -1,14 +1,637 @@
 #include "json.h"
 #include "debugger_loop.h"
+#include "mapped_file.h"
 #include "utf.h"
 #include "utils.h"
+#include "parallel.h"
+#include <fstream>
+#include <iterator>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 
-coverage_info coverage_info::load(std::istream & in)
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define COVERAGE_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// The binary format starts with a header and an index of modules; the
+// index entries point to the module metadata (the UTF-8 filename followed
+// by the CodeView record) and to the encoded covered addresses. All
+// integers are little-endian, and the index and the address data are
+// aligned to eight bytes so that the file can be used in place.
+//
+// Covered addresses are stored either as LEB128-encoded deltas between
+// consecutive addresses, or as a bitmap: the first address followed
+// by 64-bit words whose bit `i` stands for `first + i`. If the module
+// has run counts, they follow the addresses as 16-bit integers, and hit
+// counts follow as 32-bit integers.
+//
+// If the module was captured per process, the counts are followed by
+// a 64-bit process count and as many `binary_process` entries; each points
+// to the UTF-8 image path and command line of the process and to its
+// addresses, which are encoded like the module's, and hit counts.
+struct binary_header
+{
+	uint8_t magic[8];
+	uint32_t version;
+	uint32_t module_count;
+};
+
+struct binary_module
+{
+	uint8_t guid[16];
+	uint32_t image_size;
+	uint32_t timestamp;
+	uint64_t meta_offset;
+	uint32_t filename_size;
+	uint32_t cv_size;
+	uint64_t covered_offset;
+	uint64_t covered_size;
+	uint64_t addr_count;
+	uint32_t encoding;
+	uint32_t flags;
+};
+
+struct binary_process
+{
+	uint32_t pid;
+	uint32_t flags;
+	uint64_t meta_offset;
+	uint32_t image_size;
+	uint32_t cmdline_size;
+	uint64_t covered_offset;
+	uint64_t covered_size;
+	uint64_t addr_count;
+	uint32_t encoding;
+	uint32_t reserved;
+};
+
+// The first byte can't start a JSON document.
+static uint8_t const binary_magic[8] = { 0x89, 'c', 'c', 'o', 'v', '\r', '\n', 0x1a };
+static uint32_t const binary_version = 1;
+
+enum
+{
+	encoding_delta_varint = 0,
+	encoding_bitmap = 1,
+};
+
+enum
+{
+	module_has_run_counts = 1,
+	module_has_hit_counts = 2,
+	module_has_processes = 4,
+};
+
+static uint64_t align8(uint64_t n)
+{
+	return (n + 7) & ~7ull;
+}
+
+static void put_varint(std::vector<uint8_t> & out, uint64_t v)
+{
+	while (v >= 0x80)
+	{
+		out.push_back((uint8_t)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((uint8_t)v);
+}
+
+template <typename T>
+void append_pod(std::vector<uint8_t> & out, T const & v)
+{
+	uint8_t const * p = (uint8_t const *)&v;
+	out.insert(out.end(), p, p + sizeof v);
+}
+
+// Encodes sorted addresses with whichever encoding is smaller.
+static std::vector<uint8_t> encode_addrs(std::vector<uint64_t> const & addrs, uint32_t & encoding)
+{
+	std::vector<uint8_t> res;
+
+	uint64_t prev = 0;
+	for (uint64_t addr: addrs)
+	{
+		put_varint(res, addr - prev);
+		prev = addr;
+	}
+	encoding = encoding_delta_varint;
+
+	if (!addrs.empty())
+	{
+		uint64_t span = addrs.back() - addrs.front();
+		if (span / 8 + 16 < res.size())
+		{
+			std::vector<uint64_t> words((size_t)(span / 64 + 1));
+			for (uint64_t addr: addrs)
+			{
+				uint64_t bit = addr - addrs.front();
+				words[(size_t)(bit / 64)] |= 1ull << (bit % 64);
+			}
+
+			res.clear();
+			append_pod(res, addrs.front());
+			for (uint64_t word: words)
+				append_pod(res, word);
+			encoding = encoding_bitmap;
+		}
+	}
+
+	return res;
+}
+
+static void decode_addrs(uint8_t const * p, uint64_t size, uint32_t encoding, uint64_t count, std::vector<uint64_t> & addrs)
+{
+	if (count > size * 64)
+		throw std::runtime_error("invalid coverage file");
+	addrs.reserve((size_t)count);
+
+	if (encoding == encoding_delta_varint)
+	{
+		uint8_t const * last = p + size;
+		uint64_t addr = 0;
+		while (p != last)
+		{
+			uint64_t delta = 0;
+			for (int shift = 0;; shift += 7)
+			{
+				if (p == last || shift >= 64)
+					throw std::runtime_error("invalid coverage file");
+
+				uint8_t b = *p++;
+				delta |= (uint64_t)(b & 0x7f) << shift;
+				if ((b & 0x80) == 0)
+					break;
+			}
+
+			addr += delta;
+			addrs.push_back(addr);
+		}
+	}
+	else if (encoding == encoding_bitmap)
+	{
+		if (size < 8 || size % 8 != 0)
+			throw std::runtime_error("invalid coverage file");
+
+		uint64_t first;
+		memcpy(&first, p, 8);
+
+		for (uint64_t i = 1; i < size / 8; ++i)
+		{
+			uint64_t word;
+			memcpy(&word, p + i * 8, 8);
+
+			if (word == 0)
+				continue;
+
+			for (unsigned bit = 0; bit < 64; ++bit)
+			{
+				if (word & (1ull << bit))
+					addrs.push_back(first + (i - 1) * 64 + bit);
+			}
+		}
+	}
+	else
+	{
+		throw std::runtime_error("unknown address encoding in coverage file");
+	}
+
+	if (addrs.size() != count)
+		throw std::runtime_error("invalid coverage file");
+}
+
+// Merges sorted address lists into one, dropping duplicates.
+static std::vector<uint64_t> merge_addrs(std::vector<std::vector<uint64_t> const *> const & lists)
+{
+	size_t total = 0;
+	uint64_t lo = UINT64_MAX;
+	uint64_t hi = 0;
+	for (std::vector<uint64_t> const * addrs: lists)
+	{
+		if (addrs->empty())
+			continue;
+
+		total += addrs->size();
+		lo = (std::min)(lo, addrs->front());
+		hi = (std::max)(hi, addrs->back());
+	}
+
+	std::vector<uint64_t> res;
+	if (total == 0)
+		return res;
+
+	// Dense inputs are cheaper to OR into a bitmap than to compare.
+	if ((hi - lo) / 64 <= total)
+	{
+		std::vector<uint64_t> words((size_t)((hi - lo) / 64 + 1));
+		for (std::vector<uint64_t> const * addrs: lists)
+		{
+			for (uint64_t addr: *addrs)
+				words[(size_t)((addr - lo) / 64)] |= 1ull << ((addr - lo) % 64);
+		}
+
+		for (size_t i = 0; i < words.size(); ++i)
+		{
+			uint64_t word = words[i];
+			if (word == 0)
+				continue;
+
+			for (unsigned bit = 0; bit < 64; ++bit)
+			{
+				if (word & (1ull << bit))
+					res.push_back(lo + i * 64 + bit);
+			}
+		}
+
+		return res;
+	}
+
+	struct cursor
+	{
+		uint64_t const * cur;
+		uint64_t const * last;
+
+		bool operator<(cursor const & rhs) const
+		{
+			// Makes the heap a min-heap.
+			return *cur > *rhs.cur;
+		}
+	};
+
+	std::vector<cursor> heap;
+	for (std::vector<uint64_t> const * addrs: lists)
+	{
+		if (!addrs->empty())
+		{
+			cursor c = { addrs->data(), addrs->data() + addrs->size() };
+			heap.push_back(c);
+		}
+	}
+	std::make_heap(heap.begin(), heap.end());
+
+	res.reserve(total);
+	while (!heap.empty())
+	{
+		std::pop_heap(heap.begin(), heap.end());
+		cursor & c = heap.back();
+		if (res.empty() || res.back() != *c.cur)
+			res.push_back(*c.cur);
+
+		if (++c.cur == c.last)
+			heap.pop_back();
+		else
+			std::push_heap(heap.begin(), heap.end());
+	}
+
+	return res;
+}
+
+static uint16_t add_runs(uint16_t lhs, uint32_t rhs)
+{
+	uint32_t res = lhs + rhs;
+	return res > 0xffff? 0xffff: (uint16_t)res;
+}
+
+// Adds `batch` to `totals`, saturating.
+static void add_batch(uint16_t * totals, uint8_t const * batch, size_t size)
+{
+	size_t i = 0;
+
+#ifdef COVERAGE_SSE2
+	__m128i const zero = _mm_setzero_si128();
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i b = _mm_loadu_si128((__m128i const *)(batch + i));
+		__m128i lo = _mm_loadu_si128((__m128i const *)(totals + i));
+		__m128i hi = _mm_loadu_si128((__m128i const *)(totals + i + 8));
+		_mm_storeu_si128((__m128i *)(totals + i), _mm_adds_epu16(lo, _mm_unpacklo_epi8(b, zero)));
+		_mm_storeu_si128((__m128i *)(totals + i + 8), _mm_adds_epu16(hi, _mm_unpackhi_epi8(b, zero)));
+	}
+#endif
+
+	for (; i < size; ++i)
+		totals[i] = add_runs(totals[i], batch[i]);
+}
+
+// Like `merge_addrs`, but also sums up how many runs covered each address.
+// Inputs without run counts stand for a single run.
+static void merge_runs(std::vector<pdb_coverage_info const *> const & src, std::vector<uint64_t> & addrs, std::vector<uint16_t> & counts)
+{
+	size_t total = 0;
+	uint64_t lo = UINT64_MAX;
+	uint64_t hi = 0;
+	for (pdb_coverage_info const * pci: src)
+	{
+		if (pci->addrs_covered.empty())
+			continue;
+
+		total += pci->addrs_covered.size();
+		lo = (std::min)(lo, pci->addrs_covered.front());
+		hi = (std::max)(hi, pci->addrs_covered.back());
+	}
+
+	if (total == 0)
+		return;
+
+	// For dense inputs, keep a counter for every address in the span. Single
+	// runs are counted in bytes first, which can't overflow for 255 runs
+	// and take a plain increment, and the bytes are added to the totals
+	// in bulk.
+	if ((hi - lo) / 8 <= total)
+	{
+		size_t span = (size_t)(hi - lo + 1);
+		std::vector<uint16_t> totals(span);
+		std::vector<uint8_t> batch(span);
+		size_t pending = 0;
+
+		for (pdb_coverage_info const * pci: src)
+		{
+			if (pci->run_counts.empty())
+			{
+				for (uint64_t addr: pci->addrs_covered)
+					++batch[(size_t)(addr - lo)];
+
+				if (++pending == 0xff)
+				{
+					add_batch(totals.data(), batch.data(), span);
+					std::fill(batch.begin(), batch.end(), 0);
+					pending = 0;
+				}
+			}
+			else
+			{
+				for (size_t i = 0; i < pci->addrs_covered.size(); ++i)
+				{
+					uint16_t & runs = totals[(size_t)(pci->addrs_covered[i] - lo)];
+					runs = add_runs(runs, pci->run_counts[i]);
+				}
+			}
+		}
+
+		if (pending != 0)
+			add_batch(totals.data(), batch.data(), span);
+
+		for (size_t i = 0; i < span; ++i)
+		{
+			if (totals[i] != 0)
+			{
+				addrs.push_back(lo + i);
+				counts.push_back(totals[i]);
+			}
+		}
+
+		return;
+	}
+
+	struct cursor
+	{
+		uint64_t const * cur;
+		uint64_t const * last;
+		uint16_t const * runs;
+
+		bool operator<(cursor const & rhs) const
+		{
+			return *cur > *rhs.cur;
+		}
+	};
+
+	std::vector<cursor> heap;
+	for (pdb_coverage_info const * pci: src)
+	{
+		if (!pci->addrs_covered.empty())
+		{
+			cursor c = { pci->addrs_covered.data(), pci->addrs_covered.data() + pci->addrs_covered.size(),
+				pci->run_counts.empty()? nullptr: pci->run_counts.data() };
+			heap.push_back(c);
+		}
+	}
+	std::make_heap(heap.begin(), heap.end());
+
+	addrs.reserve(total);
+	counts.reserve(total);
+	while (!heap.empty())
+	{
+		std::pop_heap(heap.begin(), heap.end());
+		cursor & c = heap.back();
+
+		uint16_t runs = c.runs? *c.runs++: 1;
+		if (addrs.empty() || addrs.back() != *c.cur)
+		{
+			addrs.push_back(*c.cur);
+			counts.push_back(runs);
+		}
+		else
+		{
+			counts.back() = add_runs(counts.back(), runs);
+		}
+
+		if (++c.cur == c.last)
+			heap.pop_back();
+		else
+			std::push_heap(heap.begin(), heap.end());
+	}
+}
+
+// Sums up the sources' hit counts of each of the merged `addrs`, which must
+// include all of the sources' addresses. Leaves `hits` empty if none of
+// the sources has hit counts.
+static void merge_hits(std::vector<pdb_coverage_info const *> const & src, std::vector<uint64_t> const & addrs, std::vector<uint32_t> & hits)
+{
+	hits.clear();
+	for (pdb_coverage_info const * pci: src)
+	{
+		if (pci->hit_counts.empty())
+			continue;
+
+		if (hits.empty())
+			hits.assign(addrs.size(), 0);
+
+		size_t j = 0;
+		for (size_t i = 0; i < pci->addrs_covered.size(); ++i)
+		{
+			while (addrs[j] < pci->addrs_covered[i])
+				++j;
+
+			uint64_t sum = (uint64_t)hits[j] + pci->hit_counts[i];
+			hits[j] = sum > UINT32_MAX? UINT32_MAX: (uint32_t)sum;
+		}
+	}
+}
+
+static void store_processes(std::vector<uint8_t> & data, uint64_t data_offset, std::vector<process_coverage_info> const & procs)
+{
+	append_pod(data, (uint64_t)procs.size());
+
+	size_t index_pos = data.size();
+	data.resize(index_pos + procs.size() * sizeof(binary_process));
+
+	for (size_t i = 0; i < procs.size(); ++i)
+	{
+		process_coverage_info const & proc = procs[i];
+
+		binary_process bp = {};
+		bp.pid = proc.pid;
+
+		std::string image = utf16_to_utf8(proc.image);
+		std::string cmdline = utf16_to_utf8(proc.cmdline);
+		bp.meta_offset = data_offset + data.size();
+		bp.image_size = (uint32_t)image.size();
+		bp.cmdline_size = (uint32_t)cmdline.size();
+		data.insert(data.end(), image.begin(), image.end());
+		data.insert(data.end(), cmdline.begin(), cmdline.end());
+		data.resize((size_t)align8(data.size()));
+
+		std::vector<uint8_t> covered = encode_addrs(proc.addrs_covered, bp.encoding);
+		bp.covered_offset = data_offset + data.size();
+		bp.covered_size = covered.size();
+		bp.addr_count = proc.addrs_covered.size();
+		data.insert(data.end(), covered.begin(), covered.end());
+		data.resize((size_t)align8(data.size()));
+
+		if (!proc.hit_counts.empty())
+		{
+			uint8_t const * counts = (uint8_t const *)proc.hit_counts.data();
+			data.insert(data.end(), counts, counts + proc.hit_counts.size() * 4);
+			data.resize((size_t)align8(data.size()));
+			bp.flags |= module_has_hit_counts;
+		}
+
+		memcpy(data.data() + index_pos + i * sizeof bp, &bp, sizeof bp);
+	}
+}
+
+static void load_processes(uint8_t const * p, size_t size, uint64_t offset, std::vector<process_coverage_info> & procs)
+{
+	uint64_t count;
+	if (offset > size || size - offset < sizeof count)
+		throw std::runtime_error("invalid coverage file");
+	memcpy(&count, p + offset, sizeof count);
+	offset += sizeof count;
+
+	if (count > (size - offset) / sizeof(binary_process))
+		throw std::runtime_error("invalid coverage file");
+
+	procs.resize((size_t)count);
+	for (size_t i = 0; i < procs.size(); ++i)
+	{
+		binary_process bp;
+		memcpy(&bp, p + offset + i * sizeof bp, sizeof bp);
+
+		if (bp.meta_offset > size || size - bp.meta_offset < (uint64_t)bp.image_size + bp.cmdline_size
+			|| bp.covered_offset > size || size - bp.covered_offset < bp.covered_size)
+		{
+			throw std::runtime_error("invalid coverage file");
+		}
+
+		if (bp.flags & ~(uint32_t)module_has_hit_counts)
+			throw std::runtime_error("unsupported coverage file flags");
+
+		process_coverage_info & proc = procs[i];
+		proc.pid = bp.pid;
+
+		char const * meta = (char const *)p + bp.meta_offset;
+		proc.image = utf8_to_utf16(string_view(meta, bp.image_size));
+		proc.cmdline = utf8_to_utf16(string_view(meta + bp.image_size, bp.cmdline_size));
+
+		decode_addrs(p + bp.covered_offset, bp.covered_size, bp.encoding, bp.addr_count, proc.addrs_covered);
+
+		if (bp.flags & module_has_hit_counts)
+		{
+			uint64_t counts_offset = align8(bp.covered_offset + bp.covered_size);
+			if (counts_offset > size || (size - counts_offset) / 4 < bp.addr_count)
+				throw std::runtime_error("invalid coverage file");
+
+			proc.hit_counts.resize((size_t)bp.addr_count);
+			memcpy(proc.hit_counts.data(), p + counts_offset, proc.hit_counts.size() * 4);
+		}
+	}
+}
+
+static bool is_binary(uint8_t const * p, size_t size)
+{
+	return size >= sizeof binary_magic && memcmp(p, binary_magic, sizeof binary_magic) == 0;
+}
+
+static coverage_info load_binary(uint8_t const * p, size_t size)
+{
+	binary_header hdr;
+	if (size < sizeof hdr)
+		throw std::runtime_error("invalid coverage file");
+	memcpy(&hdr, p, sizeof hdr);
+
+	if (hdr.version != binary_version)
+		throw std::runtime_error("unsupported coverage file version");
+
+	if (hdr.module_count > (size - sizeof hdr) / sizeof(binary_module))
+		throw std::runtime_error("invalid coverage file");
+
+	coverage_info res;
+	for (uint32_t i = 0; i < hdr.module_count; ++i)
+	{
+		binary_module mod;
+		memcpy(&mod, p + sizeof hdr + i * sizeof mod, sizeof mod);
+
+		if (mod.meta_offset > size || size - mod.meta_offset < (uint64_t)mod.filename_size + mod.cv_size
+			|| mod.covered_offset > size || size - mod.covered_offset < mod.covered_size)
+		{
+			throw std::runtime_error("invalid coverage file");
+		}
+
+		guid pdb_guid;
+		memcpy(pdb_guid.data, mod.guid, sizeof pdb_guid.data);
+		if (pdb_guid.is_null())
+			throw std::runtime_error("missing pdb_guid entry");
+
+		pdb_coverage_info & pdb_info = res.pdbs[pdb_guid];
+
+		char const * meta = (char const *)p + mod.meta_offset;
+		pdb_info.filename = utf8_to_utf16(string_view(meta, mod.filename_size));
+		pdb_info.cv.assign(meta + mod.filename_size, meta + mod.filename_size + mod.cv_size);
+		pdb_info.image_size = mod.image_size;
+		pdb_info.timestamp = mod.timestamp;
+
+		decode_addrs(p + mod.covered_offset, mod.covered_size, mod.encoding, mod.addr_count, pdb_info.addrs_covered);
+
+		if (mod.flags & ~(uint32_t)(module_has_run_counts | module_has_hit_counts | module_has_processes))
+			throw std::runtime_error("unsupported coverage file flags");
+
+		uint64_t counts_offset = align8(mod.covered_offset + mod.covered_size);
+		if (mod.flags & module_has_run_counts)
+		{
+			if (counts_offset > size || (size - counts_offset) / 2 < mod.addr_count)
+				throw std::runtime_error("invalid coverage file");
+
+			pdb_info.run_counts.resize((size_t)mod.addr_count);
+			memcpy(pdb_info.run_counts.data(), p + counts_offset, pdb_info.run_counts.size() * 2);
+			counts_offset = align8(counts_offset + mod.addr_count * 2);
+		}
+
+		if (mod.flags & module_has_hit_counts)
+		{
+			if (counts_offset > size || (size - counts_offset) / 4 < mod.addr_count)
+				throw std::runtime_error("invalid coverage file");
+
+			pdb_info.hit_counts.resize((size_t)mod.addr_count);
+			memcpy(pdb_info.hit_counts.data(), p + counts_offset, pdb_info.hit_counts.size() * 4);
+			counts_offset = align8(counts_offset + mod.addr_count * 4);
+		}
+
+		if (mod.flags & module_has_processes)
+			load_processes(p, size, counts_offset, pdb_info.processes);
+	}
+
+	return res;
+}
+
+static coverage_info load_json(char const * first, char const * last)
 {
 	coverage_info res;
 
-	json_reader reader(in);
+	json_reader reader(first, last);
 	reader.read_array([&]() {
 		guid pdb_guid;
 		pdb_coverage_info pdb_info;
@@ -27,16 +650,63 @@ coverage_info coverage_info::load(std::istream & in)
 				reader.read_array([&]() {
 					pdb_info.addrs_covered.push_back(reader.read_num<uint64_t>());
 				});
+			else if (key == "runs")
+				reader.read_array([&]() {
+					pdb_info.run_counts.push_back(reader.read_num<uint16_t>());
+				});
+			else if (key == "hits")
+				reader.read_array([&]() {
+					pdb_info.hit_counts.push_back(reader.read_num<uint32_t>());
+				});
+			else if (key == "processes")
+				reader.read_array([&]() {
+					process_coverage_info proc;
+					proc.pid = 0;
+					reader.read_object([&](string_view proc_key) {
+						if (proc_key == "pid")
+							proc.pid = reader.read_num<uint32_t>();
+						else if (proc_key == "image")
+							proc.image = reader.read_wstr();
+						else if (proc_key == "cmdline")
+							proc.cmdline = reader.read_wstr();
+						else if (proc_key == "covered")
+							reader.read_array([&]() {
+								proc.addrs_covered.push_back(reader.read_num<uint64_t>());
+							});
+						else if (proc_key == "hits")
+							reader.read_array([&]() {
+								proc.hit_counts.push_back(reader.read_num<uint32_t>());
+							});
+					});
+
+					if (!proc.hit_counts.empty() && proc.hit_counts.size() != proc.addrs_covered.size())
+						throw std::runtime_error("hit counts don't match covered addresses");
+					pdb_info.processes.push_back(std::move(proc));
+				});
 		});
 
 		if (pdb_guid.is_null())
 			throw std::runtime_error("missing pdb_guid entry");
-		res.pdbs[pdb_guid] = pdb_info;
+		if (!pdb_info.run_counts.empty() && pdb_info.run_counts.size() != pdb_info.addrs_covered.size())
+			throw std::runtime_error("run counts don't match covered addresses");
+		if (!pdb_info.hit_counts.empty() && pdb_info.hit_counts.size() != pdb_info.addrs_covered.size())
+			throw std::runtime_error("hit counts don't match covered addresses");
+		res.pdbs[pdb_guid] = std::move(pdb_info);
 	});
 
 	return res;
 }
 
+}
+
+coverage_info coverage_info::load(std::istream & in)
+{
+	std::string buf((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	if (is_binary((uint8_t const *)buf.data(), buf.size()))
+		return load_binary((uint8_t const *)buf.data(), buf.size());
+	return load_json(buf.data(), buf.data() + buf.size());
+}
+
 void coverage_info::store(std::ostream & out)
 {
 	json_writer j(out);
@@ -67,11 +737,151 @@ void coverage_info::store(std::ostream & out)
 			j.write_num(addr);
 		j.close_array();
 
+		if (!kv.second.run_counts.empty())
+		{
+			j.write_key("runs");
+			j.open_array();
+			for (uint16_t runs: kv.second.run_counts)
+				j.write_num(runs);
+			j.close_array();
+		}
+
+		if (!kv.second.hit_counts.empty())
+		{
+			j.write_key("hits");
+			j.open_array();
+			for (uint32_t hits: kv.second.hit_counts)
+				j.write_num(hits);
+			j.close_array();
+		}
+
+		if (!kv.second.processes.empty())
+		{
+			j.write_key("processes");
+			j.open_array();
+			for (process_coverage_info const & proc: kv.second.processes)
+			{
+				j.open_object();
+
+				j.write_key("pid");
+				j.write_num(proc.pid);
+
+				j.write_key("image");
+				j.write_str(proc.image);
+
+				j.write_key("cmdline");
+				j.write_str(proc.cmdline);
+
+				j.write_key("covered");
+				j.open_array();
+				for (uint64_t addr: proc.addrs_covered)
+					j.write_num(addr);
+				j.close_array();
+
+				if (!proc.hit_counts.empty())
+				{
+					j.write_key("hits");
+					j.open_array();
+					for (uint32_t hits: proc.hit_counts)
+						j.write_num(hits);
+					j.close_array();
+				}
+
+				j.close_object();
+			}
+			j.close_array();
+		}
+
 		j.close_object();
 	}
 	j.close_array();
 }
 
+bool coverage_info::load_file(std::wstring const & fname, coverage_info & res)
+{
+	{
+		mapped_file file;
+		if (file.open(fname))
+		{
+			if (is_binary(file.data(), file.size()))
+				res = load_binary(file.data(), file.size());
+			else
+				res = load_json((char const *)file.data(), (char const *)file.data() + file.size());
+			return true;
+		}
+	}
+
+	std::ifstream fin(native_path(fname).c_str(), std::ios::binary);
+	if (!fin)
+		return false;
+
+	res = load(fin);
+	return true;
+}
+
+void coverage_info::store_binary(std::ostream & out)
+{
+	std::vector<binary_module> index;
+	std::vector<uint8_t> data;
+
+	uint64_t data_offset = sizeof(binary_header) + pdbs.size() * sizeof(binary_module);
+	for (auto & kv: pdbs)
+	{
+		binary_module mod = {};
+		memcpy(mod.guid, kv.first.data, sizeof mod.guid);
+		mod.image_size = kv.second.image_size;
+		mod.timestamp = kv.second.timestamp;
+
+		std::string filename = utf16_to_utf8(kv.second.filename);
+		mod.meta_offset = data_offset + data.size();
+		mod.filename_size = (uint32_t)filename.size();
+		mod.cv_size = (uint32_t)kv.second.cv.size();
+		data.insert(data.end(), filename.begin(), filename.end());
+		data.insert(data.end(), kv.second.cv.begin(), kv.second.cv.end());
+		data.resize((size_t)align8(data.size()));
+
+		std::vector<uint8_t> covered = encode_addrs(kv.second.addrs_covered, mod.encoding);
+		mod.covered_offset = data_offset + data.size();
+		mod.covered_size = covered.size();
+		mod.addr_count = kv.second.addrs_covered.size();
+		data.insert(data.end(), covered.begin(), covered.end());
+		data.resize((size_t)align8(data.size()));
+
+		if (!kv.second.run_counts.empty())
+		{
+			uint8_t const * counts = (uint8_t const *)kv.second.run_counts.data();
+			data.insert(data.end(), counts, counts + kv.second.run_counts.size() * 2);
+			data.resize((size_t)align8(data.size()));
+			mod.flags |= module_has_run_counts;
+		}
+
+		if (!kv.second.hit_counts.empty())
+		{
+			uint8_t const * counts = (uint8_t const *)kv.second.hit_counts.data();
+			data.insert(data.end(), counts, counts + kv.second.hit_counts.size() * 4);
+			data.resize((size_t)align8(data.size()));
+			mod.flags |= module_has_hit_counts;
+		}
+
+		if (!kv.second.processes.empty())
+		{
+			store_processes(data, data_offset, kv.second.processes);
+			mod.flags |= module_has_processes;
+		}
+
+		index.push_back(mod);
+	}
+
+	binary_header hdr;
+	memcpy(hdr.magic, binary_magic, sizeof hdr.magic);
+	hdr.version = binary_version;
+	hdr.module_count = (uint32_t)index.size();
+
+	out.write((char const *)&hdr, sizeof hdr);
+	out.write((char const *)index.data(), index.size() * sizeof(binary_module));
+	out.write((char const *)data.data(), data.size());
+}
+
 void coverage_info::merge(coverage_info && ci)
 {
 	for (auto && kv: ci.pdbs)
@@ -86,8 +896,100 @@ void coverage_info::merge(coverage_info && ci)
 		if (it->second.timestamp != kv.second.timestamp || it->second.image_size != kv.second.image_size)
 			throw std::runtime_error("inconsistent");
 
+		std::vector<pdb_coverage_info const *> src;
+		src.push_back(&it->second);
+		src.push_back(&kv.second);
+
+		// If either side counts runs, the counts are added up, with
+		// the other side counting as a single run.
 		std::vector<uint64_t> merged;
-		std::set_union(it->second.addrs_covered.begin(), it->second.addrs_covered.end(), kv.second.addrs_covered.begin(),kv.second.addrs_covered.end(), std::back_inserter(merged));
-		kv.second.addrs_covered = std::move(merged);
+		std::vector<uint16_t> runs;
+		if (!it->second.run_counts.empty() || !kv.second.run_counts.empty())
+			merge_runs(src, merged, runs);
+		else
+			std::set_union(it->second.addrs_covered.begin(), it->second.addrs_covered.end(), kv.second.addrs_covered.begin(),kv.second.addrs_covered.end(), std::back_inserter(merged));
+
+		std::vector<uint32_t> hits;
+		merge_hits(src, merged, hits);
+
+		it->second.addrs_covered = std::move(merged);
+		it->second.run_counts = std::move(runs);
+		it->second.hit_counts = std::move(hits);
+
+		std::move(kv.second.processes.begin(), kv.second.processes.end(), std::back_inserter(it->second.processes));
+	}
+}
+
+coverage_info coverage_info::merge_all(std::vector<coverage_info> && inputs, bool count_runs, unsigned threads)
+{
+	std::map<guid, std::vector<pdb_coverage_info *>> sources;
+	for (coverage_info & ci: inputs)
+	{
+		for (auto && kv: ci.pdbs)
+			sources[kv.first].push_back(&kv.second);
+	}
+
+	coverage_info res;
+	std::vector<std::pair<pdb_coverage_info *, std::vector<pdb_coverage_info *> const *>> work;
+	for (auto && kv: sources)
+	{
+		pdb_coverage_info & first = *kv.second.front();
+		for (pdb_coverage_info const * pci: kv.second)
+		{
+			if (pci->timestamp != first.timestamp || pci->image_size != first.image_size)
+				throw std::runtime_error("inconsistent");
+		}
+
+		pdb_coverage_info & pdb_info = res.pdbs[kv.first];
+		pdb_info.filename = std::move(first.filename);
+		pdb_info.image_size = first.image_size;
+		pdb_info.timestamp = first.timestamp;
+		pdb_info.cv = std::move(first.cv);
+		work.emplace_back(&pdb_info, &kv.second);
 	}
+
+	parallel_for(work.size(), threads, [&](size_t i) {
+		pdb_coverage_info & pdb_info = *work[i].first;
+		std::vector<pdb_coverage_info const *> src(work[i].second->begin(), work[i].second->end());
+
+		for (pdb_coverage_info * pci: *work[i].second)
+			std::move(pci->processes.begin(), pci->processes.end(), std::back_inserter(pdb_info.processes));
+
+		// Run counts are kept if any source has them, like in `merge`.
+		bool counted = count_runs;
+		for (pdb_coverage_info const * pci: src)
+		{
+			if (!pci->run_counts.empty())
+				counted = true;
+		}
+
+		if (src.size() == 1)
+		{
+			pdb_coverage_info & only = *work[i].second->front();
+			pdb_info.hit_counts = std::move(only.hit_counts);
+			if (!count_runs || !only.run_counts.empty())
+			{
+				pdb_info.addrs_covered = std::move(only.addrs_covered);
+				pdb_info.run_counts = std::move(only.run_counts);
+				return;
+			}
+		}
+
+		if (counted)
+		{
+			merge_runs(src, pdb_info.addrs_covered, pdb_info.run_counts);
+		}
+		else
+		{
+			std::vector<std::vector<uint64_t> const *> lists;
+			for (pdb_coverage_info const * pci: src)
+				lists.push_back(&pci->addrs_covered);
+			pdb_info.addrs_covered = merge_addrs(lists);
+		}
+
+		if (src.size() != 1)
+			merge_hits(src, pdb_info.addrs_covered, pdb_info.hit_counts);
+	});
+
+	return res;
 }
@@ -0,0 +1,60 @@
+#ifdef _WIN32
+
+#include "dbghelp_lines.h"
+#include "utf.h"
+#include <map>
+#include <exception>
+#include <utility>
+
+#pragma warning(push)
+// 'typedef ': ignored on left of '' when no variable is declared
+#pragma warning(disable:4091)
+#include <dbghelp.h>
+#pragma warning(pop)
+
+namespace {
+
+struct sym_enum_ctx
+{
+	line_table lines;
+	std::map<std::wstring, uint32_t> file_ids;
+	uint64_t base;
+	std::exception_ptr exc;
+};
+
+}
+
+static BOOL CALLBACK SymEnumLinesProc(PSRCCODEINFOW LineInfo, PVOID UserContext) noexcept
+{
+	sym_enum_ctx & ctx = *static_cast<sym_enum_ctx *>(UserContext);
+
+	try
+	{
+		auto r = ctx.file_ids.emplace(LineInfo->FileName, (uint32_t)ctx.lines.files.size());
+		if (r.second)
+			ctx.lines.files.push_back(utf16_to_utf8(LineInfo->FileName));
+
+		line_table_row row = { LineInfo->Address - ctx.base, r.first->second, LineInfo->LineNumber };
+		ctx.lines.rows.push_back(row);
+		return TRUE;
+	}
+	catch (...)
+	{
+		ctx.exc = std::current_exception();
+		return FALSE;
+	}
+}
+
+line_table dbghelp_read_line_table(HANDLE hProcess, DWORD64 base)
+{
+	sym_enum_ctx ctx;
+	ctx.base = base;
+
+	SymEnumLinesW(hProcess, base, nullptr, nullptr, &SymEnumLinesProc, &ctx);
+	if (ctx.exc != nullptr)
+		std::rethrow_exception(ctx.exc);
+
+	return std::move(ctx.lines);
+}
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef DBGHELP_LINES_H
+#define DBGHELP_LINES_H
+
+#ifdef _WIN32
+
+#include "line_table.h"
+#include <windows.h>
+
+// Reads with dbghelp the line table of the module loaded in `hProcess`'s
+// symbol handler at `base`, with addresses relative to `base`. Throws
+// whatever gets thrown while collecting the rows.
+line_table dbghelp_read_line_table(HANDLE hProcess, DWORD64 base);
+
+#endif
+
+#endif // DBGHELP_LINES_H
@@ -1,12 +1,25 @@
-#include "debugger_loop.h"
+#ifdef _WIN32
 
+#include "debugger_loop.h"
+#include "breakpoints.h"
+#include "basic_blocks.h"
+#include "dbghelp_lines.h"
 #include "guid.h"
+#include "line_cache.h"
+#include "pdb_file.h"
+#include "stats.h"
+#include "utf.h"
 
 #include <map>
 #include <set>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
 #include <cassert>
 
 #include <windows.h>
+#include <winternl.h>
 
 #pragma warning(push)
 // 'typedef ': ignored on left of '' when no variable is declared
@@ -29,13 +42,32 @@ struct mapping_holder
 	void * m_base;
 };
 
-static std::vector<uint8_t> get_cv_record(HANDLE hFile)
+struct image_info
+{
+	uint32_t image_size;
+	uint32_t timestamp;
+	std::vector<uint8_t> cv;
+	bool x64;
+};
+
+static image_info get_image_info(HANDLE hFile)
 {
+	image_info res = {};
+
 	HANDLE hSection = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
 	void * base = MapViewOfFileEx(hSection,  FILE_MAP_READ, 0, 0, 0, nullptr);
 	mapping_holder base_holder(base);
 	CloseHandle(hSection);
 
+	// SizeOfImage is at the same offset in 32- and 64-bit optional headers.
+	IMAGE_NT_HEADERS * nt = ImageNtHeader(base);
+	if (!nt)
+		return res;
+
+	res.image_size = nt->OptionalHeader.SizeOfImage;
+	res.timestamp = nt->FileHeader.TimeDateStamp;
+	res.x64 = nt->FileHeader.Machine == IMAGE_FILE_MACHINE_AMD64;
+
 	ULONG size;
 	auto * dd = (IMAGE_DEBUG_DIRECTORY *)ImageDirectoryEntryToData(base, FALSE, IMAGE_DIRECTORY_ENTRY_DEBUG, &size);
 	if (dd)
@@ -47,71 +79,151 @@ static std::vector<uint8_t> get_cv_record(HANDLE hFile)
 			if (dd[i].Type == IMAGE_DEBUG_TYPE_CODEVIEW)
 			{
 				auto p = (uint8_t const *)base + dd[i].PointerToRawData;
-				return std::vector<uint8_t>(p, p + dd[i].SizeOfData);
+				res.cv.assign(p, p + dd[i].SizeOfData);
+				break;
 			}
 		}
 	}
 
-	return std::vector<uint8_t>();
+	return res;
 }
 
-namespace {
-
-struct addr_info
+// Reads the image path of a process.
+static std::wstring get_process_image(HANDLE hProcess)
 {
-	uint8_t orig_byte;
-	bool covered;
-};
+	std::vector<wchar_t> buf(32768);
+	DWORD size = (DWORD)buf.size();
+	if (!QueryFullProcessImageNameW(hProcess, 0, buf.data(), &size))
+		return std::wstring();
+	return std::wstring(buf.data(), size);
+}
 
-struct pdb_info
+// Reads the command line of a process from its process parameters.
+static std::wstring get_process_cmdline(HANDLE hProcess)
 {
-	uint32_t image_size;
-	uint32_t timestamp;
-	std::wstring filename;
-	std::vector<uint8_t> cv;
-	std::map<HANDLE, uint64_t> processes;
-	std::map<uint64_t, addr_info> addrs;
-};
+	typedef NTSTATUS (NTAPI * query_fn)(HANDLE, PROCESSINFOCLASS, PVOID, ULONG, PULONG);
+	auto query = (query_fn)GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "NtQueryInformationProcess");
+
+	PROCESS_BASIC_INFORMATION pbi;
+	if (!query || query(hProcess, ProcessBasicInformation, &pbi, sizeof pbi, nullptr) < 0)
+		return std::wstring();
 
-struct global_address
+	PEB peb;
+	RTL_USER_PROCESS_PARAMETERS params;
+	if (!ReadProcessMemory(hProcess, pbi.PebBaseAddress, &peb, sizeof peb, nullptr)
+		|| !ReadProcessMemory(hProcess, peb.ProcessParameters, &params, sizeof params, nullptr))
+	{
+		return std::wstring();
+	}
+
+	std::wstring res(params.CommandLine.Length / sizeof(wchar_t), 0);
+	if (!res.empty() && !ReadProcessMemory(hProcess, params.CommandLine.Buffer, &res[0], res.size() * sizeof(wchar_t), nullptr))
+		return std::wstring();
+	return res;
+}
+
+namespace {
+
+using win32_breakpoints = breakpoints<HANDLE>;
+using pdb_info = win32_breakpoints::pdb_info;
+
+struct win32_memory
 {
-	HANDLE hProcess;
-	uint64_t addr;
+	// If set, reads and writes are counted there.
+	run_stats * stats;
 
-	friend bool operator==(global_address const & lhs, global_address const & rhs)
+	win32_memory()
+		: stats(nullptr)
 	{
-		return lhs.hProcess == rhs.hProcess && lhs.addr == rhs.addr;
 	}
 
-	friend bool operator<(global_address const & lhs, global_address const & rhs)
+	bool read(HANDLE hProcess, uint64_t addr, uint8_t * buf, size_t size)
 	{
-		return lhs.hProcess < rhs.hProcess
-			|| (lhs.hProcess == rhs.hProcess && lhs.addr < rhs.addr);
+		if (stats)
+			stats->count(counter_memory_reads);
+
+		SIZE_T read;
+		return ReadProcessMemory(hProcess, (LPCVOID)addr, buf, size, &read) && read == size;
 	}
-};
 
-struct breakpoints
-{
-	std::map<guid, pdb_info> pdbs;
-	std::map<global_address, pdb_info *> addrs;
+	bool write(HANDLE hProcess, uint64_t addr, uint8_t const * buf, size_t size)
+	{
+		if (stats)
+			stats->count(counter_memory_writes);
+
+		SIZE_T written;
+		return WriteProcessMemory(hProcess, (LPVOID)addr, buf, size, &written) && written == size;
+	}
 };
 
 struct sym_enum_ctx
 {
-	pdb_info * pi;
+	std::vector<std::pair<uint64_t, uint64_t>> functions;
 	uint64_t base;
 	std::exception_ptr exc;
 };
 
+// SymTagFunction from cvconst.h, which dbghelp.h doesn't pull in.
+static ULONG const sym_tag_function = 5;
+
+// Requests to an attached debugger: Ctrl+Break asks for a snapshot,
+// Ctrl+C for a detach.
+LONG volatile g_snapshot_requested;
+LONG volatile g_detach_requested;
+
+// How often the control file is looked for.
+static DWORD const control_poll_ms = 200;
+
+// How long to wait for breakpoint exceptions already on their way
+// once the breakpoints are gone; any left undelivered at detach
+// would crash the debuggee.
+static DWORD const detach_drain_ms = 100;
+
+}
+
+static BOOL WINAPI on_console_ctrl(DWORD type)
+{
+	switch (type)
+	{
+	case CTRL_BREAK_EVENT:
+		InterlockedExchange(&g_snapshot_requested, 1);
+		return TRUE;
+	case CTRL_C_EVENT:
+		InterlockedExchange(&g_detach_requested, 1);
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+// Consumes the control file, if it's there. Returns false if it isn't;
+// otherwise sets `detach` if it asks for a detach rather than a snapshot.
+static bool take_control_file(std::wstring const & fname, bool & detach)
+{
+	std::ifstream in(fname);
+	if (!in)
+		return false;
+
+	std::string word;
+	in >> word;
+	in.close();
+
+	DeleteFileW(fname.c_str());
+	detach = word == "detach";
+	return true;
 }
 
-static BOOL CALLBACK SymEnumLinesProc(PSRCCODEINFOW LineInfo, PVOID UserContext) noexcept
+static BOOL CALLBACK SymEnumFunctionsProc(PSYMBOL_INFOW pSymInfo, ULONG SymbolSize, PVOID UserContext) noexcept
 {
 	sym_enum_ctx & ctx = *static_cast<sym_enum_ctx *>(UserContext);
 
 	try
 	{
-		ctx.pi->addrs[LineInfo->Address - ctx.base];
+		if (pSymInfo->Tag == sym_tag_function && SymbolSize != 0)
+		{
+			uint64_t offset = pSymInfo->Address - ctx.base;
+			ctx.functions.push_back(std::make_pair(offset, offset + SymbolSize));
+		}
 		return TRUE;
 	}
 	catch (...)
@@ -121,112 +233,158 @@ static BOOL CALLBACK SymEnumLinesProc(PSRCCODEINFOW LineInfo, PVOID UserContext)
 	}
 }
 
-coverage_info capture_coverage(std::wstring cmdline, std::wstring const & sympath)
+// Reads the line table of the module at `base` and, if `want_functions`
+// is set, its function ranges with dbghelp. Returns false if the module
+// has no PDB with line information.
+static bool dbghelp_read_module_lines(module_lines & res, HANDLE hProcess, HANDLE hFile, DWORD64 base,
+	bool want_functions)
 {
-	STARTUPINFOW si = { sizeof si };
-	PROCESS_INFORMATION pi;
-	if (!CreateProcessW(nullptr, &cmdline[0], nullptr, nullptr, FALSE,
-		DEBUG_PROCESS, nullptr, nullptr, &si, &pi))
-	{
-		throw std::runtime_error("can't create process");
-	}
+	if (!SymLoadModuleExW(hProcess, hFile, nullptr, nullptr, base, 0, 0, 0))
+		throw std::runtime_error("load module error");
 
-	CloseHandle(pi.hThread);
-	CloseHandle(pi.hProcess);
+	IMAGEHLP_MODULEW64 im = { sizeof im };
+	if (!SymGetModuleInfoW64(hProcess, base, &im))
+		throw std::runtime_error("get module info error");
 
-	breakpoints bkpts;
+	if (im.SymType != SymPdb || !im.LineNumbers)
+		return false;
 
-	auto load_module = [&](HANDLE hProcess, HANDLE hFile, DWORD64 base) {
-		if (!SymLoadModuleExW(hProcess, hFile, nullptr, nullptr, base, 0, 0, 0))
-			throw std::runtime_error("load module error");
+	res.lines = dbghelp_read_line_table(hProcess, im.BaseOfImage);
 
-		IMAGEHLP_MODULEW64 im = { sizeof im };
-		if (!SymGetModuleInfoW64(hProcess, base, &im))
-			throw std::runtime_error("get module info error");
-
-		if (im.SymType == SymPdb && im.LineNumbers)
-		{
-			guid pdb_guid;
-			memcpy(pdb_guid.data, &im.PdbSig70, sizeof pdb_guid.data);
-			if (pdb_guid.is_null())
-				return;
+	sym_enum_ctx ctx;
+	ctx.base = im.BaseOfImage;
 
-			pdb_info * pi;
-			bool orig_bytes_known;
+	if (want_functions)
+	{
+		SymEnumSymbolsW(hProcess, base, L"*", &SymEnumFunctionsProc, &ctx);
+		if (ctx.exc != nullptr)
+			std::rethrow_exception(ctx.exc);
+	}
 
-			auto pi_it = bkpts.pdbs.find(pdb_guid);
-			if (pi_it == bkpts.pdbs.end())
-			{
-				pi = &bkpts.pdbs[pdb_guid];
-				orig_bytes_known = false;
-
-				pi->image_size = im.ImageSize;
-				pi->timestamp = im.TimeDateStamp;
-				pi->filename = im.LoadedPdbName;
-				pi->cv = get_cv_record(hFile);
-
-				sym_enum_ctx ctx = { pi, im.BaseOfImage };
-				SymEnumLinesW(hProcess, base, nullptr, nullptr, &SymEnumLinesProc, &ctx);
-				if (ctx.exc != nullptr)
-					std::rethrow_exception(ctx.exc);
-			}
-			else
-			{
-				pi = &pi_it->second;
-				orig_bytes_known = true;
-			}
+	res.filename = im.LoadedPdbName;
+	res.functions = std::move(ctx.functions);
+	return true;
+}
 
-			assert(pi->processes.find(hProcess) == pi->processes.end());
-			pi->processes[hProcess] = im.BaseOfImage;
+// Handles the debug events of the processes being debugged until they're
+// all gone or, if `attach` is set, until a detach is requested.
+static coverage_info debug_processes(capture_options const & opts, attach_options const * attach)
+{
+	win32_breakpoints bkpts;
+	bkpts.log = opts.log;
+	bkpts.lazy = opts.lazy;
+	bkpts.count_hits = opts.sample_ms != 0;
+	bkpts.per_process = opts.per_process;
+	bkpts.stats = opts.stats;
+	win32_memory mem;
+	mem.stats = opts.stats;
+
+	// Set once the breakpoints are gone and the remaining events are being
+	// drained before detaching.
+	bool detaching = false;
 
-			for (auto && kv: pi->addrs)
-			{
-				uint64_t addr = im.BaseOfImage + kv.first;
+	auto load_module = [&](HANDLE hProcess, HANDLE hFile, DWORD64 base) {
+		if (detaching)
+			return;
 
-				global_address ga = { hProcess, addr };
-				bkpts.addrs[ga] = pi;
+		image_info ii = get_image_info(hFile);
 
-				if (kv.second.covered)
-					continue;
+		guid pdb_guid;
+		uint32_t pdb_age;
+		std::string pdb_path;
+		if (!parse_codeview_record(ii.cv, pdb_guid, pdb_age, pdb_path) || pdb_guid.is_null())
+			return;
 
-				uint8_t buf;
-				if (!ReadProcessMemory(hProcess, (LPCVOID)addr, &buf, 1, nullptr))
-					throw std::runtime_error("cannot read process memory"); // XXX: maybe we can ignore?
+		pdb_info * pi;
+		bool orig_bytes_known;
 
-				assert(!orig_bytes_known || buf == kv.second.orig_byte);
-				kv.second.orig_byte = buf;
+		auto pi_it = bkpts.pdbs.find(pdb_guid);
+		if (pi_it == bkpts.pdbs.end())
+		{
+			// With a warm cache, dbghelp doesn't get to see the module at all,
+			// and the entry is read straight from its mapping.
+			std::wstring filename;
+			std::vector<uint64_t> offsets;
+			std::vector<std::pair<uint64_t, uint64_t>> functions;
+			{
+				stats_timer timer(opts.stats, "symbols", utf8_to_utf16(pdb_path));
 
-				if (kv.second.orig_byte != 0xcc)
+				line_cache_entry entry;
+				if (!opts.cache_dir.empty() && entry.open(opts.cache_dir, pdb_guid, ii.cv))
+				{
+					filename = entry.filename();
+					offsets.reserve(entry.row_count());
+					for (size_t i = 0; i < entry.row_count(); ++i)
+						offsets.push_back(entry.row(i).address);
+					for (size_t i = 0; i < entry.function_count(); ++i)
+						functions.push_back(entry.function(i));
+
+					if (opts.stats)
+						opts.stats->count(counter_line_cache_hits);
+				}
+				else
 				{
-					buf = 0xcc;
-					if (!WriteProcessMemory(hProcess, (LPVOID)addr, &buf, 1, nullptr))
-						throw std::runtime_error("cannot write process memory"); // XXX: maybe we can ignore?
+					module_lines ml;
+					if (!dbghelp_read_module_lines(ml, hProcess, hFile, base, bkpts.lazy || opts.blocks || !opts.cache_dir.empty()))
+						return;
+
+					if (!opts.cache_dir.empty())
+						store_line_cache(opts.cache_dir, pdb_guid, ii.cv, ml);
+
+					filename = std::move(ml.filename);
+					offsets.reserve(ml.lines.rows.size());
+					for (line_table_row const & row: ml.lines.rows)
+						offsets.push_back(row.address);
+					functions = std::move(ml.functions);
 				}
 			}
-		}
-	};
 
-	auto process_breakpoint = [&](HANDLE hProcess, HANDLE hThread, EXCEPTION_DEBUG_INFO const & exc) {
-		uint64_t exc_addr = (uint64_t)exc.ExceptionRecord.ExceptionAddress;
-		global_address ga = { hProcess, exc_addr };
+			pi = &bkpts.pdbs[pdb_guid];
+			orig_bytes_known = false;
 
-		auto pi_it = bkpts.addrs.find(ga);
-		if (pi_it == bkpts.addrs.end())
-			return DBG_EXCEPTION_NOT_HANDLED;
+			pi->image_size = ii.image_size;
+			pi->timestamp = ii.timestamp;
+			pi->filename = filename;
+			pi->cv = std::move(ii.cv);
 
-		pdb_info * pi = pi_it->second;
+			if (opts.stats)
+			{
+				opts.stats->count(counter_modules_read);
+				opts.stats->count(counter_line_addresses, offsets.size());
+			}
 
-		uint64_t base = pi->processes.find(hProcess)->second;
-		uint64_t addr = exc_addr - base;
+			if (opts.blocks)
+			{
+				// The image is still pristine, nothing has been armed in it yet.
+				stats_timer timer(opts.stats, "blocks", filename);
+				pi->set_blocks(find_basic_blocks(std::move(offsets), functions, ii.x64,
+					[&](uint64_t offset, uint8_t * buf, size_t size) {
+						return mem.read(hProcess, base + offset, buf, size);
+					}));
+			}
+			else
+			{
+				pi->set_offsets(std::move(offsets));
+			}
 
-		auto & addr_info = pi->addrs[addr];
-		addr_info.covered = true;
+			if (bkpts.lazy)
+				pi->set_functions(std::move(functions));
+		}
+		else
+		{
+			pi = &pi_it->second;
+			orig_bytes_known = true;
+		}
 
-		if (addr_info.orig_byte == 0xcc)
-			return DBG_EXCEPTION_NOT_HANDLED;
+		bkpts.arm(mem, hProcess, *pi, base, orig_bytes_known);
+	};
 
-		for (auto handle_base: pi->processes)
-			WriteProcessMemory(handle_base.first,  (LPVOID)(handle_base.second + addr), &addr_info.orig_byte, 1, nullptr);
+	auto process_breakpoint = [&](HANDLE hProcess, HANDLE hThread, EXCEPTION_DEBUG_INFO const & exc) {
+		// While detaching, breakpoints hit before they were removed are
+		// only rewound; `hit` could arm more of them.
+		uint64_t exc_addr = (uint64_t)exc.ExceptionRecord.ExceptionAddress;
+		if (detaching? !bkpts.owns(hProcess, exc_addr): !bkpts.hit(mem, hProcess, exc_addr))
+			return DBG_EXCEPTION_NOT_HANDLED;
 
 		if (exc.ExceptionRecord.ExceptionCode == STATUS_BREAKPOINT)
 		{
@@ -257,13 +415,96 @@ coverage_info capture_coverage(std::wstring cmdline, std::wstring const & sympat
 		std::map<DWORD, HANDLE> threads;
 	};
 
+	std::chrono::milliseconds sample_period(opts.sample_ms);
+	std::chrono::steady_clock::time_point next_rearm = std::chrono::steady_clock::now() + sample_period;
+
+	std::chrono::milliseconds poll_period(control_poll_ms);
+	std::chrono::steady_clock::time_point next_poll = std::chrono::steady_clock::now() + poll_period;
+
+	if (attach)
+	{
+		g_snapshot_requested = 0;
+		g_detach_requested = 0;
+		SetConsoleCtrlHandler(&on_console_ctrl, TRUE);
+	}
+
+	stats_timer loop_timer(opts.stats, "event_loop", L"event loop");
+
 	std::map<DWORD, process_info> process_handles;
 	for (;;)
 	{
+		DWORD timeout = INFINITE;
+		if (bkpts.count_hits && !detaching)
+		{
+			auto now = std::chrono::steady_clock::now();
+			if (now >= next_rearm)
+			{
+				bkpts.rearm(mem);
+				next_rearm = now + sample_period;
+			}
+
+			timeout = (DWORD)std::chrono::duration_cast<std::chrono::milliseconds>(next_rearm - now).count();
+		}
+
+		if (attach && !detaching)
+		{
+			bool detach = InterlockedExchange(&g_detach_requested, 0) != 0;
+			bool snapshot = InterlockedExchange(&g_snapshot_requested, 0) != 0;
+
+			if (!attach->control_file.empty() && std::chrono::steady_clock::now() >= next_poll)
+			{
+				bool detach_asked = false;
+				if (take_control_file(attach->control_file, detach_asked))
+				{
+					if (detach_asked)
+						detach = true;
+					else
+						snapshot = true;
+				}
+				next_poll = std::chrono::steady_clock::now() + poll_period;
+			}
+
+			if (snapshot && attach->snapshot)
+			{
+				stats_timer snapshot_timer(opts.stats, "snapshot", L"snapshot");
+				attach->snapshot(bkpts.get_coverage());
+			}
+
+			if (detach)
+			{
+				for (auto && kv: process_handles)
+					bkpts.disarm(mem, kv.second.h);
+				detaching = true;
+			}
+
+			timeout = (std::min)(timeout, detaching? detach_drain_ms: control_poll_ms);
+		}
+
 		DEBUG_EVENT de;
-		WaitForDebugEvent(&de, INFINITE);
+		if (!WaitForDebugEvent(&de, timeout))
+		{
+			if (detaching)
+			{
+				for (auto && kv: process_handles)
+				{
+					SymCleanup(kv.second.h);
+					DebugActiveProcessStop(kv.first);
+				}
+
+				SetConsoleCtrlHandler(&on_console_ctrl, FALSE);
+				return bkpts.get_coverage();
+			}
+			continue;
+		}
+
+		// Breakpoint traps are timed from the moment their event is
+		// reported to the moment the thread is resumed.
+		run_stats::clock::time_point event_time;
+		if (opts.stats)
+			event_time = run_stats::clock::now();
 
 		DWORD disp = DBG_EXCEPTION_NOT_HANDLED;
+		bool our_trap = false;
 
 		process_info * pi;
 		if (de.dwDebugEventCode == CREATE_PROCESS_DEBUG_EVENT)
@@ -282,8 +523,12 @@ coverage_info capture_coverage(std::wstring cmdline, std::wstring const & sympat
 		{
 		case CREATE_PROCESS_DEBUG_EVENT:
 		{
-			SymInitializeW(hProcess, sympath.c_str(), FALSE);
+			SymInitializeW(hProcess, opts.sympath.c_str(), FALSE);
 			pi->threads[de.dwThreadId] = de.u.CreateProcessInfo.hThread;
+			if (opts.stats)
+				opts.stats->count(counter_processes);
+			if (bkpts.per_process)
+				bkpts.start_process(hProcess, de.dwProcessId, get_process_image(hProcess), get_process_cmdline(hProcess));
 			load_module(hProcess, de.u.CreateProcessInfo.hFile, (DWORD64)de.u.CreateProcessInfo.lpBaseOfImage);
 			CloseHandle(de.u.CreateProcessInfo.hFile);
 			break;
@@ -300,26 +545,15 @@ coverage_info capture_coverage(std::wstring cmdline, std::wstring const & sympat
 		case EXIT_PROCESS_DEBUG_EVENT:
 			assert(pi->threads.size() == 1);
 			SymCleanup(hProcess);
+			bkpts.remove_process(hProcess);
 			process_handles.erase(de.dwProcessId);
 			if (process_handles.empty())
 			{
 				ContinueDebugEvent(de.dwProcessId, de.dwThreadId, DBG_EXCEPTION_NOT_HANDLED);
 
-				coverage_info ci;
-				for (auto && pdb_kv: bkpts.pdbs)
-				{
-					pdb_coverage_info & pdb_info = ci.pdbs[pdb_kv.first];
-					pdb_info.image_size = pdb_kv.second.image_size;
-					pdb_info.timestamp = pdb_kv.second.timestamp;
-					pdb_info.filename = pdb_kv.second.filename;
-					pdb_info.cv = std::move(pdb_kv.second.cv);
-					for (auto && addr_kv: pdb_kv.second.addrs)
-					{
-						if (addr_kv.second.covered)
-							pdb_info.addrs_covered.push_back(addr_kv.first);
-					}
-				}
-				return ci;
+				if (attach)
+					SetConsoleCtrlHandler(&on_console_ctrl, FALSE);
+				return bkpts.get_coverage();
 			}
 			break;
 
@@ -331,7 +565,7 @@ coverage_info capture_coverage(std::wstring cmdline, std::wstring const & sympat
 		}
 
 		case UNLOAD_DLL_DEBUG_EVENT:
-			// XXX: clear bkpt state
+			bkpts.remove_module(hProcess, (DWORD64)de.u.UnloadDll.lpBaseOfDll);
 			SymUnloadModule64(hProcess, (DWORD64)de.u.UnloadDll.lpBaseOfDll);
 			break;
 
@@ -340,10 +574,47 @@ coverage_info capture_coverage(std::wstring cmdline, std::wstring const & sympat
 				&& (de.u.Exception.ExceptionRecord.ExceptionCode == STATUS_BREAKPOINT || de.u.Exception.ExceptionRecord.ExceptionCode == 0x4000001f))
 			{
 				disp = process_breakpoint(hProcess, pi->threads[de.dwThreadId], de.u.Exception);
+				our_trap = disp == DBG_CONTINUE;
 			}
 			break;
 		}
 
 		ContinueDebugEvent(de.dwProcessId, de.dwThreadId, disp);
+
+		if (our_trap && opts.stats)
+		{
+			auto latency = std::chrono::duration_cast<std::chrono::microseconds>(run_stats::clock::now() - event_time);
+			opts.stats->count(counter_traps);
+			opts.stats->sample(histogram_trap_latency_us, (uint64_t)latency.count());
+		}
+	}
+}
+
+coverage_info capture_coverage(std::wstring cmdline, capture_options const & opts)
+{
+	STARTUPINFOW si = { sizeof si };
+	PROCESS_INFORMATION pi;
+	if (!CreateProcessW(nullptr, &cmdline[0], nullptr, nullptr, FALSE,
+		DEBUG_PROCESS, nullptr, nullptr, &si, &pi))
+	{
+		throw std::runtime_error("can't create process");
 	}
+
+	CloseHandle(pi.hThread);
+	CloseHandle(pi.hProcess);
+
+	return debug_processes(opts, nullptr);
 }
+
+coverage_info attach_coverage(uint32_t pid, attach_options const & opts)
+{
+	// The debuggee reports its loaded modules and threads as if they were
+	// just created, so it's handled just like a launched one.
+	if (!DebugActiveProcess(pid))
+		throw std::runtime_error("can't attach to process");
+	DebugSetProcessKillOnExit(FALSE);
+
+	return debug_processes(opts, &opts);
+}
+
+#endif // _WIN32
@@ -6,8 +6,25 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <iosfwd>
+#include <functional>
 #include <stdint.h>
 
+struct run_stats;
+
+// What one process image covered of a module, see
+// `capture_options::per_process`.
+struct process_coverage_info
+{
+	uint32_t pid;
+	std::wstring image;
+	std::wstring cmdline;
+	std::vector<uint64_t> addrs_covered;
+
+	// Either empty, or the number of sampled hits of each address.
+	std::vector<uint32_t> hit_counts;
+};
+
 struct pdb_coverage_info
 {
 	std::wstring filename;
@@ -15,41 +32,178 @@ struct pdb_coverage_info
 	uint32_t timestamp;
 	std::vector<uint8_t> cv;
 	std::vector<uint64_t> addrs_covered;
+
+	// Either empty, or the number of runs that covered each address
+	// in `addrs_covered`, saturated at 0xffff.
+	std::vector<uint16_t> run_counts;
+
+	// Either empty, or the number of sampled hits of each address
+	// in `addrs_covered`, see `capture_options::sample_ms`.
+	std::vector<uint32_t> hit_counts;
+
+	// The coverage of each process image that loaded the module, if it
+	// was captured per process; `addrs_covered` is then their union.
+	std::vector<process_coverage_info> processes;
 };
 
 struct coverage_info
 {
 	std::map<guid, pdb_coverage_info> pdbs;
 
+	// Merges `ci` in. If either side of a module has run counts, so does
+	// the result, with the other side counting as a single run.
 	void merge(coverage_info && ci);
 
+	// Merges all inputs at once, combining each module's addresses in
+	// a single pass; modules are merged on up to `threads` threads, zero
+	// meaning one per hardware thread. Like with `merge`, a module has run
+	// counts in the result if any of its inputs has them, with inputs that
+	// have none counting as a single run; `count_runs` makes every module
+	// count runs.
+	static coverage_info merge_all(std::vector<coverage_info> && inputs, bool count_runs = false, unsigned threads = 0);
+
+	// Reads either the JSON or the binary format.
 	static coverage_info load(std::istream & in);
+
+	// Like `load`, but maps the file instead of reading it if it's in
+	// the binary format. Returns false if the file can't be opened.
+	static bool load_file(std::wstring const & fname, coverage_info & res);
+
 	void store(std::ostream & out);
+	void store_binary(std::ostream & out);
+};
+
+struct capture_options
+{
+	std::wstring sympath;
+
+	// If not empty, module line tables are read from and stored to
+	// this directory, see line_cache.h.
+	std::wstring cache_dir;
+
+	// Arm only function entries when a module is loaded and arm the rest
+	// of a function's lines when it is first entered.
+	bool lazy;
+
+	// Split functions into basic blocks and arm only the first address of
+	// each block; a hit then covers every line address in the block.
+	bool blocks;
+
+	// Keep coverage for each process image separately, attributing each
+	// hit to the process that made it. A hit then only removes
+	// the breakpoint from that process, instead of from all processes
+	// sharing the module.
+	bool per_process;
+
+	// If set, the time spent arming each module is reported there.
+	std::wostream * log;
+
+	// If not zero, breakpoints aren't one-shot: each hit is counted, and
+	// the breakpoints that were hit are re-armed every `sample_ms`
+	// milliseconds. An address' count is then roughly the number of
+	// periods it ran in; shorter periods give finer counts, but cost
+	// more traps.
+	unsigned sample_ms;
+
+	// If set, counts and times the work done, see stats.h: symbols read,
+	// breakpoints armed, memory accesses, traps and their latency.
+	run_stats * stats;
+
+	capture_options()
+		: lazy(false), blocks(false), per_process(false), log(nullptr), sample_ms(0), stats(nullptr)
+	{
+	}
 };
 
-coverage_info capture_coverage(std::wstring cmdline, std::wstring const & sympath);
+coverage_info capture_coverage(std::wstring cmdline, capture_options const & opts);
+
+struct attach_options
+	: capture_options
+{
+	// Called with the coverage gathered so far whenever a snapshot is
+	// requested: by SIGUSR1 (Ctrl+Break on Windows), or by creating
+	// `control_file`. The debuggee runs on meanwhile, only threads
+	// hitting a breakpoint wait for the call to return.
+	std::function<void(coverage_info &&)> snapshot;
+
+	// If not empty, this file is polled for; once it appears, it's
+	// removed and a snapshot is taken, or, if it says "detach", the
+	// debugger detaches. SIGINT and SIGTERM (Ctrl+C on Windows) detach
+	// as well.
+	std::wstring control_file;
+};
+
+// Attaches to the running process `pid`, arms breakpoints in the modules
+// it has loaded and in those it loads later, and traces it until it exits
+// or until a detach is requested. Before detaching, the original code is
+// put back everywhere. Returns the coverage gathered.
+coverage_info attach_coverage(uint32_t pid, attach_options const & opts);
 
 struct coverage_line_info
 {
 	uint64_t line;
 	uint64_t total_addresses;
 	uint64_t covered;
+
+	// The most runs that covered any of the line's addresses, if
+	// the report has run counts.
+	uint64_t runs;
+
+	// The most sampled hits of any of the line's addresses, if
+	// the report has hit counts.
+	uint64_t hits;
 };
 
-struct coverage_file_report
+struct coverage_report
 {
-	std::wstring filename;
+	// The source files in order; the lines of `files[i]` are
+	// `lines[file_lines[i]]` up to `lines[file_lines[i + 1]]`.
+	std::vector<std::wstring> files;
+	std::vector<size_t> file_lines;
 	std::vector<coverage_line_info> lines;
+
+	// The JSON form has a run count for each line if either is set,
+	// followed by a hit count if `has_hit_counts` is set.
+	bool has_run_counts;
+	bool has_hit_counts;
+
+	coverage_report()
+		: has_run_counts(false), has_hit_counts(false)
+	{
+	}
+
+	void store(std::ostream & out);
 };
 
-struct coverage_report
+struct report_options
 {
-	std::vector<coverage_file_report> files;
+	std::wstring sympath;
 
-	void store(std::ostream & out);
+	// If not empty, module line tables are read from and stored to
+	// this directory, see line_cache.h.
+	std::wstring cache_dir;
+
+	// The number of threads to process modules on, zero meaning one
+	// per hardware thread.
+	unsigned threads;
+
+	// If set, counts and times the work done on each module, see stats.h.
+	run_stats * stats;
+
+	report_options()
+		: threads(0), stats(nullptr)
+	{
+	}
 };
 
-coverage_report report(coverage_info const & ci, std::wstring const & sympath);
+coverage_report report(coverage_info const & ci, report_options const & opts);
+
+// Writes the same output as `report(ci, opts).store(out)`, but without
+// building the report in memory: each module's partial report goes to
+// a temporary file as soon as it's done, and the source files are written
+// out as they're merged from there. Only the modules being processed
+// are kept in memory.
+void store_report(coverage_info const & ci, report_options const & opts, std::ostream & out);
 
 
 #endif // DEBUGGER_LOOP_H
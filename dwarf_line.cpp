@@ -0,0 +1,828 @@
+#include "dwarf_line.h"
+#include "parallel.h"
+#include <stdexcept>
+#include <algorithm>
+#include <map>
+#include <cstring>
+
+namespace {
+
+enum
+{
+	DW_LNS_copy = 1,
+	DW_LNS_advance_pc = 2,
+	DW_LNS_advance_line = 3,
+	DW_LNS_set_file = 4,
+	DW_LNS_set_column = 5,
+	DW_LNS_negate_stmt = 6,
+	DW_LNS_set_basic_block = 7,
+	DW_LNS_const_add_pc = 8,
+	DW_LNS_fixed_advance_pc = 9,
+	DW_LNS_set_prologue_end = 10,
+	DW_LNS_set_epilogue_begin = 11,
+	DW_LNS_set_isa = 12,
+};
+
+enum
+{
+	DW_LNE_end_sequence = 1,
+	DW_LNE_set_address = 2,
+	DW_LNE_define_file = 3,
+	DW_LNE_set_discriminator = 4,
+};
+
+enum
+{
+	DW_LNCT_path = 1,
+	DW_LNCT_directory_index = 2,
+};
+
+enum
+{
+	DW_FORM_addr = 0x01,
+	DW_FORM_block2 = 0x03,
+	DW_FORM_block4 = 0x04,
+	DW_FORM_data2 = 0x05,
+	DW_FORM_data4 = 0x06,
+	DW_FORM_data8 = 0x07,
+	DW_FORM_string = 0x08,
+	DW_FORM_block = 0x09,
+	DW_FORM_block1 = 0x0a,
+	DW_FORM_data1 = 0x0b,
+	DW_FORM_flag = 0x0c,
+	DW_FORM_sdata = 0x0d,
+	DW_FORM_strp = 0x0e,
+	DW_FORM_udata = 0x0f,
+	DW_FORM_ref_addr = 0x10,
+	DW_FORM_ref1 = 0x11,
+	DW_FORM_ref2 = 0x12,
+	DW_FORM_ref4 = 0x13,
+	DW_FORM_ref8 = 0x14,
+	DW_FORM_ref_udata = 0x15,
+	DW_FORM_indirect = 0x16,
+	DW_FORM_sec_offset = 0x17,
+	DW_FORM_exprloc = 0x18,
+	DW_FORM_flag_present = 0x19,
+	DW_FORM_strx = 0x1a,
+	DW_FORM_addrx = 0x1b,
+	DW_FORM_ref_sup4 = 0x1c,
+	DW_FORM_strp_sup = 0x1d,
+	DW_FORM_data16 = 0x1e,
+	DW_FORM_line_strp = 0x1f,
+	DW_FORM_ref_sig8 = 0x20,
+	DW_FORM_implicit_const = 0x21,
+	DW_FORM_loclistx = 0x22,
+	DW_FORM_rnglistx = 0x23,
+	DW_FORM_ref_sup8 = 0x24,
+	DW_FORM_strx1 = 0x25,
+	DW_FORM_strx2 = 0x26,
+	DW_FORM_strx3 = 0x27,
+	DW_FORM_strx4 = 0x28,
+	DW_FORM_addrx1 = 0x29,
+	DW_FORM_addrx2 = 0x2a,
+	DW_FORM_addrx3 = 0x2b,
+	DW_FORM_addrx4 = 0x2c,
+	DW_FORM_GNU_addr_index = 0x1f01,
+	DW_FORM_GNU_str_index = 0x1f02,
+	DW_FORM_GNU_ref_alt = 0x1f20,
+	DW_FORM_GNU_strp_alt = 0x1f21,
+};
+
+enum
+{
+	DW_AT_name = 0x03,
+	DW_AT_stmt_list = 0x10,
+	DW_AT_comp_dir = 0x1b,
+	DW_AT_str_offsets_base = 0x72,
+};
+
+enum
+{
+	DW_UT_compile = 0x01,
+	DW_UT_partial = 0x03,
+	DW_UT_skeleton = 0x04,
+};
+
+struct dwarf_cursor
+{
+	uint8_t const * cur;
+	uint8_t const * last;
+
+	void need(size_t n) const
+	{
+		if ((size_t)(last - cur) < n)
+			throw std::runtime_error("truncated line-number program");
+	}
+
+	void skip(uint64_t n)
+	{
+		this->need(n);
+		cur += n;
+	}
+
+	template <typename T>
+	T fixed()
+	{
+		this->need(sizeof(T));
+		T res;
+		memcpy(&res, cur, sizeof res);
+		cur += sizeof res;
+		return res;
+	}
+
+	uint8_t u8()
+	{
+		this->need(1);
+		return *cur++;
+	}
+
+	uint64_t uleb()
+	{
+		uint64_t res = 0;
+		int shift = 0;
+		for (;;)
+		{
+			uint8_t b = this->u8();
+			if (shift < 64)
+				res |= (uint64_t)(b & 0x7f) << shift;
+			shift += 7;
+			if ((b & 0x80) == 0)
+				return res;
+		}
+	}
+
+	int64_t sleb()
+	{
+		uint64_t res = 0;
+		int shift = 0;
+		uint8_t b;
+		do
+		{
+			b = this->u8();
+			if (shift < 64)
+				res |= (uint64_t)(b & 0x7f) << shift;
+			shift += 7;
+		}
+		while (b & 0x80);
+
+		if (shift < 64 && (b & 0x40))
+			res |= ~0ull << shift;
+		return (int64_t)res;
+	}
+
+	uint64_t offset(bool dwarf64)
+	{
+		return dwarf64? this->fixed<uint64_t>(): this->fixed<uint32_t>();
+	}
+
+	uint64_t address(uint8_t size)
+	{
+		switch (size)
+		{
+		case 4:
+			return this->fixed<uint32_t>();
+		case 8:
+			return this->fixed<uint64_t>();
+		default:
+			throw std::runtime_error("unsupported address size");
+		}
+	}
+
+	string_view strz()
+	{
+		char const * s = (char const *)cur;
+		void const * e = memchr(cur, 0, last - cur);
+		if (!e)
+			throw std::runtime_error("unterminated string in line-number program");
+		cur = (uint8_t const *)e + 1;
+		return string_view(s, (char const *)e);
+	}
+};
+
+struct string_sections
+{
+	elf_section const * str;
+	elf_section const * line_str;
+	elf_section const * str_offsets;
+};
+
+static string_view section_strz(elf_section const * sect, uint64_t offset)
+{
+	if (!sect || !sect->data || offset >= sect->size)
+		throw std::runtime_error("string offset out of range");
+
+	dwarf_cursor c = { sect->data + offset, sect->data + sect->size };
+	return c.strz();
+}
+
+struct entry_format
+{
+	uint64_t content_type;
+	uint64_t form;
+};
+
+static std::vector<entry_format> read_entry_formats(dwarf_cursor & c)
+{
+	std::vector<entry_format> res(c.u8());
+	for (entry_format & fmt: res)
+	{
+		fmt.content_type = c.uleb();
+		fmt.form = c.uleb();
+	}
+	return res;
+}
+
+// Reads one directory or file entry of a version 5 header, keeping
+// the path and the directory index and skipping everything else.
+static void read_entry(dwarf_cursor & c, std::vector<entry_format> const & formats, bool dwarf64,
+	string_sections const & strs, string_view & path, uint64_t & dir_index)
+{
+	for (entry_format const & fmt: formats)
+	{
+		string_view str;
+		uint64_t num = 0;
+
+		switch (fmt.form)
+		{
+		case DW_FORM_string:
+			str = c.strz();
+			break;
+		case DW_FORM_line_strp:
+			str = section_strz(strs.line_str, c.offset(dwarf64));
+			break;
+		case DW_FORM_strp:
+			str = section_strz(strs.str, c.offset(dwarf64));
+			break;
+		case DW_FORM_udata:
+			num = c.uleb();
+			break;
+		case DW_FORM_data1:
+			num = c.u8();
+			break;
+		case DW_FORM_data2:
+			num = c.fixed<uint16_t>();
+			break;
+		case DW_FORM_data4:
+			num = c.fixed<uint32_t>();
+			break;
+		case DW_FORM_data8:
+			num = c.fixed<uint64_t>();
+			break;
+		case DW_FORM_data16:
+			c.skip(16);
+			break;
+		case DW_FORM_block:
+			c.skip(c.uleb());
+			break;
+		default:
+			throw std::runtime_error("unsupported form in line-number program header");
+		}
+
+		if (fmt.content_type == DW_LNCT_path)
+			path = str;
+		else if (fmt.content_type == DW_LNCT_directory_index)
+			dir_index = num;
+	}
+}
+
+static std::string join_path(string_view dir, string_view name)
+{
+	if (dir.empty() || (!name.empty() && name[0] == '/'))
+		return name;
+
+	std::string res = dir;
+	if (res.back() != '/')
+		res.push_back('/');
+	res.append(name.begin(), name.end());
+	return res;
+}
+
+// Line-number programs before version 5 leave out the compilation
+// directory and the primary source file; they're taken from the unit
+// in .debug_info whose DW_AT_stmt_list points at the program.
+struct unit_paths
+{
+	string_view comp_dir;
+	string_view name;
+};
+
+// Reads the value of an attribute of the given form. Strings are returned
+// in `str` where we can resolve them, constants and offsets in `num` and
+// string indices in `index`; anything else is skipped.
+static void read_attr(dwarf_cursor & c, uint64_t form, int64_t implicit_const, uint16_t version, uint8_t address_size,
+	bool dwarf64, string_sections const & strs, string_view & str, uint64_t & num, uint64_t & index)
+{
+	switch (form)
+	{
+	case DW_FORM_string:
+		str = c.strz();
+		break;
+	case DW_FORM_strp:
+		str = section_strz(strs.str, c.offset(dwarf64));
+		break;
+	case DW_FORM_line_strp:
+		str = section_strz(strs.line_str, c.offset(dwarf64));
+		break;
+	case DW_FORM_strx:
+	case DW_FORM_GNU_str_index:
+		index = c.uleb();
+		break;
+	case DW_FORM_strx1:
+		index = c.u8();
+		break;
+	case DW_FORM_strx2:
+		index = c.fixed<uint16_t>();
+		break;
+	case DW_FORM_strx3:
+		index = c.fixed<uint16_t>();
+		index |= (uint64_t)c.u8() << 16;
+		break;
+	case DW_FORM_strx4:
+		index = c.fixed<uint32_t>();
+		break;
+	case DW_FORM_data1:
+	case DW_FORM_flag:
+	case DW_FORM_ref1:
+	case DW_FORM_addrx1:
+		num = c.u8();
+		break;
+	case DW_FORM_data2:
+	case DW_FORM_ref2:
+	case DW_FORM_addrx2:
+		num = c.fixed<uint16_t>();
+		break;
+	case DW_FORM_addrx3:
+		c.skip(3);
+		break;
+	case DW_FORM_data4:
+	case DW_FORM_ref4:
+	case DW_FORM_ref_sup4:
+	case DW_FORM_addrx4:
+		num = c.fixed<uint32_t>();
+		break;
+	case DW_FORM_data8:
+	case DW_FORM_ref8:
+	case DW_FORM_ref_sig8:
+	case DW_FORM_ref_sup8:
+		num = c.fixed<uint64_t>();
+		break;
+	case DW_FORM_data16:
+		c.skip(16);
+		break;
+	case DW_FORM_udata:
+	case DW_FORM_ref_udata:
+	case DW_FORM_addrx:
+	case DW_FORM_loclistx:
+	case DW_FORM_rnglistx:
+	case DW_FORM_GNU_addr_index:
+		num = c.uleb();
+		break;
+	case DW_FORM_sdata:
+		num = (uint64_t)c.sleb();
+		break;
+	case DW_FORM_implicit_const:
+		num = (uint64_t)implicit_const;
+		break;
+	case DW_FORM_flag_present:
+		num = 1;
+		break;
+	case DW_FORM_addr:
+		num = c.address(address_size);
+		break;
+	case DW_FORM_ref_addr:
+		num = version <= 2? c.address(address_size): c.offset(dwarf64);
+		break;
+	case DW_FORM_sec_offset:
+	case DW_FORM_strp_sup:
+	case DW_FORM_GNU_ref_alt:
+	case DW_FORM_GNU_strp_alt:
+		num = c.offset(dwarf64);
+		break;
+	case DW_FORM_block1:
+		c.skip(c.u8());
+		break;
+	case DW_FORM_block2:
+		c.skip(c.fixed<uint16_t>());
+		break;
+	case DW_FORM_block4:
+		c.skip(c.fixed<uint32_t>());
+		break;
+	case DW_FORM_block:
+	case DW_FORM_exprloc:
+		c.skip(c.uleb());
+		break;
+	case DW_FORM_indirect:
+		read_attr(c, c.uleb(), implicit_const, version, address_size, dwarf64, strs, str, num, index);
+		break;
+	default:
+		throw std::runtime_error("unsupported form in debug information");
+	}
+}
+
+// Finds the attribute list of abbreviation `code` in the table at `offset`.
+static dwarf_cursor find_abbrev(elf_section const * debug_abbrev, uint64_t offset, uint64_t code)
+{
+	if (offset >= debug_abbrev->size)
+		throw std::runtime_error("abbreviation offset out of range");
+
+	dwarf_cursor c = { debug_abbrev->data + offset, debug_abbrev->data + debug_abbrev->size };
+	for (;;)
+	{
+		uint64_t cur_code = c.uleb();
+		if (cur_code == 0)
+			throw std::runtime_error("missing abbreviation");
+
+		c.uleb(); // tag
+		c.u8(); // children
+		if (cur_code == code)
+			return c;
+
+		for (;;)
+		{
+			uint64_t attr = c.uleb();
+			uint64_t form = c.uleb();
+			if (form == DW_FORM_implicit_const)
+				c.sleb();
+			if (attr == 0 && form == 0)
+				break;
+		}
+	}
+}
+
+// Reads the root DIE of every compilation unit in .debug_info, keyed
+// by the offset of its line-number program.
+static std::map<uint64_t, unit_paths> read_unit_paths(elf_file const & elf, string_sections const & strs)
+{
+	std::map<uint64_t, unit_paths> res;
+
+	elf_section const * debug_info = elf.find_section(".debug_info");
+	elf_section const * debug_abbrev = elf.find_section(".debug_abbrev");
+	if (!debug_info || !debug_info->data || (debug_info->flags & elf_file::shf_compressed)
+		|| !debug_abbrev || !debug_abbrev->data || (debug_abbrev->flags & elf_file::shf_compressed))
+	{
+		return res;
+	}
+
+	dwarf_cursor c = { debug_info->data, debug_info->data + debug_info->size };
+	while (c.cur != c.last)
+	{
+		uint64_t unit_length = c.fixed<uint32_t>();
+		bool dwarf64 = unit_length == 0xffffffff;
+		if (dwarf64)
+			unit_length = c.fixed<uint64_t>();
+
+		c.need(unit_length);
+		dwarf_cursor unit = { c.cur, c.cur + unit_length };
+		c.cur += unit_length;
+
+		uint16_t version = unit.fixed<uint16_t>();
+		if (version < 2 || version > 5)
+			continue;
+
+		uint64_t abbrev_offset;
+		uint8_t address_size;
+		if (version >= 5)
+		{
+			uint8_t unit_type = unit.u8();
+			if (unit_type != DW_UT_compile && unit_type != DW_UT_partial && unit_type != DW_UT_skeleton)
+				continue;
+
+			address_size = unit.u8();
+			abbrev_offset = unit.offset(dwarf64);
+			if (unit_type == DW_UT_skeleton)
+				unit.skip(8); // dwo_id
+		}
+		else
+		{
+			abbrev_offset = unit.offset(dwarf64);
+			address_size = unit.u8();
+		}
+
+		uint64_t code = unit.uleb();
+		if (code == 0)
+			continue;
+
+		dwarf_cursor abbrev = find_abbrev(debug_abbrev, abbrev_offset, code);
+
+		unit_paths paths;
+		bool has_stmt_list = false;
+		uint64_t stmt_list = 0;
+		uint64_t str_offsets_base = dwarf64? 16: 8;
+		uint64_t name_index = ~0ull;
+		uint64_t comp_dir_index = ~0ull;
+
+		for (;;)
+		{
+			uint64_t attr = abbrev.uleb();
+			uint64_t form = abbrev.uleb();
+			int64_t implicit_const = form == DW_FORM_implicit_const? abbrev.sleb(): 0;
+			if (attr == 0 && form == 0)
+				break;
+
+			string_view str;
+			uint64_t num = 0;
+			uint64_t index = ~0ull;
+			read_attr(unit, form, implicit_const, version, address_size, dwarf64, strs, str, num, index);
+
+			switch (attr)
+			{
+			case DW_AT_name:
+				paths.name = str;
+				name_index = index;
+				break;
+			case DW_AT_comp_dir:
+				paths.comp_dir = str;
+				comp_dir_index = index;
+				break;
+			case DW_AT_stmt_list:
+				stmt_list = num;
+				has_stmt_list = true;
+				break;
+			case DW_AT_str_offsets_base:
+				str_offsets_base = num;
+				break;
+			}
+		}
+
+		if (!has_stmt_list)
+			continue;
+
+		// Indexed strings can only be looked up once the base is known,
+		// which may come after them.
+		auto indexed_str = [&](uint64_t index) {
+			uint64_t offset_size = dwarf64? 8: 4;
+			if (index == ~0ull || !strs.str_offsets || !strs.str_offsets->data
+				|| str_offsets_base + (index + 1) * offset_size > strs.str_offsets->size)
+			{
+				return string_view();
+			}
+
+			dwarf_cursor entry = { strs.str_offsets->data + str_offsets_base + index * offset_size, strs.str_offsets->data + strs.str_offsets->size };
+			return section_strz(strs.str, entry.offset(dwarf64));
+		};
+
+		if (name_index != ~0ull)
+			paths.name = indexed_str(name_index);
+		if (comp_dir_index != ~0ull)
+			paths.comp_dir = indexed_str(comp_dir_index);
+
+		res[stmt_list] = paths;
+	}
+
+	return res;
+}
+
+static void decode_unit(dwarf_cursor c, string_sections const & strs, unit_paths const & paths, line_table & unit)
+{
+	uint64_t unit_length = c.fixed<uint32_t>();
+	bool dwarf64 = unit_length == 0xffffffff;
+	if (dwarf64)
+		unit_length = c.fixed<uint64_t>();
+
+	c.need(unit_length);
+	c.last = c.cur + unit_length;
+
+	uint16_t version = c.fixed<uint16_t>();
+	if (version < 2 || version > 5)
+		throw std::runtime_error("unsupported line-number program version");
+
+	uint8_t address_size = 8;
+	if (version >= 5)
+	{
+		address_size = c.u8();
+		c.u8(); // segment_selector_size
+	}
+
+	uint64_t header_length = c.offset(dwarf64);
+	c.need(header_length);
+	dwarf_cursor program = { c.cur + header_length, c.last };
+
+	uint8_t min_inst_length = c.u8();
+	if (version >= 4)
+		c.u8(); // maximum_operations_per_instruction
+	bool default_is_stmt = c.u8() != 0;
+	int8_t line_base = (int8_t)c.u8();
+	uint8_t line_range = c.u8();
+	uint8_t opcode_base = c.u8();
+
+	if (line_range == 0)
+		throw std::runtime_error("invalid line range");
+
+	uint8_t const * std_opcode_lengths = c.cur;
+	c.skip(opcode_base == 0? 0: opcode_base - 1);
+
+	std::vector<std::string> dirs;
+	if (version >= 5)
+	{
+		std::vector<entry_format> dir_formats = read_entry_formats(c);
+		uint64_t dir_count = c.uleb();
+		for (uint64_t i = 0; i < dir_count; ++i)
+		{
+			string_view path;
+			uint64_t dir_index = 0;
+			read_entry(c, dir_formats, dwarf64, strs, path, dir_index);
+
+			// Directory zero is the compilation directory, the others
+			// may be relative to it.
+			dirs.push_back(dirs.empty()? std::string(path): join_path(dirs[0], path));
+		}
+
+		std::vector<entry_format> file_formats = read_entry_formats(c);
+		uint64_t file_count = c.uleb();
+		for (uint64_t i = 0; i < file_count; ++i)
+		{
+			string_view path;
+			uint64_t dir_index = 0;
+			read_entry(c, file_formats, dwarf64, strs, path, dir_index);
+			unit.files.push_back(join_path(dir_index < dirs.size()? string_view(dirs[dir_index]): string_view(), path));
+		}
+	}
+	else
+	{
+		// Before version 5, directory and file indices are one-based and
+		// index zero refers to the compilation directory and the primary
+		// source file, neither of which is listed in the header.
+		dirs.push_back(paths.comp_dir);
+		for (;;)
+		{
+			string_view dir = c.strz();
+			if (dir.empty())
+				break;
+			dirs.push_back(join_path(paths.comp_dir, dir));
+		}
+
+		unit.files.push_back(paths.name.empty()? std::string(): join_path(paths.comp_dir, paths.name));
+		for (;;)
+		{
+			string_view name = c.strz();
+			if (name.empty())
+				break;
+
+			uint64_t dir_index = c.uleb();
+			c.uleb(); // mtime
+			c.uleb(); // length
+			unit.files.push_back(join_path(dir_index < dirs.size()? string_view(dirs[dir_index]): string_view(), name));
+		}
+	}
+
+	uint64_t address = 0;
+	uint64_t file = 1;
+	int64_t line = 1;
+	bool is_stmt = default_is_stmt;
+
+	auto reset = [&]() {
+		address = 0;
+		file = 1;
+		line = 1;
+		is_stmt = default_is_stmt;
+	};
+
+	auto emit = [&]() {
+		if (!is_stmt)
+			return;
+
+		line_table_row row;
+		row.address = address;
+		row.file = file < unit.files.size()? (uint32_t)file: 0;
+		row.line = (uint32_t)line;
+		unit.rows.push_back(row);
+	};
+
+	c = program;
+	while (c.cur != c.last)
+	{
+		uint8_t opcode = c.u8();
+		if (opcode >= opcode_base)
+		{
+			uint8_t adjusted = opcode - opcode_base;
+			address += (uint64_t)min_inst_length * (adjusted / line_range);
+			line += line_base + adjusted % line_range;
+			emit();
+			continue;
+		}
+
+		switch (opcode)
+		{
+		case 0:
+		{
+			uint64_t len = c.uleb();
+			c.need(len);
+			dwarf_cursor ext = { c.cur, c.cur + len };
+			c.cur += len;
+
+			if (len == 0)
+				break;
+
+			switch (ext.u8())
+			{
+			case DW_LNE_end_sequence:
+				reset();
+				break;
+			case DW_LNE_set_address:
+				address = ext.address(version >= 5? address_size: (uint8_t)(len - 1));
+				break;
+			case DW_LNE_define_file:
+			{
+				string_view name = ext.strz();
+				uint64_t dir_index = ext.uleb();
+				unit.files.push_back(join_path(dir_index < dirs.size()? string_view(dirs[dir_index]): string_view(), name));
+				break;
+			}
+			}
+			break;
+		}
+		case DW_LNS_copy:
+			emit();
+			break;
+		case DW_LNS_advance_pc:
+			address += c.uleb() * min_inst_length;
+			break;
+		case DW_LNS_advance_line:
+			line += c.sleb();
+			break;
+		case DW_LNS_set_file:
+			file = c.uleb();
+			break;
+		case DW_LNS_negate_stmt:
+			is_stmt = !is_stmt;
+			break;
+		case DW_LNS_const_add_pc:
+			address += (uint64_t)min_inst_length * ((255 - opcode_base) / line_range);
+			break;
+		case DW_LNS_fixed_advance_pc:
+			address += c.fixed<uint16_t>();
+			break;
+		default:
+			// DW_LNS_set_column, DW_LNS_set_isa and any opcodes we don't know
+			// about take a number of uleb arguments given by the header.
+			for (uint8_t i = 0; i < std_opcode_lengths[opcode - 1]; ++i)
+				c.uleb();
+			break;
+		}
+	}
+}
+
+}
+
+line_table dwarf_read_line_table(elf_file const & elf, unsigned threads)
+{
+	elf_section const * debug_line = elf.find_section(".debug_line");
+	if (!debug_line || !debug_line->data || (debug_line->flags & elf_file::shf_compressed))
+		return line_table();
+
+	string_sections strs = { elf.find_section(".debug_str"), elf.find_section(".debug_line_str"), elf.find_section(".debug_str_offsets") };
+	std::map<uint64_t, unit_paths> paths = read_unit_paths(elf, strs);
+
+	// Unit headers only need their length read to find the next one,
+	// so the units are located serially and decoded in parallel.
+	std::vector<dwarf_cursor> unit_ranges;
+
+	dwarf_cursor c = { debug_line->data, debug_line->data + debug_line->size };
+	while (c.cur != c.last)
+	{
+		uint8_t const * unit_start = c.cur;
+
+		uint64_t unit_length = c.fixed<uint32_t>();
+		if (unit_length == 0xffffffff)
+			unit_length = c.fixed<uint64_t>();
+		c.skip(unit_length);
+
+		unit_ranges.push_back(dwarf_cursor{ unit_start, c.cur });
+	}
+
+	std::vector<line_table> units(unit_ranges.size());
+	parallel_for(units.size(), threads, [&](size_t i) {
+		auto it = paths.find((uint64_t)(unit_ranges[i].cur - debug_line->data));
+		decode_unit(unit_ranges[i], strs, it != paths.end()? it->second: unit_paths(), units[i]);
+	});
+
+	return join_line_tables(units);
+}
+
+bool dwarf_read_module_lines(module_lines & res, std::wstring const & image_path, string_view build_id,
+	std::vector<std::wstring> const & debug_dirs, unsigned threads)
+{
+	elf_file elf;
+	res.filename = open_elf_debug_file(elf, image_path, build_id, debug_dirs);
+	if (res.filename.empty())
+		return false;
+
+	res.lines = dwarf_read_line_table(elf, threads);
+
+	auto last = std::remove_if(res.lines.rows.begin(), res.lines.rows.end(), [&](line_table_row const & row) {
+		return !elf.is_code_address(row.address);
+	});
+	res.lines.rows.erase(last, res.lines.rows.end());
+
+	for (line_table_row & row: res.lines.rows)
+		row.address -= elf.image_base();
+
+	res.functions = elf.functions();
+	for (auto & fn: res.functions)
+	{
+		fn.first -= elf.image_base();
+		fn.second -= elf.image_base();
+	}
+
+	return true;
+}
@@ -0,0 +1,23 @@
+#ifndef DWARF_LINE_H
+#define DWARF_LINE_H
+
+#include "elf_file.h"
+#include "line_table.h"
+
+// Decodes every line-number program in the .debug_line section of `elf`,
+// spreading the units over `threads` worker threads (zero meaning one per
+// hardware thread). Only rows that start a statement are kept and
+// end-of-sequence markers are dropped; paths are joined with their include
+// directory and, if that's relative, with the compilation directory, which
+// units before version 5 take from .debug_info. Supports DWARF versions 2 to 5; the table is empty
+// if the image has no (uncompressed) line information.
+line_table dwarf_read_line_table(elf_file const & elf, unsigned threads = 0);
+
+// Finds the debug file of the ELF image with the given build id (see
+// `open_elf_debug_file`) and reads its line table and function ranges
+// relative to the image base. Returns false if there's no debug file;
+// throws if its line information is compressed or damaged.
+bool dwarf_read_module_lines(module_lines & res, std::wstring const & image_path, string_view build_id,
+	std::vector<std::wstring> const & debug_dirs, unsigned threads = 0);
+
+#endif // DWARF_LINE_H
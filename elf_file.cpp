@@ -0,0 +1,434 @@
+#include "elf_file.h"
+#include "utils.h"
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+struct elf64_ehdr
+{
+	uint8_t e_ident[16];
+	uint16_t e_type;
+	uint16_t e_machine;
+	uint32_t e_version;
+	uint64_t e_entry;
+	uint64_t e_phoff;
+	uint64_t e_shoff;
+	uint32_t e_flags;
+	uint16_t e_ehsize;
+	uint16_t e_phentsize;
+	uint16_t e_phnum;
+	uint16_t e_shentsize;
+	uint16_t e_shnum;
+	uint16_t e_shstrndx;
+};
+
+struct elf64_phdr
+{
+	uint32_t p_type;
+	uint32_t p_flags;
+	uint64_t p_offset;
+	uint64_t p_vaddr;
+	uint64_t p_paddr;
+	uint64_t p_filesz;
+	uint64_t p_memsz;
+	uint64_t p_align;
+};
+
+struct elf64_shdr
+{
+	uint32_t sh_name;
+	uint32_t sh_type;
+	uint64_t sh_flags;
+	uint64_t sh_addr;
+	uint64_t sh_offset;
+	uint64_t sh_size;
+	uint32_t sh_link;
+	uint32_t sh_info;
+	uint64_t sh_addralign;
+	uint64_t sh_entsize;
+};
+
+struct elf64_sym
+{
+	uint32_t st_name;
+	uint8_t st_info;
+	uint8_t st_other;
+	uint16_t st_shndx;
+	uint64_t st_value;
+	uint64_t st_size;
+};
+
+static uint32_t const sht_note = 7;
+static uint8_t const stt_func = 2;
+static uint32_t const nt_gnu_build_id = 3;
+static uint64_t const page_size = 0x1000;
+
+template <typename T>
+T read_struct(uint8_t const * base, size_t size, uint64_t offset)
+{
+	if (offset > size || size - offset < sizeof(T))
+		throw std::runtime_error("truncated ELF file");
+
+	T res;
+	memcpy(&res, base + offset, sizeof res);
+	return res;
+}
+
+static string_view read_strz(uint8_t const * first, uint8_t const * last, uint64_t offset)
+{
+	if (offset >= (uint64_t)(last - first))
+		throw std::runtime_error("string offset out of range");
+
+	char const * s = (char const *)first + offset;
+	char const * e = (char const *)memchr(s, 0, (char const *)last - s);
+	if (!e)
+		throw std::runtime_error("unterminated string");
+	return string_view(s, e);
+}
+
+}
+
+bool elf_file::open(std::wstring const & fname)
+{
+	m_sections.clear();
+	m_segments.clear();
+	m_image_base = 0;
+	m_image_size = 0;
+	m_build_id_note = string_view();
+	m_build_id = string_view();
+	m_code_ranges.clear();
+
+	if (!m_file.open(fname))
+		return false;
+
+	uint8_t const * base = m_file.data();
+	size_t size = m_file.size();
+
+	if (size < sizeof(elf64_ehdr) || memcmp(base, "\x7f" "ELF", 4) != 0)
+		return false;
+
+	// ELFCLASS64, ELFDATA2LSB
+	if (base[4] != 2 || base[5] != 1)
+		return false;
+
+	elf64_ehdr eh = read_struct<elf64_ehdr>(base, size, 0);
+
+	if (eh.e_phnum != 0 && eh.e_phentsize < sizeof(elf64_phdr))
+		throw std::runtime_error("invalid program header size");
+
+	uint64_t lo = UINT64_MAX;
+	uint64_t hi = 0;
+	for (uint16_t i = 0; i < eh.e_phnum; ++i)
+	{
+		elf64_phdr ph = read_struct<elf64_phdr>(base, size, eh.e_phoff + (uint64_t)i * eh.e_phentsize);
+
+		elf_segment seg;
+		seg.type = ph.p_type;
+		seg.flags = ph.p_flags;
+		seg.offset = ph.p_offset;
+		seg.vaddr = ph.p_vaddr;
+		seg.filesz = ph.p_filesz;
+		seg.memsz = ph.p_memsz;
+		m_segments.push_back(seg);
+
+		if (ph.p_type == pt_load)
+		{
+			lo = (std::min)(lo, ph.p_vaddr);
+			hi = (std::max)(hi, ph.p_vaddr + ph.p_memsz);
+		}
+	}
+
+	if (lo <= hi)
+	{
+		m_image_base = lo & ~(page_size - 1);
+		m_image_size = ((hi + page_size - 1) & ~(page_size - 1)) - m_image_base;
+	}
+
+	if (eh.e_shnum != 0)
+	{
+		if (eh.e_shentsize < sizeof(elf64_shdr))
+			throw std::runtime_error("invalid section header size");
+
+		std::vector<elf64_shdr> shdrs;
+		for (uint16_t i = 0; i < eh.e_shnum; ++i)
+			shdrs.push_back(read_struct<elf64_shdr>(base, size, eh.e_shoff + (uint64_t)i * eh.e_shentsize));
+
+		if (eh.e_shstrndx >= shdrs.size())
+			throw std::runtime_error("invalid section name table index");
+
+		elf64_shdr const & strtab = shdrs[eh.e_shstrndx];
+		if (strtab.sh_offset > size || size - strtab.sh_offset < strtab.sh_size)
+			throw std::runtime_error("truncated ELF file");
+
+		uint8_t const * names = base + strtab.sh_offset;
+		for (elf64_shdr const & sh: shdrs)
+		{
+			elf_section sect;
+			sect.name = read_strz(names, names + strtab.sh_size, sh.sh_name);
+			sect.type = sh.sh_type;
+			sect.flags = sh.sh_flags;
+			sect.addr = sh.sh_addr;
+			sect.size = sh.sh_size;
+			sect.data = nullptr;
+
+			if (sh.sh_type != sht_nobits)
+			{
+				if (sh.sh_offset > size || size - sh.sh_offset < sh.sh_size)
+					throw std::runtime_error("truncated ELF file");
+				sect.data = base + sh.sh_offset;
+			}
+
+			m_sections.push_back(sect);
+
+			if (sect.flags & shf_execinstr)
+				m_code_ranges.push_back(std::make_pair(sect.addr, sect.addr + sect.size));
+		}
+
+		std::sort(m_code_ranges.begin(), m_code_ranges.end());
+	}
+
+	for (elf_section const & sect: m_sections)
+	{
+		if (sect.type != sht_note || !sect.data)
+			continue;
+
+		uint8_t const * cur = sect.data;
+		uint8_t const * last = sect.data + sect.size;
+		while (last - cur >= 12)
+		{
+			uint32_t hdr[3];
+			memcpy(hdr, cur, sizeof hdr);
+
+			uint64_t name_size = (hdr[0] + 3) & ~3ull;
+			uint64_t desc_size = (hdr[1] + 3) & ~3ull;
+			if ((uint64_t)(last - cur) - 12 < name_size + desc_size)
+				break;
+
+			if (hdr[2] == nt_gnu_build_id && hdr[0] == 4 && memcmp(cur + 12, "GNU", 4) == 0)
+			{
+				m_build_id_note = string_view((char const *)cur, (char const *)cur + 12 + name_size + hdr[1]);
+				m_build_id = string_view((char const *)cur + 12 + name_size, hdr[1]);
+				break;
+			}
+
+			cur += 12 + name_size + desc_size;
+		}
+
+		if (!m_build_id.empty())
+			break;
+	}
+
+	return true;
+}
+
+elf_section const * elf_file::find_section(string_view name) const
+{
+	for (elf_section const & sect: m_sections)
+	{
+		if (sect.name == name)
+			return &sect;
+	}
+
+	return nullptr;
+}
+
+std::vector<uint8_t> elf_file::build_id_note() const
+{
+	return std::vector<uint8_t>(m_build_id_note.begin(), m_build_id_note.end());
+}
+
+guid elf_file::build_id_guid() const
+{
+	guid res = {};
+	std::copy_n(m_build_id.begin(), (std::min)(m_build_id.size(), sizeof res.data), res.data);
+	return res;
+}
+
+uint64_t elf_file::find_symbol(string_view name) const
+{
+	if (uint64_t addr = this->find_symbol(this->find_section(".dynsym"), name))
+		return addr;
+	return this->find_symbol(this->find_section(".symtab"), name);
+}
+
+uint64_t elf_file::find_symbol(elf_section const * symtab, string_view name) const
+{
+	if (!symtab || !symtab->data)
+		return 0;
+
+	string_view strtab_name = symtab->name == ".dynsym"? ".dynstr": ".strtab";
+	elf_section const * strtab = this->find_section(strtab_name);
+	if (!strtab || !strtab->data)
+		return 0;
+
+	size_t count = symtab->size / sizeof(elf64_sym);
+	for (size_t i = 0; i < count; ++i)
+	{
+		elf64_sym sym;
+		memcpy(&sym, symtab->data + i * sizeof sym, sizeof sym);
+
+		if (sym.st_value == 0 || sym.st_name >= strtab->size)
+			continue;
+
+		if (read_strz(strtab->data, strtab->data + strtab->size, sym.st_name) == name)
+			return sym.st_value;
+	}
+
+	return 0;
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> elf_file::functions() const
+{
+	elf_section const * symtab = this->find_section(".symtab");
+	if (!symtab || !symtab->data)
+		symtab = this->find_section(".dynsym");
+
+	std::vector<std::pair<uint64_t, uint64_t>> res;
+	if (!symtab || !symtab->data)
+		return res;
+
+	size_t count = symtab->size / sizeof(elf64_sym);
+	for (size_t i = 0; i < count; ++i)
+	{
+		elf64_sym sym;
+		memcpy(&sym, symtab->data + i * sizeof sym, sizeof sym);
+
+		if ((sym.st_info & 0xf) != stt_func || sym.st_shndx == 0 || sym.st_value == 0 || sym.st_size == 0)
+			continue;
+
+		res.push_back(std::make_pair(sym.st_value, sym.st_value + sym.st_size));
+	}
+
+	std::sort(res.begin(), res.end());
+	return res;
+}
+
+bool elf_file::is_code_address(uint64_t addr) const
+{
+	auto it = std::upper_bound(m_code_ranges.begin(), m_code_ranges.end(), std::pair<uint64_t, uint64_t>(addr, UINT64_MAX));
+	return it != m_code_ranges.begin() && addr < it[-1].second;
+}
+
+bool elf_file::has_line_info() const
+{
+	elf_section const * debug_line = this->find_section(".debug_line");
+	return debug_line && debug_line->data && (debug_line->flags & shf_compressed) == 0;
+}
+
+string_view parse_build_id_note(std::vector<uint8_t> const & note)
+{
+	if (note.size() < 16)
+		return string_view();
+
+	uint32_t hdr[3];
+	memcpy(hdr, note.data(), sizeof hdr);
+	if (hdr[0] != 4 || hdr[2] != nt_gnu_build_id || memcmp(note.data() + 12, "GNU", 4) != 0 || note.size() - 16 != hdr[1])
+		return string_view();
+
+	return string_view((char const *)note.data() + 16, hdr[1]);
+}
+
+static std::wstring hex_wstring(string_view bytes)
+{
+	static wchar_t const digits[] = L"0123456789abcdef";
+
+	std::wstring res;
+	for (char ch: bytes)
+	{
+		res.push_back(digits[(uint8_t)ch >> 4]);
+		res.push_back(digits[(uint8_t)ch & 0xf]);
+	}
+	return res;
+}
+
+bool elf_file::has_compressed_line_info() const
+{
+	elf_section const * debug_line = this->find_section(".debug_line");
+	return debug_line && debug_line->data && (debug_line->flags & shf_compressed) != 0;
+}
+
+// Does the search of `open_elf_debug_file`, remembering in `compressed`
+// the first candidate whose line information is there, but compressed.
+static std::wstring find_elf_debug_file(elf_file & res, std::wstring const & image_path, string_view build_id,
+	std::vector<std::wstring> const & debug_dirs, std::wstring & compressed)
+{
+	auto try_open = [&](std::wstring const & path) {
+		try
+		{
+			if (!res.open(path) || res.build_id() != build_id)
+				return false;
+
+			if (compressed.empty() && res.has_compressed_line_info())
+				compressed = path;
+			return res.has_line_info();
+		}
+		catch (std::exception const &)
+		{
+			return false;
+		}
+	};
+
+	if (!image_path.empty() && try_open(image_path))
+		return image_path;
+
+	if (build_id.size() >= 2)
+	{
+		std::wstring hex = hex_wstring(build_id);
+		std::wstring rel = L"/.build-id/" + hex.substr(0, 2) + L"/" + hex.substr(2) + L".debug";
+		for (std::wstring const & dir: debug_dirs)
+		{
+			if (try_open(dir + rel))
+				return dir + rel;
+		}
+	}
+
+	// Without line information of its own, the image may still
+	// point to its debug file by name.
+	if (image_path.empty())
+		return std::wstring();
+
+	try
+	{
+		if (!res.open(image_path) || res.build_id() != build_id)
+			return std::wstring();
+	}
+	catch (std::exception const &)
+	{
+		return std::wstring();
+	}
+
+	elf_section const * link = res.find_section(".gnu_debuglink");
+	if (!link || !link->data)
+		return std::wstring();
+
+	char const * link_first = (char const *)link->data;
+	std::wstring link_name = utf8_to_utf16(string_view(link_first, std::find(link_first, link_first + link->size, 0)));
+
+	std::wstring image_dir = split_filename(image_path).first;
+
+	std::vector<std::wstring> candidates;
+	candidates.push_back(image_dir + L"/" + link_name);
+	candidates.push_back(image_dir + L"/.debug/" + link_name);
+	for (std::wstring const & dir: debug_dirs)
+		candidates.push_back(dir + image_dir + L"/" + link_name);
+
+	for (std::wstring const & path: candidates)
+	{
+		if (try_open(path))
+			return path;
+	}
+
+	return std::wstring();
+}
+
+std::wstring open_elf_debug_file(elf_file & res, std::wstring const & image_path, string_view build_id,
+	std::vector<std::wstring> const & debug_dirs)
+{
+	std::wstring compressed;
+	std::wstring path = find_elf_debug_file(res, image_path, build_id, debug_dirs, compressed);
+	if (path.empty() && !compressed.empty())
+		throw std::runtime_error(utf16_to_utf8(compressed) + ": compressed line information isn't supported");
+	return path;
+}
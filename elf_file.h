@@ -0,0 +1,122 @@
+#ifndef ELF_FILE_H
+#define ELF_FILE_H
+
+#include "mapped_file.h"
+#include "string_view.h"
+#include "guid.h"
+#include <vector>
+#include <string>
+#include <utility>
+#include <stdint.h>
+
+struct elf_section
+{
+	string_view name;
+	uint32_t type;
+	uint64_t flags;
+	uint64_t addr;
+	uint64_t size;
+
+	// Null for sections that occupy no space in the file (SHT_NOBITS).
+	uint8_t const * data;
+};
+
+struct elf_segment
+{
+	uint32_t type;
+	uint32_t flags;
+	uint64_t offset;
+	uint64_t vaddr;
+	uint64_t filesz;
+	uint64_t memsz;
+};
+
+// A read-only view of a 64-bit little-endian ELF file.
+struct elf_file
+{
+	static uint32_t const sht_nobits = 8;
+	static uint64_t const shf_execinstr = 0x4;
+	static uint64_t const shf_compressed = 0x800;
+	static uint32_t const pt_load = 1;
+	static uint32_t const pf_x = 1;
+
+	elf_file()
+		: m_image_base(0), m_image_size(0)
+	{
+	}
+
+	// Returns false if the file can't be mapped or isn't an ELF image
+	// we understand; throws if the file is an ELF image, but malformed.
+	bool open(std::wstring const & fname);
+
+	std::vector<elf_section> const & sections() const { return m_sections; }
+	std::vector<elf_segment> const & segments() const { return m_segments; }
+
+	elf_section const * find_section(string_view name) const;
+
+	// The page-aligned virtual address of the lowest loadable segment and
+	// the extent of all loadable segments starting from there. Module
+	// offsets stored in `coverage_info` are relative to `image_base`.
+	uint64_t image_base() const { return m_image_base; }
+	uint64_t image_size() const { return m_image_size; }
+
+	// The raw NT_GNU_BUILD_ID note (header, owner and descriptor),
+	// or an empty vector if the image carries none.
+	std::vector<uint8_t> build_id_note() const;
+	string_view build_id() const { return m_build_id; }
+
+	// Build ids are usually 20 bytes long; the first 16 of them are used
+	// to key the module in `coverage_info`, just like PDB signatures are.
+	guid build_id_guid() const;
+
+	// Returns the virtual address of the named symbol, looking at the
+	// dynamic symbol table first, or zero if there is no such symbol.
+	uint64_t find_symbol(string_view name) const;
+
+	// The [first, last) address ranges of the function symbols that have
+	// a size, from the static symbol table or, if the image is stripped,
+	// from the dynamic one. Sorted, but aliases aren't removed.
+	std::vector<std::pair<uint64_t, uint64_t>> functions() const;
+
+	// True if `addr` lies in an executable section. Line tables of linked
+	// images still carry rows for discarded functions, which are resolved
+	// to zero or to some other address outside of the code.
+	bool is_code_address(uint64_t addr) const;
+
+	// True if the image carries an uncompressed .debug_line section.
+	bool has_line_info() const;
+
+	// True if the image carries a .debug_line section compressed with
+	// SHF_COMPRESSED (e.g. by `-gz`), which we can't read.
+	bool has_compressed_line_info() const;
+
+private:
+	uint64_t find_symbol(elf_section const * symtab, string_view name) const;
+
+	std::vector<std::pair<uint64_t, uint64_t>> m_code_ranges;
+
+	mapped_file m_file;
+	std::vector<elf_section> m_sections;
+	std::vector<elf_segment> m_segments;
+	uint64_t m_image_base;
+	uint64_t m_image_size;
+	string_view m_build_id_note;
+	string_view m_build_id;
+};
+
+// Returns the build id held in a raw NT_GNU_BUILD_ID note, as stored in
+// `pdb_coverage_info::cv` for ELF modules, or an empty view if `note`
+// is something else, e.g. a CodeView record.
+string_view parse_build_id_note(std::vector<uint8_t> const & note);
+
+// Opens the file holding the line information for the image with
+// the given build id: the image at `image_path` itself, a separate debug
+// file under one of `debug_dirs` in their .build-id subdirectory, or
+// the file named by the image's .gnu_debuglink. Candidates whose build id
+// doesn't match are skipped. Returns the path of the file opened in `res`,
+// or an empty string if none was found. Throws if the only line information
+// found is compressed, so that the module isn't skipped silently.
+std::wstring open_elf_debug_file(elf_file & res, std::wstring const & image_path, string_view build_id,
+	std::vector<std::wstring> const & debug_dirs);
+
+#endif // ELF_FILE_H
@@ -3,26 +3,46 @@
 
 #include "utf.h"
 #include <ostream>
-#include <istream>
+#include <string>
+#include <vector>
+#include <limits>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
 #include <cassert>
+#include <stdint.h>
 
+// Writes JSON to a stream through an internal buffer, which is flushed
+// when it fills up, by `flush` and on destruction.
 struct json_writer
 {
 	json_writer(std::ostream & out)
 		: m_out(out), m_comma(false)
 	{
+		m_buf.reserve(buffer_size);
+	}
+
+	~json_writer()
+	{
+		this->flush();
+	}
+
+	void flush()
+	{
+		m_out.write(m_buf.data(), m_buf.size());
+		m_buf.clear();
 	}
 
 	void open_object()
 	{
 		this->comma();
-		this->write_raw("{");
+		this->write_raw('{');
 		m_comma = false;
 	}
 
 	void close_object()
 	{
-		this->write_raw("}");
+		this->write_raw('}');
 		m_comma = true;
 	}
 
@@ -30,7 +50,7 @@ struct json_writer
 	{
 		this->comma();
 		this->write_raw_str(s);
-		this->write_raw(":");
+		this->write_raw(':');
 		m_comma = false;
 	}
 
@@ -38,28 +58,62 @@ struct json_writer
 	{
 		this->comma();
 		this->write_raw_str(utf16_to_utf8(s));
-		this->write_raw(":");
+		this->write_raw(':');
 		m_comma = false;
 	}
 
 	void open_array()
 	{
 		this->comma();
-		this->write_raw("[");
+		this->write_raw('[');
 		m_comma = false;
 	}
 
 	void close_array()
 	{
-		this->write_raw("]");
+		this->write_raw(']');
 		m_comma = true;
 	}
 
 	template <typename Num>
 	void write_num(Num num)
 	{
+		static char const digit_pairs[] =
+			"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+			"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+			"8081828384858687888990919293949596979899";
+
 		this->comma();
-		this->write_raw(std::to_string(num));
+
+		bool negative = num < 0;
+		uint64_t n = negative? ~(uint64_t)(int64_t)num + 1: (uint64_t)num;
+
+		char buf[24];
+		char * last = buf + sizeof buf;
+		char * first = last;
+
+		while (n >= 100)
+		{
+			unsigned pair = (unsigned)(n % 100) * 2;
+			n /= 100;
+			*--first = digit_pairs[pair + 1];
+			*--first = digit_pairs[pair];
+		}
+
+		if (n >= 10)
+		{
+			*--first = digit_pairs[n * 2 + 1];
+			*--first = digit_pairs[n * 2];
+		}
+		else
+		{
+			*--first = (char)('0' + n);
+		}
+
+		if (negative)
+			*--first = '-';
+
+		this->write_raw(string_view(first, last));
 		m_comma = true;
 	}
 
@@ -76,116 +130,253 @@ struct json_writer
 	}
 
 private:
+	static size_t const buffer_size = 64 * 1024;
+
 	void comma()
 	{
 		if (m_comma)
-			this->write_raw(",");
+			this->write_raw(',');
+	}
+
+	// Returns the first character that has to be escaped, looking at eight
+	// characters at a time for quotes, backslashes and control characters.
+	static char const * find_escape(char const * first, char const * last)
+	{
+		static uint64_t const ones = 0x0101010101010101ull;
+		static uint64_t const highs = 0x8080808080808080ull;
+
+		for (; last - first >= 8; first += 8)
+		{
+			uint64_t w;
+			memcpy(&w, first, sizeof w);
+
+			uint64_t quote = w ^ (ones * '"');
+			uint64_t backslash = w ^ (ones * '\\');
+
+			// The high bit of each byte of `mask` is set if the byte is
+			// zero, or, for `w` itself, if it's below 0x20. Bytes with their
+			// high bit set are UTF-8 and are excluded by `~w`.
+			uint64_t mask = ((quote - ones) | (backslash - ones) | (w - ones * 0x20)) & ~w & highs;
+			if (mask)
+				break;
+		}
+
+		for (; first != last; ++first)
+		{
+			unsigned char ch = (unsigned char)*first;
+			if (ch < 0x20 || ch == '"' || ch == '\\')
+				break;
+		}
+
+		return first;
 	}
 
 	void write_raw_str(string_view s)
 	{
-		this->write_raw("\"");
+		static char const hex_digits[] = "0123456789abcdef";
+
+		this->write_raw('"');
 
 		char const * first = s.begin();
 		char const * last = s.end();
-
-		auto needs_escape = [](char ch) { return ch == '\\' || ch == '\n' || ch == '"'; };
-
-		for (char const * cur = first; cur != last; ++cur)
+		for (;;)
 		{
-			if (needs_escape(*cur))
+			char const * cur = find_escape(first, last);
+			this->write_raw(string_view(first, cur));
+			if (cur == last)
+				break;
+
+			char ch = *cur;
+			switch (ch)
+			{
+			case '"':
+				this->write_raw("\\\"");
+				break;
+			case '\\':
+				this->write_raw("\\\\");
+				break;
+			case '\n':
+				this->write_raw("\\n");
+				break;
+			case '\r':
+				this->write_raw("\\r");
+				break;
+			case '\t':
+				this->write_raw("\\t");
+				break;
+			default:
 			{
-				this->write_raw(string_view(first, cur));
-				this->write_raw("\\");
-				// XXX proper escape
-				first = cur;
+				char esc[] = { '\\', 'u', '0', '0', hex_digits[(ch >> 4) & 0xf], hex_digits[ch & 0xf] };
+				this->write_raw(string_view(esc, sizeof esc));
+				break;
+			}
 			}
+
+			first = cur + 1;
 		}
 
-		this->write_raw(string_view(first, last));
-		this->write_raw("\"");
+		this->write_raw('"');
+	}
+
+	void write_raw(char ch)
+	{
+		if (m_buf.size() == buffer_size)
+			this->flush();
+		m_buf.push_back(ch);
 	}
 
 	void write_raw(string_view s)
 	{
-		m_out.write(s.data(), s.size());
+		if (m_buf.size() + s.size() > buffer_size)
+		{
+			this->flush();
+			if (s.size() > buffer_size)
+			{
+				m_out.write(s.data(), s.size());
+				return;
+			}
+		}
+
+		m_buf.insert(m_buf.end(), s.begin(), s.end());
 	}
 
 	std::ostream & m_out;
 	bool m_comma;
+	std::vector<char> m_buf;
 };
 
+// Reads JSON from a contiguous buffer, such as a mapped file or a stream
+// read in one go. Strings are handed out as views into the buffer;
+// only strings with escape sequences are decoded, into a buffer owned
+// by the reader that is reused for each such string.
+//
+// `read_array` and `read_object` call back for each element. Elements
+// the callback doesn't read are skipped.
 struct json_reader
 {
-	json_reader(std::istream & in)
-		: m_in(in), m_exc_state(m_in.exceptions()), m_next(nx_unknown)
+	json_reader(char const * first, char const * last)
+		: m_cur(first), m_last(last), m_pending(false)
 	{
-		m_in.exceptions(std::ios::badbit | std::ios::failbit | std::ios::eofbit);
-		this->detect_next();
 	}
 
-	~json_reader()
+	explicit json_reader(string_view buf)
+		: m_cur(buf.begin()), m_last(buf.end()), m_pending(false)
 	{
-		m_in.exceptions(m_exc_state);
 	}
 
 	template <typename F>
 	void read_array(F && f)
 	{
+		this->start_value();
 		this->consume('[');
-		while (!this->try_consume(']'))
+
+		this->skip_ws();
+		if (this->try_consume(']'))
+			return;
+
+		for (;;)
 		{
-			this->detect_next();
+			m_pending = true;
 			f();
-			this->skip();
-		}
+			if (m_pending)
+				this->skip();
 
-		m_next = nx_comma;
+			this->skip_ws();
+			if (this->try_consume(']'))
+				return;
+			this->consume(',');
+		}
 	}
 
+	// The key passed to `f` is only valid until the next string is read.
 	template <typename F>
 	void read_object(F && f)
 	{
+		this->start_value();
 		this->consume('{');
-		while (!this->try_consume('}'))
+
+		this->skip_ws();
+		if (this->try_consume('}'))
+			return;
+
+		for (;;)
 		{
-			if (m_next == nx_comma)
-				this->consume(',');
+			string_view key = this->read_str();
 
-			std::string key = this->read_str();
+			this->skip_ws();
 			this->consume(':');
 
-			this->detect_next();
-			f(std::move(key));
-			this->skip();
-		}
+			m_pending = true;
+			f(key);
+			if (m_pending)
+				this->skip();
 
-		m_next = nx_comma;
+			this->skip_ws();
+			if (this->try_consume('}'))
+				return;
+			this->consume(',');
+		}
 	}
 
-	std::string read_str()
+	// The returned view is only valid until the next string is read.
+	string_view read_str()
 	{
+		this->start_value();
 		this->consume('"');
 
-		std::string res;
+		// Most strings have no escapes and can be returned in place.
+		char const * first = m_cur;
+		while (m_cur != m_last && *m_cur != '"' && *m_cur != '\\')
+			++m_cur;
+
+		if (m_cur == m_last)
+			throw std::runtime_error("unterminated string");
+
+		if (*m_cur == '"')
+			return string_view(first, m_cur++);
+
+		m_scratch.assign(first, m_cur);
 		for (;;)
 		{
-			char ch;
-			m_in.get(ch);
-
+			char ch = this->get();
 			if (ch == '"')
+				return m_scratch;
+
+			if (ch != '\\')
 			{
-				m_next = nx_comma;
-				return res;
+				m_scratch.push_back(ch);
+				continue;
 			}
 
-			if (ch == '\\')
+			ch = this->get();
+			switch (ch)
 			{
-				m_in.get(ch);
-				// XXX: other
+			case '"':
+			case '\\':
+			case '/':
+				m_scratch.push_back(ch);
+				break;
+			case 'b':
+				m_scratch.push_back('\b');
+				break;
+			case 'f':
+				m_scratch.push_back('\f');
+				break;
+			case 'n':
+				m_scratch.push_back('\n');
+				break;
+			case 'r':
+				m_scratch.push_back('\r');
+				break;
+			case 't':
+				m_scratch.push_back('\t');
+				break;
+			case 'u':
+				this->append_utf8(this->read_escaped_cp());
+				break;
+			default:
+				throw std::runtime_error("invalid escape sequence");
 			}
-
-			res.push_back(ch);
 		}
 	}
 
@@ -197,116 +388,209 @@ struct json_reader
 	template <typename Num>
 	Num read_num()
 	{
-		Num res = 0;
+		this->start_value();
 
-		char ch;
-		for (;;)
+		bool negative = m_cur != m_last && *m_cur == '-';
+		if (negative)
+			++m_cur;
+
+		// Nineteen decimal digits always fit into 64 bits,
+		// so the common case needs no overflow checks.
+		char const * first = m_cur;
+		char const * fast_last = m_last - m_cur > 19? m_cur + 19: m_last;
+
+		uint64_t res = 0;
+		for (; m_cur != fast_last; ++m_cur)
 		{
-			m_in.get(ch);
-			if (!is_ws(ch))
+			unsigned digit = (unsigned char)*m_cur - '0';
+			if (digit > 9)
 				break;
+			res = res * 10 + digit;
 		}
 
-		bool has_none = true;
-		for (;;)
+		if (m_cur == first)
+			throw std::runtime_error("expected number");
+
+		for (; m_cur != m_last; ++m_cur)
 		{
-			if ('0' <= ch && ch <= '9')
-			{
-				res = res * 10 + (ch - '0');
-				has_none = false;
-				m_in.get(ch);
-			}
-			else
+			unsigned digit = (unsigned char)*m_cur - '0';
+			if (digit > 9)
+				break;
+			if (res > (UINT64_MAX - digit) / 10)
+				throw std::runtime_error("number out of range");
+			res = res * 10 + digit;
+		}
+
+		if (m_cur != m_last && (*m_cur == '.' || *m_cur == 'e' || *m_cur == 'E'))
+			throw std::runtime_error("expected integer");
+
+		if (negative && res != 0)
+		{
+			if (!std::numeric_limits<Num>::is_signed || res - 1 > (uint64_t)(std::numeric_limits<Num>::max)())
+				throw std::runtime_error("number out of range");
+			return (Num)(~res + 1);
+		}
+
+		if (res > (uint64_t)(std::numeric_limits<Num>::max)())
+			throw std::runtime_error("number out of range");
+		return (Num)res;
+	}
+
+	// Skips the next value.
+	void skip()
+	{
+		this->skip_ws();
+		if (m_cur == m_last)
+			throw std::runtime_error("unexpected end of input");
+
+		switch (*m_cur)
+		{
+		case '{':
+			this->read_object([](string_view) {});
+			break;
+		case '[':
+			this->read_array([]() {});
+			break;
+		case '"':
+			this->read_str();
+			break;
+		case 't':
+			this->read_literal("true");
+			break;
+		case 'f':
+			this->read_literal("false");
+			break;
+		case 'n':
+			this->read_literal("null");
+			break;
+		default:
+			this->start_value();
+			if (m_cur != m_last && *m_cur == '-')
+				++m_cur;
+
+			char const * first = m_cur;
+			while (m_cur != m_last && (('0' <= *m_cur && *m_cur <= '9')
+				|| *m_cur == '.' || *m_cur == 'e' || *m_cur == 'E' || *m_cur == '+' || *m_cur == '-'))
 			{
-				m_in.unget();
-				if (has_none)
-					throw std::runtime_error("expected number");
-				m_next = nx_comma;
-				return res;
+				++m_cur;
 			}
+
+			if (m_cur == first)
+				throw std::runtime_error("unexpected character");
 		}
 	}
 
 private:
 	static bool is_ws(char ch) { return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r'; }
 
+	void skip_ws()
+	{
+		while (m_cur != m_last && is_ws(*m_cur))
+			++m_cur;
+	}
+
+	void start_value()
+	{
+		m_pending = false;
+		this->skip_ws();
+	}
+
+	char get()
+	{
+		if (m_cur == m_last)
+			throw std::runtime_error("unexpected end of input");
+		return *m_cur++;
+	}
+
 	bool try_consume(char exp)
 	{
-		for (;;)
-		{
-			char ch;
-			m_in.get(ch);
-			if (!is_ws(ch))
-			{
-				if (ch != exp)
-				{
-					m_in.unget();
-					return false;
-				}
-
-				m_next = nx_unknown;
-				return true;
-			}
-		}
+		if (m_cur == m_last || *m_cur != exp)
+			return false;
+		++m_cur;
+		return true;
 	}
 
 	void consume(char exp)
 	{
 		if (!this->try_consume(exp))
-			throw std::runtime_error("expected array");
-
+			throw std::runtime_error(m_cur == m_last? "unexpected end of input": "unexpected character");
 	}
 
-	void detect_next()
+	void read_literal(string_view lit)
 	{
-		if (m_next == nx_comma)
-			this->consume(',');
+		this->start_value();
+		if ((size_t)(m_last - m_cur) < lit.size() || !std::equal(lit.begin(), lit.end(), m_cur))
+			throw std::runtime_error("unexpected character");
+		m_cur += lit.size();
+	}
 
-		char ch;
-		do
+	uint32_t read_hex4()
+	{
+		uint32_t res = 0;
+		for (int i = 0; i < 4; ++i)
 		{
-			m_in.get(ch);
+			char ch = this->get();
+			res <<= 4;
+			if ('0' <= ch && ch <= '9')
+				res |= ch - '0';
+			else if ('a' <= ch && ch <= 'f')
+				res |= ch - 'a' + 10;
+			else if ('A' <= ch && ch <= 'F')
+				res |= ch - 'A' + 10;
+			else
+				throw std::runtime_error("invalid escape sequence");
 		}
-		while (is_ws(ch));
-
-		if (ch == '{')
-			m_next = nx_object;
-		else if (ch == '[')
-			m_next = nx_array;
-		else if (ch == '"')
-			m_next = nx_str;
-		else if (ch == '-' || ('0' <= ch && ch <= '9'))
-			m_next = nx_num;
-		else
-			throw std::runtime_error("unexpected character");
+		return res;
+	}
 
-		m_in.unget();
+	// Reads the code point of a \u escape, whose "\u" has been consumed,
+	// combining surrogate pairs.
+	uint32_t read_escaped_cp()
+	{
+		uint32_t cp = this->read_hex4();
+		if (cp < 0xd800 || cp >= 0xdc00)
+			return cp;
+
+		if (m_last - m_cur < 6 || m_cur[0] != '\\' || m_cur[1] != 'u')
+			throw std::runtime_error("unpaired surrogate");
+		m_cur += 2;
+
+		uint32_t lo = this->read_hex4();
+		if (lo < 0xdc00 || lo >= 0xe000)
+			throw std::runtime_error("unpaired surrogate");
+		return 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
 	}
 
-	void skip()
+	void append_utf8(uint32_t cp)
 	{
-		switch (m_next)
+		if (cp < 0x80)
 		{
-		case nx_object:
-			this->read_object([](string_view) {});
-			break;
-		case nx_array:
-			this->read_array([]() {});
-			break;
-		case nx_num:
-			this->read_num<int>();
-			break;
-		case nx_str:
-			this->read_str();
-			break;
+			m_scratch.push_back((char)cp);
+		}
+		else if (cp < 0x800)
+		{
+			m_scratch.push_back((char)(0xc0 | (cp >> 6)));
+			m_scratch.push_back((char)(0x80 | (cp & 0x3f)));
+		}
+		else if (cp < 0x10000)
+		{
+			m_scratch.push_back((char)(0xe0 | (cp >> 12)));
+			m_scratch.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+			m_scratch.push_back((char)(0x80 | (cp & 0x3f)));
+		}
+		else
+		{
+			m_scratch.push_back((char)(0xf0 | (cp >> 18)));
+			m_scratch.push_back((char)(0x80 | ((cp >> 12) & 0x3f)));
+			m_scratch.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+			m_scratch.push_back((char)(0x80 | (cp & 0x3f)));
 		}
-
-		assert(m_next == nx_comma);
 	}
 
-	std::istream & m_in;
-	int m_exc_state;
-	enum { nx_unknown, nx_object, nx_array, nx_num, nx_str, nx_comma } m_next;
+	char const * m_cur;
+	char const * m_last;
+	bool m_pending;
+	std::string m_scratch;
 };
 
 #endif // JSON_H
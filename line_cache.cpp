@@ -0,0 +1,234 @@
+#include "line_cache.h"
+#include "utils.h"
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <cstring>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace {
+
+// An entry consists of the header, followed by the CodeView record and
+// the UTF-8 filename, padded to eight bytes, and then by the arrays
+//
+//     uint64_t addresses[row_count];
+//     uint64_t functions[function_count][2];
+//     uint32_t files[row_count];
+//     uint32_t lines[row_count];
+//     uint32_t file_offsets[file_count + 1];
+//     char strings[file_offsets[file_count]];
+//
+// Rows are sorted by address; `files` indexes into `file_offsets`, which
+// delimit the UTF-8 paths in `strings`.
+struct cache_header
+{
+	char magic[8];
+	uint32_t cv_size;
+	uint32_t filename_size;
+	uint32_t file_count;
+	uint32_t function_count;
+	uint64_t row_count;
+};
+
+static char const cache_magic[8] = { 'c', 'c', 'o', 'v', 'l', 'n', '0', '2' };
+
+static uint64_t align8(uint64_t n)
+{
+	return (n + 7) & ~7ull;
+}
+
+static std::wstring cache_path(std::wstring const & cache_dir, guid const & key)
+{
+	return cache_dir + L"/" + utf8_to_utf16(key.to_string()) + L".lines";
+}
+
+static void make_dir(std::wstring const & dir)
+{
+#ifdef _WIN32
+	CreateDirectoryW(dir.c_str(), nullptr);
+#else
+	mkdir(utf16_to_utf8(dir).c_str(), 0777);
+#endif
+}
+
+static bool replace_file(std::wstring const & from, std::wstring const & to)
+{
+#ifdef _WIN32
+	return MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+#else
+	return ::rename(utf16_to_utf8(from).c_str(), utf16_to_utf8(to).c_str()) == 0;
+#endif
+}
+
+static void remove_file(std::wstring const & fname)
+{
+#ifdef _WIN32
+	DeleteFileW(fname.c_str());
+#else
+	::remove(utf16_to_utf8(fname).c_str());
+#endif
+}
+
+template <typename T>
+void write_pod(std::ostream & out, T const * p, size_t count)
+{
+	out.write((char const *)p, sizeof(T) * count);
+}
+
+}
+
+line_cache_entry::line_cache_entry()
+	: m_row_count(0), m_file_count(0), m_function_count(0), m_addresses(nullptr), m_functions(nullptr),
+	m_files(nullptr), m_lines(nullptr), m_file_offsets(nullptr), m_strings(nullptr)
+{
+}
+
+bool line_cache_entry::open(std::wstring const & cache_dir, guid const & key, std::vector<uint8_t> const & cv)
+{
+	m_file.close();
+	m_row_count = 0;
+	m_file_count = 0;
+	m_function_count = 0;
+
+	mapped_file file;
+	if (!file.open(cache_path(cache_dir, key)))
+		return false;
+
+	uint8_t const * base = file.data();
+	uint64_t size = file.size();
+
+	cache_header hdr;
+	if (size < sizeof hdr)
+		return false;
+	memcpy(&hdr, base, sizeof hdr);
+
+	if (memcmp(hdr.magic, cache_magic, sizeof cache_magic) != 0 || hdr.cv_size != cv.size())
+		return false;
+
+	// The mapping is page-aligned and so, by the layout, are the arrays
+	// to the size of their elements.
+	uint64_t cv_offset = sizeof hdr;
+	uint64_t addrs_offset = align8(cv_offset + hdr.cv_size + hdr.filename_size);
+	uint64_t functions_offset = addrs_offset + hdr.row_count * 8;
+	uint64_t files_offset = functions_offset + (uint64_t)hdr.function_count * 16;
+	uint64_t lines_offset = files_offset + hdr.row_count * 4;
+	uint64_t file_offsets_offset = lines_offset + hdr.row_count * 4;
+	uint64_t strings_offset = file_offsets_offset + ((uint64_t)hdr.file_count + 1) * 4;
+
+	if (hdr.row_count > size / 16 || strings_offset > size)
+		return false;
+
+	if (!std::equal(cv.begin(), cv.end(), base + cv_offset))
+		return false;
+
+	uint32_t const * file_offsets = (uint32_t const *)(base + file_offsets_offset);
+	if (file_offsets[hdr.file_count] > size - strings_offset || !std::is_sorted(file_offsets, file_offsets + hdr.file_count + 1))
+		return false;
+
+	uint32_t const * files = (uint32_t const *)(base + files_offset);
+	for (uint64_t i = 0; i < hdr.row_count; ++i)
+	{
+		if (files[i] >= hdr.file_count)
+			return false;
+	}
+
+	char const * filename = (char const *)base + cv_offset + hdr.cv_size;
+	m_filename = utf8_to_utf16(string_view(filename, hdr.filename_size));
+
+	m_row_count = (size_t)hdr.row_count;
+	m_file_count = hdr.file_count;
+	m_function_count = hdr.function_count;
+
+	m_addresses = (uint64_t const *)(base + addrs_offset);
+	m_functions = (uint64_t const *)(base + functions_offset);
+	m_files = files;
+	m_lines = (uint32_t const *)(base + lines_offset);
+	m_file_offsets = file_offsets;
+	m_strings = (char const *)base + strings_offset;
+
+	m_file = std::move(file);
+	return true;
+}
+
+bool store_line_cache(std::wstring const & cache_dir, guid const & key, std::vector<uint8_t> const & cv,
+	module_lines const & ml)
+{
+	std::string filename = utf16_to_utf8(ml.filename);
+
+	std::vector<line_table_row> rows = ml.lines.rows;
+	std::sort(rows.begin(), rows.end(), [](line_table_row const & lhs, line_table_row const & rhs) {
+		return lhs.address < rhs.address;
+	});
+
+	cache_header hdr;
+	memcpy(hdr.magic, cache_magic, sizeof cache_magic);
+	hdr.cv_size = (uint32_t)cv.size();
+	hdr.filename_size = (uint32_t)filename.size();
+	hdr.file_count = (uint32_t)ml.lines.files.size();
+	hdr.function_count = (uint32_t)ml.functions.size();
+	hdr.row_count = rows.size();
+
+	make_dir(cache_dir);
+
+	std::random_device rd;
+	std::wstring final_path = cache_path(cache_dir, key);
+	std::wstring temp_path = final_path + L"." + std::to_wstring(rd()) + L".tmp";
+
+	{
+		std::ofstream out(native_path(temp_path).c_str(), std::ios::binary);
+		if (!out)
+			return false;
+
+		write_pod(out, &hdr, 1);
+		write_pod(out, cv.data(), cv.size());
+		write_pod(out, filename.data(), filename.size());
+
+		static char const padding[8] = {};
+		uint64_t head_size = sizeof hdr + cv.size() + filename.size();
+		write_pod(out, padding, (size_t)(align8(head_size) - head_size));
+
+		for (line_table_row const & row: rows)
+			write_pod(out, &row.address, 1);
+		for (auto const & fn: ml.functions)
+		{
+			write_pod(out, &fn.first, 1);
+			write_pod(out, &fn.second, 1);
+		}
+		for (line_table_row const & row: rows)
+			write_pod(out, &row.file, 1);
+		for (line_table_row const & row: rows)
+			write_pod(out, &row.line, 1);
+
+		uint32_t offset = 0;
+		write_pod(out, &offset, 1);
+		for (std::string const & file: ml.lines.files)
+		{
+			offset += (uint32_t)file.size();
+			write_pod(out, &offset, 1);
+		}
+
+		for (std::string const & file: ml.lines.files)
+			write_pod(out, file.data(), file.size());
+
+		out.close();
+		if (!out)
+		{
+			remove_file(temp_path);
+			return false;
+		}
+	}
+
+	if (!replace_file(temp_path, final_path))
+	{
+		remove_file(temp_path);
+		return false;
+	}
+
+	return true;
+}
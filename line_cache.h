@@ -0,0 +1,60 @@
+#ifndef LINE_CACHE_H
+#define LINE_CACHE_H
+
+#include "line_table.h"
+#include "mapped_file.h"
+#include "string_view.h"
+#include "guid.h"
+#include <vector>
+#include <string>
+#include <utility>
+#include <stdint.h>
+
+// An entry of the line cache, mapped into memory. Its rows, sorted by
+// address, and its functions are read straight from the mapping, so
+// a warm cache costs no more than what the caller makes of them.
+struct line_cache_entry
+{
+	line_cache_entry();
+
+	// Looks up the entry for the module `key` in the cache directory
+	// `cache_dir`. Entries are only used if they were stored with the same
+	// CodeView record or build-id note `cv`. Returns false on a miss
+	// or if the entry is damaged.
+	bool open(std::wstring const & cache_dir, guid const & key, std::vector<uint8_t> const & cv);
+
+	std::wstring const & filename() const { return m_filename; }
+
+	size_t row_count() const { return m_row_count; }
+	line_table_row row(size_t i) const { line_table_row res = { m_addresses[i], m_files[i], m_lines[i] }; return res; }
+
+	size_t file_count() const { return m_file_count; }
+	string_view file(size_t i) const { return string_view(m_strings + m_file_offsets[i], m_strings + m_file_offsets[i + 1]); }
+
+	size_t function_count() const { return m_function_count; }
+	std::pair<uint64_t, uint64_t> function(size_t i) const { return std::make_pair(m_functions[2 * i], m_functions[2 * i + 1]); }
+
+private:
+	mapped_file m_file;
+	std::wstring m_filename;
+
+	size_t m_row_count;
+	size_t m_file_count;
+	size_t m_function_count;
+
+	uint64_t const * m_addresses;
+	uint64_t const * m_functions;
+	uint32_t const * m_files;
+	uint32_t const * m_lines;
+	uint32_t const * m_file_offsets;
+	char const * m_strings;
+};
+
+// Stores the entry for the module `key`, creating the directory if needed.
+// The entry is written to a temporary file first and renamed into place,
+// so concurrent readers and writers don't see partial entries.
+// Returns false if the entry can't be written.
+bool store_line_cache(std::wstring const & cache_dir, guid const & key, std::vector<uint8_t> const & cv,
+	module_lines const & ml);
+
+#endif // LINE_CACHE_H
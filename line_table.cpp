@@ -0,0 +1,36 @@
+#include "line_table.h"
+#include <unordered_map>
+
+line_table join_line_tables(std::vector<line_table> & parts)
+{
+	line_table res;
+
+	size_t row_count = 0;
+	for (line_table const & part: parts)
+		row_count += part.rows.size();
+	res.rows.reserve(row_count);
+
+	std::unordered_map<std::string, uint32_t> file_ids;
+	std::vector<uint32_t> file_map;
+	for (line_table & part: parts)
+	{
+		file_map.clear();
+		for (std::string & file: part.files)
+		{
+			auto r = file_ids.emplace(file, (uint32_t)res.files.size());
+			if (r.second)
+				res.files.push_back(std::move(file));
+			file_map.push_back(r.first->second);
+		}
+
+		for (line_table_row row: part.rows)
+		{
+			row.file = file_map[row.file];
+			res.rows.push_back(row);
+		}
+
+		part = line_table();
+	}
+
+	return res;
+}
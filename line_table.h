@@ -0,0 +1,43 @@
+#ifndef LINE_TABLE_H
+#define LINE_TABLE_H
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <stdint.h>
+
+struct line_table_row
+{
+	uint64_t address;
+	uint32_t file;
+	uint32_t line;
+};
+
+// Line records of one image in bulk. `file` indexes into `files`,
+// which holds UTF-8 paths.
+struct line_table
+{
+	std::vector<std::string> files;
+	std::vector<line_table_row> rows;
+};
+
+// The symbol information of one module, as used by capture and report.
+struct module_lines
+{
+	// The file the information was read from, stored in
+	// `pdb_coverage_info::filename`.
+	std::wstring filename;
+
+	// Rows relative to the image base, restricted to code.
+	line_table lines;
+
+	// The [first, last) offset ranges of the module's functions;
+	// may be empty if the symbol source doesn't provide them.
+	std::vector<std::pair<uint64_t, uint64_t>> functions;
+};
+
+// Concatenates tables decoded separately, e.g. one per compilation unit,
+// storing each distinct path only once. The parts are left empty.
+line_table join_line_tables(std::vector<line_table> & parts);
+
+#endif // LINE_TABLE_H
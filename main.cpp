@@ -1,19 +1,106 @@
 #include "debugger_loop.h"
 #include "cmdline.h"
 #include "utils.h"
+#include "utf.h"
+#include "parallel.h"
+#include "stats.h"
 #include <iostream>
 #include <fstream>
+#include <cwchar>
+#include <cstdio>
+
+#ifdef _WIN32
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+// The options for writing out a `run_stats`, shared by the modes
+// that do the heavy lifting.
+struct stats_opts
+{
+	std::wstring stats_fname;
+	std::wstring trace_fname;
+
+	// Returns false if `arg` isn't one of the options.
+	bool parse_option(std::wstring const & arg, wstring_view & cmdline)
+	{
+		if (arg == L"--stats")
+			stats_fname = win_split_cmdline_arg(cmdline);
+		else if (arg == L"--trace")
+			trace_fname = win_split_cmdline_arg(cmdline);
+		else
+			return false;
+		return true;
+	}
+
+	// Returns `stats` if any of the files was asked for, null otherwise.
+	run_stats * use(run_stats & stats) const
+	{
+		return stats_fname.empty() && trace_fname.empty()? nullptr: &stats;
+	}
+
+	bool store(run_stats const & stats) const
+	{
+		if (!stats_fname.empty())
+		{
+			std::ofstream out(native_path(stats_fname).c_str(), std::ios::binary);
+			stats.store(out);
+			if (!out)
+				return false;
+		}
+
+		if (!trace_fname.empty())
+		{
+			std::ofstream out(native_path(trace_fname).c_str(), std::ios::binary);
+			stats.store_trace(out);
+			if (!out)
+				return false;
+		}
+
+		return true;
+	}
+};
+
+// Parses an option shared by `capture` and `attach`. Returns false
+// if `arg` isn't one of them.
+static bool parse_capture_option(std::wstring const & arg, wstring_view & cmdline, capture_options & options,
+	std::wstring & covinfo_fname, bool & binary)
+{
+	if (arg == L"-y" || arg == L"--sympath")
+		options.sympath = win_split_cmdline_arg(cmdline);
+	else if (arg == L"-o" || arg == L"--output")
+		covinfo_fname = win_split_cmdline_arg(cmdline);
+	else if (arg == L"-v" || arg == L"--verbose")
+		options.log = &std::wcerr;
+	else if (arg == L"--lazy")
+		options.lazy = true;
+	else if (arg == L"--blocks")
+		options.blocks = true;
+	else if (arg == L"--per-process")
+		options.per_process = true;
+	else if (arg == L"--cache")
+		options.cache_dir = win_split_cmdline_arg(cmdline);
+	else if (arg == L"--sample")
+		options.sample_ms = (unsigned)wcstoul(win_split_cmdline_arg(cmdline).c_str(), nullptr, 10);
+	else if (arg == L"-b" || arg == L"--binary")
+		binary = true;
+	else
+		return false;
+	return true;
+}
 
 struct capture_opts
 {
 	bool print_help;
-	std::wstring sympath;
+	bool binary;
+	capture_options options;
+	stats_opts stats;
 	std::wstring covinfo_fname;
 	std::wstring win_cmdline;
 
 	capture_opts()
-		: print_help(false)
+		: print_help(false), binary(false)
 	{
 	}
 
@@ -24,15 +111,10 @@ struct capture_opts
 			wstring_view prev_cmdline = cmdline;
 			std::wstring arg = win_split_cmdline_arg(cmdline);
 
-			if (arg == L"-y" || arg == L"--sympath")
-			{
-				sympath = win_split_cmdline_arg(cmdline);
-			}
-			else if (arg == L"-o" || arg == L"--output")
-			{
-				covinfo_fname = win_split_cmdline_arg(cmdline);
-			}
-			else if (arg == L"--")
+			if (parse_capture_option(arg, cmdline, options, covinfo_fname, binary) || stats.parse_option(arg, cmdline))
+				continue;
+
+			if (arg == L"--")
 			{
 				win_cmdline = cmdline;
 				return;
@@ -53,14 +135,57 @@ struct capture_opts
 	}
 };
 
+struct attach_opts
+{
+	bool binary;
+	attach_options options;
+	stats_opts stats;
+	std::wstring covinfo_fname;
+	uint32_t pid;
+
+	attach_opts()
+		: binary(false), pid(0)
+	{
+	}
+
+	bool parse(wstring_view cmdline)
+	{
+		while (!cmdline.empty())
+		{
+			std::wstring arg = win_split_cmdline_arg(cmdline);
+
+			if (parse_capture_option(arg, cmdline, options, covinfo_fname, binary) || stats.parse_option(arg, cmdline))
+				continue;
+
+			if (arg == L"--control")
+			{
+				options.control_file = win_split_cmdline_arg(cmdline);
+				continue;
+			}
+
+			if (arg[0] == L'-' || pid != 0)
+				return false;
+
+			pid = (uint32_t)wcstoul(arg.c_str(), nullptr, 10);
+			if (pid == 0)
+				return false;
+		}
+
+		return pid != 0 && !covinfo_fname.empty();
+	}
+};
+
 struct report_opts
 {
 	std::vector<std::wstring> input_files;
-	std::wstring sympath;
+	report_options options;
+	stats_opts stats;
 	std::wstring output_file;
+	bool count_runs;
+	bool stream;
 
 	report_opts()
-		: output_file(L"-")
+		: output_file(L"-"), count_runs(false), stream(false)
 	{
 	}
 
@@ -75,10 +200,37 @@ struct report_opts
 			{
 				if (arg == L"-y" || arg == L"--sympath")
 				{
-					sympath = win_split_cmdline_arg(cmdline);
+					options.sympath = win_split_cmdline_arg(cmdline);
 					continue;
 				}
 
+				if (arg == L"--cache")
+				{
+					options.cache_dir = win_split_cmdline_arg(cmdline);
+					continue;
+				}
+
+				if (arg == L"-c" || arg == L"--count")
+				{
+					count_runs = true;
+					continue;
+				}
+
+				if (arg == L"-j" || arg == L"--jobs")
+				{
+					options.threads = (unsigned)wcstoul(win_split_cmdline_arg(cmdline).c_str(), nullptr, 10);
+					continue;
+				}
+
+				if (arg == L"-s" || arg == L"--stream")
+				{
+					stream = true;
+					continue;
+				}
+
+				if (stats.parse_option(arg, cmdline))
+					continue;
+
 				if (arg == L"-o" || arg == L"--output")
 				{
 					output_file = win_split_cmdline_arg(cmdline);
@@ -106,9 +258,11 @@ struct merge_opts
 {
 	std::vector<std::wstring> input_files;
 	std::wstring output_file;
+	bool binary;
+	bool count_runs;
 
 	merge_opts()
-		: output_file(L"-")
+		: output_file(L"-"), binary(false), count_runs(false)
 	{
 	}
 
@@ -127,6 +281,18 @@ struct merge_opts
 					continue;
 				}
 
+				if (arg == L"-b" || arg == L"--binary")
+				{
+					binary = true;
+					continue;
+				}
+
+				if (arg == L"-c" || arg == L"--count")
+				{
+					count_runs = true;
+					continue;
+				}
+
 				if (arg == L"--")
 				{
 					ignore_opts = true;
@@ -144,9 +310,62 @@ struct merge_opts
 	}
 };
 
-int main()
+// Writes a snapshot to a temporary file first and renames it into place,
+// so that the output file always holds a complete snapshot.
+static bool store_snapshot(std::wstring const & fname, coverage_info & ci, bool binary)
+{
+	std::wstring temp = fname + L".tmp";
+
+	{
+		std::ofstream out(native_path(temp).c_str(), std::ios::binary);
+		if (!out)
+			return false;
+
+		if (binary)
+			ci.store_binary(out);
+		else
+			ci.store(out);
+
+		if (!out)
+			return false;
+	}
+
+#ifdef _WIN32
+	return MoveFileExW(temp.c_str(), fname.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+#else
+	return ::rename(native_path(temp).c_str(), native_path(fname).c_str()) == 0;
+#endif
+}
+
+// Loads the input files on up to `threads` threads and merges them. Returns
+// false and sets `failed` to the first file that can't be opened.
+// Both steps are timed into `stats`, if set.
+static bool load_inputs(std::vector<std::wstring> const & input_files, bool count_runs, unsigned threads, run_stats * stats,
+	coverage_info & ci, std::wstring & failed)
+{
+	std::vector<coverage_info> inputs(input_files.size());
+	std::vector<char> opened(input_files.size());
+	parallel_for(input_files.size(), threads, [&](size_t i) {
+		stats_timer timer(stats, "load", input_files[i]);
+		opened[i] = coverage_info::load_file(input_files[i], inputs[i]);
+	});
+
+	for (size_t i = 0; i < input_files.size(); ++i)
+	{
+		if (!opened[i])
+		{
+			failed = input_files[i];
+			return false;
+		}
+	}
+
+	stats_timer timer(stats, "merge", L"merge inputs");
+	ci = coverage_info::merge_all(std::move(inputs), count_runs, threads);
+	return true;
+}
+
+static int ccover_main(wstring_view cmdline)
 {
-	wstring_view cmdline = GetCommandLineW();
 	std::wstring arg0 = split_filename(win_split_cmdline_arg(cmdline)).second;
 
 	std::wstring mode = win_split_cmdline_arg(cmdline);
@@ -158,100 +377,183 @@ int main()
 
 		if (opts.print_help || opts.covinfo_fname.empty())
 		{
-			std::wcerr << L"Usage: " << arg0 << L" capture -o <output> [-y <sympath>] [--] <command> [<arg> ...]\n";
+			std::wcerr << L"Usage: " << arg0 << L" capture -o <output> [-y <sympath>] [-b] [-v] [--lazy] [--blocks] [--per-process] [--cache <dir>] [--sample <ms>] [--stats <file>] [--trace <file>] [--] <command> [<arg> ...]\n";
 			return 2;
 		}
 
-		std::ofstream fcovinfo(opts.covinfo_fname.c_str(), std::ios::binary);
+		std::ofstream fcovinfo(native_path(opts.covinfo_fname).c_str(), std::ios::binary);
 		if (!fcovinfo)
 		{
 			std::wcerr << arg0 << L": error: cannot open the output file\n";
 			return 3;
 		}
 
-		coverage_info ci = capture_coverage(opts.win_cmdline, opts.sympath);
-		ci.store(fcovinfo);
+		run_stats stats;
+		opts.options.stats = opts.stats.use(stats);
+
+		coverage_info ci = capture_coverage(opts.win_cmdline, opts.options);
+		if (opts.binary)
+			ci.store_binary(fcovinfo);
+		else
+			ci.store(fcovinfo);
+
+		if (!opts.stats.store(stats))
+		{
+			std::wcerr << arg0 << L": error: cannot write the stats\n";
+			return 3;
+		}
 		return 0;
 	}
-	else if (mode == L"merge")
+	else if (mode == L"attach")
 	{
-		merge_opts opts;
+		attach_opts opts;
 		if (!opts.parse(cmdline))
 		{
-			std::wcerr << L"Usage: " << arg0 << L" merge [-o <output>] <input> [...]\n";
+			std::wcerr << L"Usage: " << arg0 << L" attach -o <output> [-y <sympath>] [-b] [-v] [--lazy] [--blocks] [--per-process] [--cache <dir>] [--sample <ms>] [--stats <file>] [--trace <file>] [--control <file>] <pid>\n";
 			return 2;
 		}
 
-		coverage_info ci;
-		for (std::wstring const & input: opts.input_files)
+		if (!std::ofstream(native_path(opts.covinfo_fname).c_str(), std::ios::binary))
 		{
-			std::ifstream fin(input.c_str(), std::ios::binary);
-			if (!fin)
-			{
-				std::wcerr << arg0 << L": error: cannot open input file: " << input << L"\n";
-				return 3;
-			}
+			std::wcerr << arg0 << L": error: cannot open the output file\n";
+			return 3;
+		}
+
+		opts.options.snapshot = [&](coverage_info && ci) {
+			if (!store_snapshot(opts.covinfo_fname, ci, opts.binary))
+				std::wcerr << arg0 << L": error: cannot write the snapshot\n";
+		};
+
+		run_stats stats;
+		opts.options.stats = opts.stats.use(stats);
 
-			ci.merge(coverage_info::load(fin));
+		coverage_info ci = attach_coverage(opts.pid, opts.options);
+		if (!store_snapshot(opts.covinfo_fname, ci, opts.binary))
+		{
+			std::wcerr << arg0 << L": error: cannot write the output file\n";
+			return 3;
 		}
 
-		if (opts.output_file == L"-")
+		if (!opts.stats.store(stats))
 		{
-			ci.store(std::cout);
+			std::wcerr << arg0 << L": error: cannot write the stats\n";
+			return 3;
 		}
-		else
+		return 0;
+	}
+	else if (mode == L"merge")
+	{
+		merge_opts opts;
+		if (!opts.parse(cmdline))
 		{
-			std::ofstream fout(opts.output_file.c_str(), std::ios::binary);
+			std::wcerr << L"Usage: " << arg0 << L" merge [-o <output>] [-b] [-c] <input> [...]\n";
+			return 2;
+		}
+
+		coverage_info ci;
+		std::wstring failed;
+		if (!load_inputs(opts.input_files, opts.count_runs, 0, nullptr, ci, failed))
+		{
+			std::wcerr << arg0 << L": error: cannot open input file: " << failed << L"\n";
+			return 3;
+		}
+
+		std::ofstream fout;
+		if (opts.output_file != L"-")
+		{
+			fout.open(native_path(opts.output_file).c_str(), std::ios::binary);
 			if (!fout)
 			{
 				std::wcerr << arg0 << L": error: cannot open the output file\n";
 				return 3;
 			}
-
-			ci.store(fout);
 		}
+
+#ifdef _WIN32
+		// Keep the binary format from going through newline translation.
+		if (opts.output_file == L"-" && opts.binary)
+			_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+		std::ostream & out = opts.output_file == L"-"? std::cout: fout;
+		if (opts.binary)
+			ci.store_binary(out);
+		else
+			ci.store(out);
 	}
 	else if (mode == L"report")
 	{
 		report_opts opts;
 		if (!opts.parse(cmdline))
 		{
-			std::wcerr << L"Usage: " << arg0 << L" report [-o <output>] [-y <sympath>] <input> [...]\n";
+			std::wcerr << L"Usage: " << arg0 << L" report [-o <output>] [-y <sympath>] [--cache <dir>] [-c] [-j <threads>] [-s] [--stats <file>] [--trace <file>] <input> [...]\n";
 			return 2;
 		}
 
+		run_stats stats;
+		opts.options.stats = opts.stats.use(stats);
+
 		coverage_info ci;
-		for (std::wstring const & input: opts.input_files)
+		std::wstring failed;
+		if (!load_inputs(opts.input_files, opts.count_runs, opts.options.threads, opts.options.stats, ci, failed))
+		{
+			std::wcerr << arg0 << L": error: cannot open input file: " << failed << L"\n";
+			return 3;
+		}
+
+		std::ofstream fout;
+		if (opts.output_file != L"-")
 		{
-			std::ifstream fin(input.c_str(), std::ios::binary);
-			if (!fin)
+			fout.open(native_path(opts.output_file).c_str(), std::ios::binary);
+			if (!fout)
 			{
-				std::wcerr << arg0 << L": error: cannot open input file: " << input << L"\n";
+				std::wcerr << arg0 << L": error: cannot open output file: " << opts.output_file << L"\n";
 				return 3;
 			}
-
-			ci.merge(coverage_info::load(fin));
 		}
 
-		coverage_report rep = report(ci, opts.sympath);
-		if (opts.output_file == L"-")
+		std::ostream & out = opts.output_file == L"-"? std::cout: fout;
+		if (opts.stream)
 		{
-			rep.store(std::cout);
+			store_report(ci, opts.options, out);
 		}
 		else
 		{
-			std::ofstream fout(opts.output_file.c_str(), std::ios::binary);
-			if (!fout)
-			{
-				std::wcerr << arg0 << L": error: cannot open output file: " << opts.output_file << L"\n";
-				return 3;
-			}
-			rep.store(fout);
+			coverage_report cr = report(ci, opts.options);
+
+			stats_timer timer(opts.options.stats, "store", L"store report");
+			cr.store(out);
+		}
+
+		if (!opts.stats.store(stats))
+		{
+			std::wcerr << arg0 << L": error: cannot write the stats\n";
+			return 3;
 		}
 	}
 	else
 	{
-		std::wcerr << L"Usage: " << arg0 << L" { capture | merge | report } [...]\n";
+		std::wcerr << L"Usage: " << arg0 << L" { capture | attach | merge | report } [...]\n";
 		return 2;
 	}
+	return 0;
 }
+
+#ifdef _WIN32
+
+int main()
+{
+	return ccover_main(GetCommandLineW());
+}
+
+#else
+
+int main(int argc, char * argv[])
+{
+	std::wstring cmdline;
+	for (int i = 0; i < argc; ++i)
+		win_append_cmdline_arg(cmdline, utf8_to_utf16(argv[i]));
+	return ccover_main(cmdline);
+}
+
+#endif
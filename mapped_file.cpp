@@ -0,0 +1,127 @@
+#include "mapped_file.h"
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include "utf.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+mapped_file::mapped_file()
+	: m_base(nullptr), m_size(0)
+{
+}
+
+mapped_file::mapped_file(std::wstring const & fname)
+	: m_base(nullptr), m_size(0)
+{
+	if (!this->open(fname))
+		throw std::runtime_error("cannot map file");
+}
+
+mapped_file::~mapped_file()
+{
+	this->close();
+}
+
+mapped_file::mapped_file(mapped_file && o)
+	: m_base(o.m_base), m_size(o.m_size)
+{
+	o.m_base = nullptr;
+	o.m_size = 0;
+}
+
+mapped_file & mapped_file::operator=(mapped_file && o)
+{
+	if (this != &o)
+	{
+		this->close();
+		m_base = o.m_base;
+		m_size = o.m_size;
+		o.m_base = nullptr;
+		o.m_size = 0;
+	}
+
+	return *this;
+}
+
+#ifdef _WIN32
+
+bool mapped_file::open(std::wstring const & fname)
+{
+	this->close();
+
+	HANDLE hFile = CreateFileW(fname.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(hFile, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(hFile);
+		return false;
+	}
+
+	HANDLE hSection = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(hFile);
+	if (!hSection)
+		return false;
+
+	void * base = MapViewOfFileEx(hSection, FILE_MAP_READ, 0, 0, 0, nullptr);
+	CloseHandle(hSection);
+	if (!base)
+		return false;
+
+	m_base = static_cast<uint8_t const *>(base);
+	m_size = (size_t)size.QuadPart;
+	return true;
+}
+
+void mapped_file::close()
+{
+	if (m_base)
+		UnmapViewOfFile(m_base);
+	m_base = nullptr;
+	m_size = 0;
+}
+
+#else
+
+bool mapped_file::open(std::wstring const & fname)
+{
+	this->close();
+
+	int fd = ::open(utf16_to_utf8(fname).c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+
+	void * base = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (base == MAP_FAILED)
+		return false;
+
+	m_base = static_cast<uint8_t const *>(base);
+	m_size = (size_t)st.st_size;
+	return true;
+}
+
+void mapped_file::close()
+{
+	if (m_base)
+		munmap(const_cast<uint8_t *>(m_base), m_size);
+	m_base = nullptr;
+	m_size = 0;
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include "string_view.h"
+#include <string>
+#include <stdint.h>
+
+struct mapped_file
+{
+	mapped_file();
+	explicit mapped_file(std::wstring const & fname);
+	~mapped_file();
+
+	mapped_file(mapped_file && o);
+	mapped_file & operator=(mapped_file && o);
+
+	bool open(std::wstring const & fname);
+	void close();
+
+	bool is_open() const { return m_base != nullptr; }
+	uint8_t const * data() const { return m_base; }
+	size_t size() const { return m_size; }
+
+private:
+	mapped_file(mapped_file const &);
+	mapped_file & operator=(mapped_file const &);
+
+	uint8_t const * m_base;
+	size_t m_size;
+};
+
+#endif // MAPPED_FILE_H
@@ -0,0 +1,53 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <exception>
+#include <algorithm>
+#include <stddef.h>
+
+// Calls `f(i)` for every `i` in [0, count) on up to `threads` threads,
+// zero meaning one per hardware thread. Items are handed out one at a time,
+// so uneven items balance out. The first exception thrown by `f` stops
+// the remaining work and is rethrown once all threads are done.
+template <typename F>
+void parallel_for(size_t count, unsigned threads, F && f)
+{
+	if (threads == 0)
+		threads = (std::max)(std::thread::hardware_concurrency(), 1u);
+	threads = (unsigned)(std::min)((size_t)threads, count);
+
+	std::atomic<size_t> next(0);
+	std::vector<std::exception_ptr> errors(threads);
+
+	auto worker = [&](unsigned idx) {
+		try
+		{
+			for (size_t i = next++; i < count; i = next++)
+				f(i);
+		}
+		catch (...)
+		{
+			errors[idx] = std::current_exception();
+			next = count;
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < threads; ++i)
+		workers.emplace_back(worker, i);
+	if (threads != 0)
+		worker(0);
+	for (std::thread & t: workers)
+		t.join();
+
+	for (std::exception_ptr const & exc: errors)
+	{
+		if (exc != nullptr)
+			std::rethrow_exception(exc);
+	}
+}
+
+#endif // PARALLEL_H
@@ -0,0 +1,507 @@
+#include "pdb_file.h"
+#include "parallel.h"
+#include "utils.h"
+#include <unordered_map>
+#include <stdexcept>
+#include <cstring>
+
+namespace {
+
+static char const msf_magic[32] = "Microsoft C/C++ MSF 7.00\r\n\x1a" "DS\0\0";
+
+enum
+{
+	pdb_info_stream = 1,
+	pdb_dbi_stream = 3,
+};
+
+enum
+{
+	debug_s_ignore = 0x80000000,
+	debug_s_lines = 0xf2,
+	debug_s_file_checksums = 0xf4,
+};
+
+// Index of the section header stream in the DBI optional debug header.
+static size_t const dbg_section_hdr = 5;
+
+// Line numbers the compiler uses to hide code from the debugger.
+static uint32_t const hidden_line_1 = 0xfeefee;
+static uint32_t const hidden_line_2 = 0xf00f00;
+
+struct pdb_cursor
+{
+	uint8_t const * cur;
+	uint8_t const * last;
+
+	void need(size_t n) const
+	{
+		if ((size_t)(last - cur) < n)
+			throw std::runtime_error("truncated PDB stream");
+	}
+
+	void skip(size_t n)
+	{
+		this->need(n);
+		cur += n;
+	}
+
+	template <typename T>
+	T fixed()
+	{
+		this->need(sizeof(T));
+		T res;
+		memcpy(&res, cur, sizeof res);
+		cur += sizeof res;
+		return res;
+	}
+
+	string_view strz()
+	{
+		char const * s = (char const *)cur;
+		void const * e = memchr(cur, 0, last - cur);
+		if (!e)
+			throw std::runtime_error("unterminated string in PDB stream");
+		cur = (uint8_t const *)e + 1;
+		return string_view(s, (char const *)e);
+	}
+
+	pdb_cursor sub(size_t n)
+	{
+		this->need(n);
+		pdb_cursor res = { cur, cur + n };
+		cur += n;
+		return res;
+	}
+};
+
+static pdb_cursor make_cursor(std::vector<uint8_t> const & stream)
+{
+	pdb_cursor res = { stream.data(), stream.data() + stream.size() };
+	return res;
+}
+
+static string_view read_name(std::vector<uint8_t> const & names, uint32_t offset)
+{
+	// The /names stream starts with a signature, a version and the size
+	// of the string buffer.
+	if (names.size() < 12 || offset >= names.size() - 12)
+		throw std::runtime_error("file name offset out of range");
+
+	pdb_cursor c = { names.data() + 12 + offset, names.data() + names.size() };
+	return c.strz();
+}
+
+struct dbi_module
+{
+	uint16_t stream;
+	uint32_t sym_size;
+	uint32_t c11_size;
+	uint32_t c13_size;
+};
+
+}
+
+bool pdb_file::open(std::wstring const & fname)
+{
+	m_stream_sizes.clear();
+	m_stream_blocks.clear();
+	m_signature = guid();
+	m_age = 0;
+	m_names_stream = UINT32_MAX;
+
+	if (!m_file.open(fname))
+		return false;
+
+	pdb_cursor c = { m_file.data(), m_file.data() + m_file.size() };
+	if (m_file.size() < sizeof msf_magic + 24 || memcmp(c.cur, msf_magic, sizeof msf_magic) != 0)
+		return false;
+
+	c.skip(sizeof msf_magic);
+	m_block_size = c.fixed<uint32_t>();
+	c.fixed<uint32_t>(); // free block map block
+	uint32_t block_count = c.fixed<uint32_t>();
+	uint32_t dir_size = c.fixed<uint32_t>();
+	c.fixed<uint32_t>();
+	uint32_t block_map_addr = c.fixed<uint32_t>();
+
+	if (m_block_size != 512 && m_block_size != 1024 && m_block_size != 2048 && m_block_size != 4096)
+		throw std::runtime_error("invalid MSF block size");
+	if ((uint64_t)block_count * m_block_size > m_file.size())
+		throw std::runtime_error("truncated MSF file");
+
+	auto block = [&](uint32_t index) {
+		if (index >= block_count)
+			throw std::runtime_error("MSF block index out of range");
+		return m_file.data() + (size_t)index * m_block_size;
+	};
+
+	uint32_t dir_block_count = (dir_size + m_block_size - 1) / m_block_size;
+	if ((uint64_t)dir_block_count * 4 > m_block_size)
+		throw std::runtime_error("MSF directory too large");
+
+	std::vector<uint8_t> dir;
+	dir.reserve((size_t)dir_block_count * m_block_size);
+	for (uint32_t i = 0; i < dir_block_count; ++i)
+	{
+		uint32_t index;
+		memcpy(&index, block(block_map_addr) + i * 4, 4);
+		uint8_t const * p = block(index);
+		dir.insert(dir.end(), p, p + m_block_size);
+	}
+	dir.resize(dir_size);
+
+	pdb_cursor d = make_cursor(dir);
+	uint32_t stream_count = d.fixed<uint32_t>();
+	d.need((size_t)stream_count * 4);
+	for (uint32_t i = 0; i < stream_count; ++i)
+		m_stream_sizes.push_back(d.fixed<uint32_t>());
+
+	for (uint32_t size: m_stream_sizes)
+	{
+		std::vector<uint32_t> blocks;
+		if (size != UINT32_MAX)
+		{
+			uint32_t count = (size + m_block_size - 1) / m_block_size;
+			d.need((size_t)count * 4);
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				uint32_t index = d.fixed<uint32_t>();
+				if (index >= block_count)
+					throw std::runtime_error("MSF block index out of range");
+				blocks.push_back(index);
+			}
+		}
+		m_stream_blocks.push_back(std::move(blocks));
+	}
+
+	std::vector<uint8_t> info = this->read_stream(pdb_info_stream);
+	pdb_cursor ic = make_cursor(info);
+	ic.fixed<uint32_t>(); // version
+	ic.fixed<uint32_t>(); // timestamp
+	m_age = ic.fixed<uint32_t>();
+	ic.need(sizeof m_signature.data);
+	memcpy(m_signature.data, ic.cur, sizeof m_signature.data);
+	ic.skip(sizeof m_signature.data);
+
+	// The named stream map: a string buffer followed by a hash table
+	// of (string offset, stream index) pairs.
+	uint32_t strings_size = ic.fixed<uint32_t>();
+	pdb_cursor strings = ic.sub(strings_size);
+	ic.fixed<uint32_t>(); // size
+	uint32_t capacity = ic.fixed<uint32_t>();
+
+	uint32_t present_words = ic.fixed<uint32_t>();
+	pdb_cursor present = ic.sub((size_t)present_words * 4);
+	uint32_t deleted_words = ic.fixed<uint32_t>();
+	ic.skip((size_t)deleted_words * 4);
+
+	for (uint32_t i = 0; i < capacity && i / 32 < present_words; ++i)
+	{
+		uint32_t word;
+		memcpy(&word, present.cur + (i / 32) * 4, 4);
+		if ((word & (1u << (i % 32))) == 0)
+			continue;
+
+		uint32_t key = ic.fixed<uint32_t>();
+		uint32_t value = ic.fixed<uint32_t>();
+		if (key >= strings_size)
+			continue;
+
+		pdb_cursor name = { strings.cur + key, strings.last };
+		if (name.strz() == "/names")
+			m_names_stream = value;
+	}
+
+	return true;
+}
+
+std::vector<uint8_t> pdb_file::read_stream(uint32_t index) const
+{
+	std::vector<uint8_t> res;
+	if (index >= m_stream_sizes.size() || m_stream_sizes[index] == UINT32_MAX)
+		return res;
+
+	res.reserve(m_stream_blocks[index].size() * m_block_size);
+	for (uint32_t block: m_stream_blocks[index])
+	{
+		uint8_t const * p = m_file.data() + (size_t)block * m_block_size;
+		res.insert(res.end(), p, p + m_block_size);
+	}
+
+	res.resize(m_stream_sizes[index]);
+	return res;
+}
+
+line_table pdb_file::read_line_table(unsigned threads) const
+{
+	std::vector<uint8_t> dbi = this->read_stream(pdb_dbi_stream);
+	if (dbi.empty())
+		return line_table();
+
+	pdb_cursor c = make_cursor(dbi);
+	c.need(64);
+
+	int32_t substream_sizes[8];
+	memcpy(substream_sizes, c.cur + 24, sizeof substream_sizes);
+	c.skip(64);
+
+	// The sixth field is the MFC type server index rather than a size.
+	for (size_t i = 0; i < 8; ++i)
+	{
+		if (i != 5 && substream_sizes[i] < 0)
+			throw std::runtime_error("invalid DBI stream header");
+	}
+
+	int32_t mod_info_size = substream_sizes[0];
+	int32_t section_contrib_size = substream_sizes[1];
+	int32_t section_map_size = substream_sizes[2];
+	int32_t source_info_size = substream_sizes[3];
+	int32_t type_server_map_size = substream_sizes[4];
+	int32_t opt_dbg_header_size = substream_sizes[6];
+	int32_t ec_size = substream_sizes[7];
+
+	std::vector<dbi_module> modules;
+
+	pdb_cursor mods = c.sub(mod_info_size);
+	while (mods.cur != mods.last)
+	{
+		uint8_t const * rec_start = mods.cur;
+		mods.need(64);
+
+		dbi_module mod;
+		memcpy(&mod.stream, mods.cur + 34, 2);
+		memcpy(&mod.sym_size, mods.cur + 36, 4);
+		memcpy(&mod.c11_size, mods.cur + 40, 4);
+		memcpy(&mod.c13_size, mods.cur + 44, 4);
+		mods.skip(64);
+
+		mods.strz(); // module name
+		mods.strz(); // object file name
+		mods.skip(std::min<size_t>((4 - (mods.cur - rec_start) % 4) % 4, mods.last - mods.cur));
+
+		if (mod.stream != 0xffff && mod.c13_size != 0)
+			modules.push_back(mod);
+	}
+
+	c.skip((size_t)section_contrib_size + section_map_size + source_info_size + type_server_map_size + ec_size);
+	pdb_cursor opt_dbg_header = c.sub(opt_dbg_header_size);
+
+	std::vector<uint32_t> section_rvas;
+	if ((size_t)opt_dbg_header_size >= (dbg_section_hdr + 1) * 2)
+	{
+		uint16_t section_hdr_stream;
+		memcpy(&section_hdr_stream, opt_dbg_header.cur + dbg_section_hdr * 2, 2);
+
+		if (section_hdr_stream != 0xffff)
+		{
+			// IMAGE_SECTION_HEADER records, 40 bytes each,
+			// with the virtual address at offset 12.
+			std::vector<uint8_t> hdrs = this->read_stream(section_hdr_stream);
+			for (size_t off = 0; off + 40 <= hdrs.size(); off += 40)
+			{
+				uint32_t rva;
+				memcpy(&rva, hdrs.data() + off + 12, 4);
+				section_rvas.push_back(rva);
+			}
+		}
+	}
+
+	std::vector<uint8_t> names = this->read_stream(m_names_stream);
+
+	std::vector<line_table> parts(modules.size());
+	parallel_for(modules.size(), threads, [&](size_t i) {
+		dbi_module const & mod = modules[i];
+		line_table & part = parts[i];
+
+		std::vector<uint8_t> stream = this->read_stream(mod.stream);
+
+		pdb_cursor mc = make_cursor(stream);
+		mc.skip((size_t)mod.sym_size + mod.c11_size);
+		pdb_cursor c13 = mc.sub(mod.c13_size);
+
+		// Line blocks refer to files through the file checksum subsection,
+		// which may come after them.
+		pdb_cursor checksums = { nullptr, nullptr };
+		std::vector<pdb_cursor> line_subsections;
+		while ((size_t)(c13.last - c13.cur) >= 8)
+		{
+			uint32_t kind = c13.fixed<uint32_t>();
+			uint32_t len = c13.fixed<uint32_t>();
+			pdb_cursor data = c13.sub(len);
+			c13.skip(std::min<size_t>((4 - len % 4) % 4, c13.last - c13.cur));
+
+			if (kind & debug_s_ignore)
+				continue;
+
+			if (kind == debug_s_file_checksums)
+				checksums = data;
+			else if (kind == debug_s_lines)
+				line_subsections.push_back(data);
+		}
+
+		std::unordered_map<uint32_t, uint32_t> file_ids;
+		auto file_id = [&](uint32_t checksum_offset) {
+			auto it = file_ids.find(checksum_offset);
+			if (it != file_ids.end())
+				return it->second;
+
+			if (checksum_offset >= (size_t)(checksums.last - checksums.cur))
+				throw std::runtime_error("file checksum offset out of range");
+
+			pdb_cursor entry = { checksums.cur + checksum_offset, checksums.last };
+			uint32_t name_offset = entry.fixed<uint32_t>();
+
+			uint32_t id = (uint32_t)part.files.size();
+			part.files.push_back(read_name(names, name_offset));
+			file_ids[checksum_offset] = id;
+			return id;
+		};
+
+		for (pdb_cursor lines: line_subsections)
+		{
+			uint32_t contrib_offset = lines.fixed<uint32_t>();
+			uint16_t section = lines.fixed<uint16_t>();
+			uint16_t flags = lines.fixed<uint16_t>();
+			lines.fixed<uint32_t>(); // contribution size
+
+			bool has_columns = (flags & 1) != 0;
+
+			while (lines.cur != lines.last)
+			{
+				uint32_t checksum_offset = lines.fixed<uint32_t>();
+				uint32_t line_count = lines.fixed<uint32_t>();
+				uint32_t block_size = lines.fixed<uint32_t>();
+				if (block_size < 12)
+					throw std::runtime_error("invalid line block");
+
+				pdb_cursor block = lines.sub(block_size - 12);
+				block.need((size_t)line_count * (has_columns? 12: 8));
+
+				if (section == 0 || section > section_rvas.size())
+					continue;
+
+				uint64_t base = (uint64_t)section_rvas[section - 1] + contrib_offset;
+				uint32_t file = file_id(checksum_offset);
+
+				for (uint32_t i = 0; i < line_count; ++i)
+				{
+					uint32_t offset = block.fixed<uint32_t>();
+					uint32_t line = block.fixed<uint32_t>() & 0xffffff;
+
+					if (line == 0 || line == hidden_line_1 || line == hidden_line_2)
+						continue;
+
+					line_table_row row;
+					row.address = base + offset;
+					row.file = file;
+					row.line = line;
+					part.rows.push_back(row);
+				}
+			}
+		}
+	});
+
+	return join_line_tables(parts);
+}
+
+bool parse_codeview_record(std::vector<uint8_t> const & cv, guid & signature, uint32_t & age, std::string & pdb_path)
+{
+	if (cv.size() < 25 || memcmp(cv.data(), "RSDS", 4) != 0)
+		return false;
+
+	memcpy(signature.data, cv.data() + 4, sizeof signature.data);
+	memcpy(&age, cv.data() + 20, 4);
+
+	char const * first = (char const *)cv.data() + 24;
+	char const * last = (char const *)cv.data() + cv.size();
+	pdb_path.assign(first, std::find(first, last, 0));
+	return true;
+}
+
+// The directory name of a PDB in a symbol store: the signature
+// in its textual GUID byte order followed by the age, in upper-case hex.
+static std::wstring symstore_key(guid const & signature, uint32_t age)
+{
+	static wchar_t const digits[] = L"0123456789ABCDEF";
+	static size_t const order[] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+	std::wstring res;
+	for (size_t idx: order)
+	{
+		res.push_back(digits[signature.data[idx] >> 4]);
+		res.push_back(digits[signature.data[idx] & 0xf]);
+	}
+
+	wchar_t buf[8];
+	size_t len = 0;
+	do
+	{
+		buf[len++] = digits[age & 0xf];
+		age >>= 4;
+	}
+	while (age != 0);
+
+	while (len != 0)
+		res.push_back(buf[--len]);
+	return res;
+}
+
+std::wstring open_pdb_file(pdb_file & res, std::vector<uint8_t> const & cv, std::wstring const & pdb_path,
+	std::vector<std::wstring> const & sym_dirs)
+{
+	guid signature;
+	uint32_t age;
+	std::string cv_path;
+	if (!parse_codeview_record(cv, signature, age, cv_path))
+		return std::wstring();
+
+	std::wstring cv_wpath = utf8_to_utf16(cv_path);
+	std::wstring name = split_filename(cv_wpath).second;
+
+	std::vector<std::wstring> candidates;
+	if (!pdb_path.empty())
+		candidates.push_back(pdb_path);
+	candidates.push_back(cv_wpath);
+	for (std::wstring const & entry: sym_dirs)
+	{
+		// Entries such as `srv*c:\symbols*https://server` name a local
+		// downstream store among other things; only local paths are used.
+		std::vector<std::wstring> dirs;
+		for (size_t first = 0; first <= entry.size(); )
+		{
+			size_t last = entry.find(L'*', first);
+			if (last == std::wstring::npos)
+				last = entry.size();
+
+			std::wstring dir = entry.substr(first, last - first);
+			if (!dir.empty() && dir.find(L"://") == std::wstring::npos
+				&& dir != L"srv" && dir != L"SRV" && dir != L"cache" && dir != L"symsrv")
+			{
+				dirs.push_back(dir);
+			}
+
+			first = last + 1;
+		}
+
+		for (std::wstring const & dir: dirs)
+		{
+			candidates.push_back(dir + L"/" + name);
+			candidates.push_back(dir + L"/" + name + L"/" + symstore_key(signature, age) + L"/" + name);
+		}
+	}
+
+	for (std::wstring const & path: candidates)
+	{
+		try
+		{
+			if (res.open(path) && res.signature() == signature && res.age() == age)
+				return path;
+		}
+		catch (std::exception const &)
+		{
+		}
+	}
+
+	return std::wstring();
+}
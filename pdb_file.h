@@ -0,0 +1,56 @@
+#ifndef PDB_FILE_H
+#define PDB_FILE_H
+
+#include "mapped_file.h"
+#include "line_table.h"
+#include "string_view.h"
+#include "guid.h"
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+// A read-only view of a PDB file in the MSF 7.00 container format.
+struct pdb_file
+{
+	pdb_file()
+		: m_block_size(0), m_signature(), m_age(0), m_names_stream(UINT32_MAX)
+	{
+	}
+
+	// Returns false if the file can't be mapped or isn't an MSF 7.00 file;
+	// throws if the container or the PDB info stream is malformed.
+	bool open(std::wstring const & fname);
+
+	guid const & signature() const { return m_signature; }
+	uint32_t age() const { return m_age; }
+
+	// Reads the C13 line information of all modules in the DBI stream,
+	// decoding modules on `threads` worker threads (zero meaning one
+	// per hardware thread). Addresses are relative to the image base.
+	line_table read_line_table(unsigned threads = 0) const;
+
+private:
+	std::vector<uint8_t> read_stream(uint32_t index) const;
+
+	mapped_file m_file;
+	uint32_t m_block_size;
+	std::vector<uint32_t> m_stream_sizes;
+	std::vector<std::vector<uint32_t>> m_stream_blocks;
+	guid m_signature;
+	uint32_t m_age;
+	uint32_t m_names_stream;
+};
+
+// Splits an RSDS CodeView record, as stored in `pdb_coverage_info::cv`
+// for PE modules, into the PDB signature, age and path.
+bool parse_codeview_record(std::vector<uint8_t> const & cv, guid & signature, uint32_t & age, std::string & pdb_path);
+
+// Opens the PDB matching the CodeView record `cv`. Looks at `pdb_path`
+// (usually the path the debugger loaded the PDB from), then at the path in
+// the record, then in each of `sym_dirs`, both flat and laid out as a
+// symbol store. Returns the path of the file opened in `res`, or
+// an empty string if none of the candidates has the right signature and age.
+std::wstring open_pdb_file(pdb_file & res, std::vector<uint8_t> const & cv, std::wstring const & pdb_path,
+	std::vector<std::wstring> const & sym_dirs);
+
+#endif // PDB_FILE_H
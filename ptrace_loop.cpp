@@ -0,0 +1,1080 @@
+#if defined(__linux__) && defined(__x86_64__)
+
+#include "debugger_loop.h"
+#include "breakpoints.h"
+#include "basic_blocks.h"
+#include "elf_file.h"
+#include "dwarf_line.h"
+#include "line_cache.h"
+#include "cmdline.h"
+#include "utf.h"
+#include "utils.h"
+#include "stats.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <cassert>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cinttypes>
+#include <chrono>
+
+#include <sys/auxv.h>
+#include <sys/ptrace.h>
+#include <sys/time.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+using ptrace_breakpoints = breakpoints<pid_t>;
+using pdb_info = ptrace_breakpoints::pdb_info;
+
+// Debuggee memory is accessed through /proc/<pid>/mem, so that patching
+// a single byte costs one pwrite instead of a peek/poke pair.
+struct ptrace_memory
+{
+	std::map<pid_t, int> fds;
+
+	// If set, reads and writes are counted there.
+	run_stats * stats;
+
+	ptrace_memory()
+		: stats(nullptr)
+	{
+	}
+
+	~ptrace_memory()
+	{
+		for (auto && kv: fds)
+			::close(kv.second);
+	}
+
+	void open(pid_t pid)
+	{
+		this->close(pid);
+
+		int fd = ::open(("/proc/" + std::to_string(pid) + "/mem").c_str(), O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			throw std::runtime_error("cannot open process memory");
+		fds[pid] = fd;
+	}
+
+	void close(pid_t pid)
+	{
+		auto it = fds.find(pid);
+		if (it != fds.end())
+		{
+			::close(it->second);
+			fds.erase(it);
+		}
+	}
+
+	bool read(pid_t pid, uint64_t addr, uint8_t * buf, size_t size)
+	{
+		if (stats)
+			stats->count(counter_memory_reads);
+
+		auto it = fds.find(pid);
+		return it != fds.end() && pread(it->second, buf, size, (off_t)addr) == (ssize_t)size;
+	}
+
+	bool write(pid_t pid, uint64_t addr, uint8_t const * buf, size_t size)
+	{
+		if (stats)
+			stats->count(counter_memory_writes);
+
+		auto it = fds.find(pid);
+		return it != fds.end() && pwrite(it->second, buf, size, (off_t)addr) == (ssize_t)size;
+	}
+
+	bool read(pid_t pid, uint64_t addr, uint8_t & byte)
+	{
+		return this->read(pid, addr, &byte, 1);
+	}
+
+	bool write(pid_t pid, uint64_t addr, uint8_t byte)
+	{
+		return this->write(pid, addr, &byte, 1);
+	}
+};
+
+struct process_info
+{
+	// Bases of the images we've already looked at.
+	std::map<uint64_t, std::string> modules;
+
+	// A permanent breakpoint in the dynamic loader, which is hit
+	// whenever a shared object is mapped or unmapped.
+	uint64_t rendezvous;
+	uint8_t rendezvous_byte;
+
+	process_info()
+		: rendezvous(0), rendezvous_byte(0)
+	{
+	}
+};
+
+struct mapped_image
+{
+	std::string path;
+	bool executable;
+};
+
+// Interrupts `waitpid` every `ms` milliseconds, so that sampled breakpoints
+// get re-armed and requests get noticed even when no other events come in.
+struct wakeup_timer
+{
+	explicit wakeup_timer(unsigned ms)
+		: m_active(ms != 0)
+	{
+		if (!m_active)
+			return;
+
+		struct sigaction sa = {};
+		sa.sa_handler = &wakeup_timer::on_alarm;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGALRM, &sa, &m_old_action);
+
+		itimerval timer = {};
+		timer.it_interval.tv_sec = ms / 1000;
+		timer.it_interval.tv_usec = (ms % 1000) * 1000;
+		timer.it_value = timer.it_interval;
+		setitimer(ITIMER_REAL, &timer, &m_old_timer);
+	}
+
+	~wakeup_timer()
+	{
+		if (!m_active)
+			return;
+
+		setitimer(ITIMER_REAL, &m_old_timer, nullptr);
+		sigaction(SIGALRM, &m_old_action, nullptr);
+	}
+
+private:
+	wakeup_timer(wakeup_timer const &);
+	wakeup_timer & operator=(wakeup_timer const &);
+
+	// Installed without SA_RESTART, so the signal makes `waitpid` fail
+	// with EINTR.
+	static void on_alarm(int)
+	{
+	}
+
+	bool m_active;
+	struct sigaction m_old_action;
+	itimerval m_old_timer;
+};
+
+// Requests to an attached tracer: SIGUSR1 asks for a snapshot,
+// SIGINT and SIGTERM for a detach.
+volatile sig_atomic_t g_snapshot_requested;
+volatile sig_atomic_t g_detach_requested;
+
+struct request_handlers
+{
+	explicit request_handlers(bool active)
+		: m_active(active)
+	{
+		g_snapshot_requested = 0;
+		g_detach_requested = 0;
+
+		if (!m_active)
+			return;
+
+		struct sigaction sa = {};
+		sigemptyset(&sa.sa_mask);
+
+		sa.sa_handler = &request_handlers::on_snapshot;
+		sigaction(SIGUSR1, &sa, &m_old_usr1);
+
+		sa.sa_handler = &request_handlers::on_detach;
+		sigaction(SIGINT, &sa, &m_old_int);
+		sigaction(SIGTERM, &sa, &m_old_term);
+	}
+
+	~request_handlers()
+	{
+		if (!m_active)
+			return;
+
+		sigaction(SIGUSR1, &m_old_usr1, nullptr);
+		sigaction(SIGINT, &m_old_int, nullptr);
+		sigaction(SIGTERM, &m_old_term, nullptr);
+	}
+
+private:
+	request_handlers(request_handlers const &);
+	request_handlers & operator=(request_handlers const &);
+
+	// Like the alarm, these interrupt `waitpid`.
+	static void on_snapshot(int)
+	{
+		g_snapshot_requested = 1;
+	}
+
+	static void on_detach(int)
+	{
+		g_detach_requested = 1;
+	}
+
+	bool m_active;
+	struct sigaction m_old_usr1;
+	struct sigaction m_old_int;
+	struct sigaction m_old_term;
+};
+
+// How often the control file is looked for.
+static unsigned const control_poll_ms = 200;
+
+}
+
+// Reads the image path of a process.
+static std::wstring read_exe(pid_t pid)
+{
+	std::string link = "/proc/" + std::to_string(pid) + "/exe";
+
+	char buf[4096];
+	ssize_t len = readlink(link.c_str(), buf, sizeof buf);
+	if (len < 0)
+		return std::wstring();
+	return utf8_to_utf16(string_view(buf, (size_t)len));
+}
+
+// Reads the arguments of a process, quoted like our own command line.
+static std::wstring read_cmdline(pid_t pid)
+{
+	std::ifstream in("/proc/" + std::to_string(pid) + "/cmdline", std::ios::binary);
+
+	std::wstring res;
+	std::string arg;
+	while (std::getline(in, arg, '\0'))
+		win_append_cmdline_arg(res, utf8_to_utf16(arg));
+	return res;
+}
+
+// Lists the files mapped into a process, keyed by the start address
+// of their mapping at file offset zero.
+static std::map<uint64_t, mapped_image> read_maps(pid_t pid)
+{
+	std::map<uint64_t, mapped_image> res;
+
+	std::ifstream maps("/proc/" + std::to_string(pid) + "/maps");
+	mapped_image * cur = nullptr;
+
+	std::string line;
+	while (std::getline(maps, line))
+	{
+		uint64_t start, end, offset;
+		char perms[5];
+		int path_pos = -1;
+		if (sscanf(line.c_str(), "%" SCNx64 "-%" SCNx64 " %4s %" SCNx64 " %*s %*s %n", &start, &end, perms, &offset, &path_pos) < 4
+			|| path_pos < 0)
+		{
+			continue;
+		}
+
+		std::string path = line.substr(path_pos);
+		if (path.empty() || path[0] != '/')
+		{
+			cur = nullptr;
+			continue;
+		}
+
+		if (offset == 0)
+		{
+			cur = &res[start];
+			cur->path = path;
+			cur->executable = false;
+		}
+
+		if (cur && cur->path == path && perms[2] == 'x')
+			cur->executable = true;
+	}
+
+	return res;
+}
+
+static uint64_t read_auxv(pid_t pid, uint64_t type)
+{
+	std::ifstream auxv("/proc/" + std::to_string(pid) + "/auxv", std::ios::binary);
+
+	uint64_t entry[2];
+	while (auxv.read((char *)entry, sizeof entry) && entry[0] != 0)
+	{
+		if (entry[0] == type)
+			return entry[1];
+	}
+
+	return 0;
+}
+
+// Consumes the control file, if it's there. Returns false if it isn't;
+// otherwise sets `detach` if it asks for a detach rather than a snapshot.
+static bool take_control_file(std::wstring const & fname, bool & detach)
+{
+	std::string path = utf16_to_utf8(fname);
+
+	std::ifstream in(path);
+	if (!in)
+		return false;
+
+	std::string word;
+	in >> word;
+	in.close();
+
+	unlink(path.c_str());
+	detach = word == "detach";
+	return true;
+}
+
+static bool read_status(pid_t tid, pid_t & tgid, pid_t & ppid)
+{
+	std::ifstream status("/proc/" + std::to_string(tid) + "/status");
+
+	bool has_tgid = false;
+	bool has_ppid = false;
+
+	std::string line;
+	while (std::getline(status, line))
+	{
+		if (line.compare(0, 5, "Tgid:") == 0)
+		{
+			tgid = (pid_t)std::stol(line.substr(5));
+			has_tgid = true;
+		}
+		else if (line.compare(0, 5, "PPid:") == 0)
+		{
+			ppid = (pid_t)std::stol(line.substr(5));
+			has_ppid = true;
+		}
+	}
+
+	return has_tgid && has_ppid;
+}
+
+// Seized threads report group-stops as PTRACE_EVENT_STOP with the stop
+// signal, and other event stops, like those of PTRACE_INTERRUPT, with SIGTRAP.
+static bool is_group_stop(int status)
+{
+	int sig = WSTOPSIG(status);
+	return (status >> 16) == PTRACE_EVENT_STOP
+		&& (sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN || sig == SIGTTOU);
+}
+
+// Traces `root` and everything it starts until they're all gone or, if
+// `attach` is set, until a detach is requested. When launching, `root` is
+// a seized and stopped child that has yet to exec; when attaching, `stopped` holds
+// the seized threads, all stopped, with the signal each is to be resumed
+// with, or -1 for those in a group-stop.
+static coverage_info trace_processes(pid_t root, std::map<pid_t, int> const & stopped, capture_options const & opts,
+	attach_options const * attach)
+{
+	std::vector<std::wstring> debug_dirs = split_search_path(opts.sympath);
+	debug_dirs.push_back(L"/usr/lib/debug");
+
+	ptrace_breakpoints bkpts;
+	bkpts.log = opts.log;
+	bkpts.lazy = opts.lazy;
+	bkpts.count_hits = opts.sample_ms != 0;
+	bkpts.per_process = opts.per_process;
+	bkpts.stats = opts.stats;
+	ptrace_memory mem;
+	mem.stats = opts.stats;
+
+	std::map<pid_t, process_info> processes;
+	std::map<pid_t, pid_t> threads;
+
+	auto load_module = [&](pid_t pid, std::string const & path, uint64_t base) {
+		std::wstring image_path = utf8_to_utf16(path);
+
+		elf_file image;
+		if (!image.open(image_path) || image.build_id().empty())
+			return;
+
+		guid pdb_guid = image.build_id_guid();
+
+		pdb_info * pi;
+		bool orig_bytes_known;
+
+		auto pi_it = bkpts.pdbs.find(pdb_guid);
+		if (pi_it == bkpts.pdbs.end())
+		{
+			std::vector<uint8_t> cv = image.build_id_note();
+
+			// A warm cache entry is read straight from its mapping.
+			std::wstring filename;
+			std::vector<uint64_t> offsets;
+			std::vector<std::pair<uint64_t, uint64_t>> functions;
+			{
+				stats_timer timer(opts.stats, "symbols", image_path);
+
+				line_cache_entry entry;
+				if (!opts.cache_dir.empty() && entry.open(opts.cache_dir, pdb_guid, cv))
+				{
+					filename = entry.filename();
+					offsets.reserve(entry.row_count());
+					for (size_t i = 0; i < entry.row_count(); ++i)
+						offsets.push_back(entry.row(i).address);
+					for (size_t i = 0; i < entry.function_count(); ++i)
+						functions.push_back(entry.function(i));
+
+					if (opts.stats)
+						opts.stats->count(counter_line_cache_hits);
+				}
+				else
+				{
+					// Line information we can't read, like compressed sections,
+					// costs us this module only, but isn't skipped silently.
+					module_lines ml;
+					try
+					{
+						if (!dwarf_read_module_lines(ml, image_path, image.build_id(), debug_dirs))
+							return;
+					}
+					catch (std::exception const & e)
+					{
+						std::wcerr << L"warning: skipping " << image_path << L": " << utf8_to_utf16(e.what()) << L"\n";
+						return;
+					}
+
+					if (!opts.cache_dir.empty())
+						store_line_cache(opts.cache_dir, pdb_guid, cv, ml);
+
+					filename = std::move(ml.filename);
+					offsets.reserve(ml.lines.rows.size());
+					for (line_table_row const & row: ml.lines.rows)
+						offsets.push_back(row.address);
+					functions = std::move(ml.functions);
+				}
+			}
+
+			if (offsets.empty())
+				return;
+
+			if (opts.stats)
+			{
+				opts.stats->count(counter_modules_read);
+				opts.stats->count(counter_line_addresses, offsets.size());
+			}
+
+			pi = &bkpts.pdbs[pdb_guid];
+			orig_bytes_known = false;
+
+			pi->image_size = (uint32_t)image.image_size();
+			pi->timestamp = 0;
+			pi->filename = std::move(filename);
+			pi->cv = std::move(cv);
+
+			if (opts.blocks)
+			{
+				// The image is still pristine, nothing has been armed in it yet;
+				// the backend only traces x86-64 processes.
+				stats_timer timer(opts.stats, "blocks", image_path);
+				pi->set_blocks(find_basic_blocks(std::move(offsets), functions, true,
+					[&](uint64_t offset, uint8_t * buf, size_t size) {
+						return mem.read(pid, base + offset, buf, size);
+					}));
+			}
+			else
+			{
+				pi->set_offsets(std::move(offsets));
+			}
+
+			if (bkpts.lazy)
+				pi->set_functions(std::move(functions));
+		}
+		else
+		{
+			pi = &pi_it->second;
+			orig_bytes_known = true;
+		}
+
+		bkpts.arm(mem, pid, *pi, base, orig_bytes_known);
+	};
+
+	// Brings our view of the process' images up to date with its mappings.
+	auto sync_modules = [&](pid_t pid) {
+		process_info & proc = processes[pid];
+		std::map<uint64_t, mapped_image> maps = read_maps(pid);
+
+		for (auto it = proc.modules.begin(); it != proc.modules.end(); )
+		{
+			auto map_it = maps.find(it->first);
+			if (map_it == maps.end() || map_it->second.path != it->second)
+			{
+				bkpts.remove_module(pid, it->first);
+				it = proc.modules.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+
+		for (auto && kv: maps)
+		{
+			if (!kv.second.executable || proc.modules.find(kv.first) != proc.modules.end())
+				continue;
+
+			proc.modules[kv.first] = kv.second.path;
+			load_module(pid, kv.second.path, kv.first);
+		}
+	};
+
+	auto set_rendezvous = [&](pid_t pid) {
+		process_info & proc = processes[pid];
+		proc.rendezvous = 0;
+
+		uint64_t interp_base = read_auxv(pid, AT_BASE);
+		if (interp_base == 0)
+			return;
+
+		std::map<uint64_t, mapped_image> maps = read_maps(pid);
+		auto it = maps.find(interp_base);
+		if (it == maps.end())
+			return;
+
+		elf_file interp;
+		if (!interp.open(utf8_to_utf16(it->second.path)))
+			return;
+
+		uint64_t sym = interp.find_symbol("_dl_debug_state");
+		if (sym == 0)
+			return;
+
+		uint64_t addr = interp_base + sym - interp.image_base();
+		if (!mem.read(pid, addr, proc.rendezvous_byte) || !mem.write(pid, addr, 0xcc))
+			return;
+
+		proc.rendezvous = addr;
+	};
+
+	// Registers a thread we haven't seen before and returns its process id.
+	// New processes inherit the images and breakpoints of their parent.
+	auto attach_thread = [&](pid_t tid) {
+		pid_t tgid = tid;
+		pid_t ppid = 0;
+		read_status(tid, tgid, ppid);
+
+		threads[tid] = tgid;
+		if (processes.find(tgid) != processes.end())
+			return tgid;
+
+		if (tgid != tid)
+			read_status(tgid, tgid, ppid);
+
+		if (opts.stats)
+			opts.stats->count(counter_processes);
+
+		mem.open(tgid);
+
+		if (bkpts.per_process)
+			bkpts.start_process(tgid, (uint32_t)tgid, read_exe(tgid), read_cmdline(tgid));
+
+		auto parent_it = processes.find(ppid);
+		if (parent_it != processes.end())
+		{
+			processes[tgid] = parent_it->second;
+			bkpts.clone_process(mem, ppid, tgid);
+		}
+		else
+		{
+			processes[tgid];
+		}
+
+		return tgid;
+	};
+
+	// Steps a thread over the loader breakpoint and then picks up
+	// whatever the loader has just mapped or unmapped.
+	auto process_rendezvous = [&](pid_t tid, pid_t pid, user_regs_struct & regs) {
+		process_info & proc = processes[pid];
+		uint64_t addr = proc.rendezvous;
+
+		bkpts.hit(mem, pid, addr);
+
+		regs.rip = addr;
+		ptrace(PTRACE_SETREGS, tid, nullptr, &regs);
+		mem.write(pid, addr, proc.rendezvous_byte);
+
+		int sig = 0;
+		int step_status;
+		ptrace(PTRACE_SINGLESTEP, tid, nullptr, nullptr);
+
+		// The sample timer may interrupt the wait.
+		pid_t waited;
+		do
+			waited = waitpid(tid, &step_status, __WALL);
+		while (waited < 0 && errno == EINTR);
+
+		if (waited != tid || !WIFSTOPPED(step_status))
+			return -1;
+
+		if (WSTOPSIG(step_status) != SIGTRAP)
+			sig = WSTOPSIG(step_status);
+
+		mem.write(pid, addr, 0xcc);
+		sync_modules(pid);
+		return sig;
+	};
+
+	// Puts the original code back and lets go of every thread. Only stopped
+	// threads can be detached, so they're all interrupted first. Traps from
+	// breakpoints hit in the meantime are rewound, other signals are passed
+	// on, and threads and processes that show up late are let go as well.
+	auto detach_all = [&]() {
+		std::set<pid_t> disarmed;
+		for (auto && kv: processes)
+		{
+			bkpts.disarm(mem, kv.first);
+			if (kv.second.rendezvous != 0)
+				mem.write(kv.first, kv.second.rendezvous, kv.second.rendezvous_byte);
+			disarmed.insert(kv.first);
+		}
+
+		std::set<pid_t> pending;
+		for (auto && kv: threads)
+		{
+			ptrace(PTRACE_INTERRUPT, kv.first, nullptr, nullptr);
+			pending.insert(kv.first);
+		}
+
+		while (!pending.empty())
+		{
+			int status;
+			pid_t tid = waitpid(-1, &status, __WALL);
+			if (tid < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+
+			if (!WIFSTOPPED(status))
+			{
+				pending.erase(tid);
+				continue;
+			}
+
+			pid_t pid;
+			auto thread_it = threads.find(tid);
+			if (thread_it == threads.end())
+			{
+				// A forked child starts with a copy of its parent's breakpoints.
+				pid = attach_thread(tid);
+				if (disarmed.insert(pid).second)
+				{
+					bkpts.disarm(mem, pid);
+					process_info & proc = processes[pid];
+					if (proc.rendezvous != 0)
+						mem.write(pid, proc.rendezvous, proc.rendezvous_byte);
+				}
+			}
+			else
+			{
+				pid = thread_it->second;
+			}
+
+			int sig = WSTOPSIG(status);
+			int event = status >> 16;
+			int pass = 0;
+
+			if (event == PTRACE_EVENT_CLONE || event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK)
+			{
+				unsigned long new_tid;
+				if (ptrace(PTRACE_GETEVENTMSG, tid, nullptr, &new_tid) == 0 && threads.find((pid_t)new_tid) == threads.end())
+					pending.insert((pid_t)new_tid);
+			}
+			else if (event == 0 && sig == SIGTRAP)
+			{
+				pass = sig;
+
+				user_regs_struct regs;
+				if (ptrace(PTRACE_GETREGS, tid, nullptr, &regs) == 0)
+				{
+					uint64_t addr = regs.rip - 1;
+
+					process_info & proc = processes[pid];
+					if ((proc.rendezvous != 0 && addr == proc.rendezvous) || bkpts.owns(pid, addr))
+					{
+						regs.rip = addr;
+						ptrace(PTRACE_SETREGS, tid, nullptr, &regs);
+						pass = 0;
+					}
+				}
+			}
+			else if (event == 0)
+			{
+				pass = sig;
+			}
+
+			ptrace(PTRACE_DETACH, tid, nullptr, (void *)(intptr_t)pass);
+			pending.erase(tid);
+		}
+	};
+
+	bool exec_seen = false;
+	if (attach)
+	{
+		for (auto && kv: stopped)
+			attach_thread(kv.first);
+
+		set_rendezvous(root);
+		sync_modules(root);
+
+		for (auto && kv: stopped)
+		{
+			if (kv.second < 0)
+				ptrace(PTRACE_LISTEN, kv.first, nullptr, nullptr);
+			else
+				ptrace(PTRACE_CONT, kv.first, nullptr, (void *)(intptr_t)kv.second);
+		}
+		exec_seen = true;
+	}
+	else
+	{
+		threads[root] = root;
+		processes[root];
+		mem.open(root);
+		ptrace(PTRACE_CONT, root, nullptr, nullptr);
+	}
+
+	std::chrono::milliseconds sample_period(opts.sample_ms);
+	std::chrono::steady_clock::time_point next_rearm = std::chrono::steady_clock::now() + sample_period;
+
+	std::chrono::milliseconds poll_period(control_poll_ms);
+	std::chrono::steady_clock::time_point next_poll = std::chrono::steady_clock::now() + poll_period;
+
+	unsigned wakeup_ms = opts.sample_ms;
+	if (attach && (wakeup_ms == 0 || wakeup_ms > control_poll_ms))
+		wakeup_ms = control_poll_ms;
+
+	request_handlers handlers(attach != nullptr);
+	wakeup_timer timer(wakeup_ms);
+
+	// Breakpoint traps are timed from the moment their stop is reported
+	// to the moment the thread is resumed.
+	run_stats::clock::time_point event_time;
+	auto count_trap = [&]() {
+		if (!opts.stats)
+			return;
+
+		auto latency = std::chrono::duration_cast<std::chrono::microseconds>(run_stats::clock::now() - event_time);
+		opts.stats->count(counter_traps);
+		opts.stats->sample(histogram_trap_latency_us, (uint64_t)latency.count());
+	};
+
+	stats_timer loop_timer(opts.stats, "event_loop", L"event loop");
+
+	for (;;)
+	{
+		if (bkpts.count_hits && std::chrono::steady_clock::now() >= next_rearm)
+		{
+			bkpts.rearm(mem);
+			next_rearm = std::chrono::steady_clock::now() + sample_period;
+		}
+
+		if (attach)
+		{
+			bool detach = g_detach_requested != 0;
+			if (!attach->control_file.empty() && std::chrono::steady_clock::now() >= next_poll)
+			{
+				bool detach_asked = false;
+				if (take_control_file(attach->control_file, detach_asked))
+				{
+					if (detach_asked)
+						detach = true;
+					else
+						g_snapshot_requested = 1;
+				}
+				next_poll = std::chrono::steady_clock::now() + poll_period;
+			}
+
+			if (g_snapshot_requested)
+			{
+				g_snapshot_requested = 0;
+				if (attach->snapshot)
+				{
+					stats_timer snapshot_timer(opts.stats, "snapshot", L"snapshot");
+					attach->snapshot(bkpts.get_coverage());
+				}
+			}
+
+			if (detach)
+			{
+				detach_all();
+				return bkpts.get_coverage();
+			}
+		}
+
+		int status;
+		pid_t tid = waitpid(-1, &status, __WALL);
+		if (tid < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == ECHILD)
+				return bkpts.get_coverage();
+			throw std::runtime_error("waitpid failed");
+		}
+
+		if (WIFEXITED(status) || WIFSIGNALED(status))
+		{
+			if (tid == root && !exec_seen)
+				throw std::runtime_error("can't create process");
+
+			threads.erase(tid);
+
+			// The thread group leader is reaped last, so the process is gone.
+			if (processes.erase(tid))
+			{
+				bkpts.remove_process(tid);
+				mem.close(tid);
+			}
+			continue;
+		}
+
+		if (!WIFSTOPPED(status))
+			continue;
+
+		if (opts.stats)
+			event_time = run_stats::clock::now();
+
+		pid_t pid;
+
+		auto thread_it = threads.find(tid);
+		if (thread_it == threads.end())
+		{
+			pid = attach_thread(tid);
+		}
+		else
+		{
+			pid = thread_it->second;
+		}
+
+		int sig = WSTOPSIG(status);
+		int event = status >> 16;
+
+		if (event == PTRACE_EVENT_EXEC)
+		{
+			// The other threads are gone and the exec'ing thread
+			// has taken over the thread group leader's id.
+			for (auto it = threads.begin(); it != threads.end(); )
+			{
+				if (it->second == pid)
+					it = threads.erase(it);
+				else
+					++it;
+			}
+			threads[pid] = pid;
+
+			bkpts.remove_process(pid);
+			processes[pid] = process_info();
+			mem.open(pid);
+
+			if (bkpts.per_process)
+				bkpts.start_process(pid, (uint32_t)pid, read_exe(pid), read_cmdline(pid));
+
+			if (opts.stats)
+				opts.stats->count(counter_execs);
+
+			set_rendezvous(pid);
+			sync_modules(pid);
+
+			exec_seen = true;
+			ptrace(PTRACE_CONT, tid, nullptr, nullptr);
+			continue;
+		}
+
+		// Group-stopped threads are left stopped, as job control expects,
+		// until a SIGCONT makes them report again.
+		if (is_group_stop(status))
+		{
+			ptrace(PTRACE_LISTEN, tid, nullptr, nullptr);
+			continue;
+		}
+
+		if (event != 0)
+		{
+			// Forked processes and new threads announce themselves
+			// with a stop of their own.
+			ptrace(PTRACE_CONT, tid, nullptr, nullptr);
+			continue;
+		}
+
+		if (sig == SIGTRAP)
+		{
+			user_regs_struct regs;
+			if (ptrace(PTRACE_GETREGS, tid, nullptr, &regs) == 0)
+			{
+				uint64_t addr = regs.rip - 1;
+
+				process_info & proc = processes[pid];
+				if (proc.rendezvous != 0 && addr == proc.rendezvous)
+				{
+					int pending = process_rendezvous(tid, pid, regs);
+					if (pending >= 0)
+						ptrace(PTRACE_CONT, tid, nullptr, (void *)(intptr_t)pending);
+					if (opts.stats)
+						opts.stats->count(counter_loader_traps);
+					continue;
+				}
+
+				if (bkpts.hit(mem, pid, addr))
+				{
+					regs.rip = addr;
+					ptrace(PTRACE_SETREGS, tid, nullptr, &regs);
+					ptrace(PTRACE_CONT, tid, nullptr, nullptr);
+					count_trap();
+					continue;
+				}
+			}
+		}
+
+		ptrace(PTRACE_CONT, tid, nullptr, (void *)(intptr_t)sig);
+	}
+}
+
+coverage_info capture_coverage(std::wstring cmdline, capture_options const & opts)
+{
+	std::vector<std::string> args;
+	for (wstring_view rest = cmdline; !rest.empty(); )
+		args.push_back(utf16_to_utf8(win_split_cmdline_arg(rest)));
+
+	if (args.empty())
+		throw std::runtime_error("can't create process");
+
+	std::vector<char *> argv;
+	for (std::string & arg: args)
+		argv.push_back(&arg[0]);
+	argv.push_back(nullptr);
+
+	// The child waits for the pipe to close before it execs, so that it's
+	// seized from the start. Seizing rather than PTRACE_TRACEME lets us
+	// tell group-stops apart and leave them stopped.
+	int sync_pipe[2];
+	if (pipe2(sync_pipe, O_CLOEXEC) < 0)
+		throw std::runtime_error("can't create process");
+
+	pid_t child = fork();
+	if (child < 0)
+	{
+		::close(sync_pipe[0]);
+		::close(sync_pipe[1]);
+		throw std::runtime_error("can't create process");
+	}
+
+	if (child == 0)
+	{
+		::close(sync_pipe[1]);
+
+		char c;
+		ssize_t r;
+		do
+			r = read(sync_pipe[0], &c, 1);
+		while (r < 0 && errno == EINTR);
+
+		execvp(argv[0], argv.data());
+		_exit(127);
+	}
+
+	::close(sync_pipe[0]);
+
+	long options = PTRACE_O_TRACEEXEC | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_EXITKILL;
+	if (ptrace(PTRACE_SEIZE, child, nullptr, (void *)options) < 0)
+	{
+		::close(sync_pipe[1]);
+		kill(child, SIGKILL);
+		waitpid(child, nullptr, 0);
+		throw std::runtime_error("can't trace process");
+	}
+
+	ptrace(PTRACE_INTERRUPT, child, nullptr, nullptr);
+	::close(sync_pipe[1]);
+
+	int status;
+	if (waitpid(child, &status, __WALL) != child || !WIFSTOPPED(status))
+		throw std::runtime_error("can't create process");
+
+	return trace_processes(child, std::map<pid_t, int>(), opts, nullptr);
+}
+
+coverage_info attach_coverage(uint32_t pid, attach_options const & opts)
+{
+	pid_t root = (pid_t)pid;
+	std::string task_dir = "/proc/" + std::to_string(root) + "/task";
+
+	// New threads of seized threads are traced automatically, but
+	// threads we haven't got to yet may start more, so keep going until
+	// a pass finds nothing new. Threads that exit meanwhile are skipped.
+	long options = PTRACE_O_TRACEEXEC | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK;
+	std::set<pid_t> seized;
+	for (bool found = true; found; )
+	{
+		found = false;
+
+		DIR * dir = opendir(task_dir.c_str());
+		if (!dir)
+			break;
+
+		while (dirent * entry = readdir(dir))
+		{
+			pid_t tid = (pid_t)atoi(entry->d_name);
+			if (tid <= 0 || seized.find(tid) != seized.end())
+				continue;
+
+			if (ptrace(PTRACE_SEIZE, tid, nullptr, (void *)options) == 0)
+			{
+				seized.insert(tid);
+				found = true;
+			}
+		}
+
+		closedir(dir);
+	}
+
+	if (seized.find(root) == seized.end())
+	{
+		for (pid_t tid: seized)
+			ptrace(PTRACE_DETACH, tid, nullptr, nullptr);
+		throw std::runtime_error("can't attach to process");
+	}
+
+	// Stop every thread, remembering the signal it was about to get
+	// if it stopped for one first, and whether it was stopped already.
+	for (pid_t tid: seized)
+		ptrace(PTRACE_INTERRUPT, tid, nullptr, nullptr);
+
+	std::map<pid_t, int> stopped;
+	for (pid_t tid: seized)
+	{
+		int status;
+		pid_t waited;
+		do
+			waited = waitpid(tid, &status, __WALL);
+		while (waited < 0 && errno == EINTR);
+
+		if (waited != tid || !WIFSTOPPED(status))
+			continue;
+
+		if (is_group_stop(status))
+			stopped[tid] = -1;
+		else
+			stopped[tid] = (status >> 16) == 0? WSTOPSIG(status): 0;
+	}
+
+	return trace_processes(root, stopped, opts, &opts);
+}
+
+#endif
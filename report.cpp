@@ -1,5 +1,20 @@
 #include "json.h"
 #include "debugger_loop.h"
+#include "elf_file.h"
+#include "dwarf_line.h"
+#include "pdb_file.h"
+#include "line_cache.h"
+#include "utils.h"
+#include "parallel.h"
+#include "stats.h"
+#include "dbghelp_lines.h"
+#include <unordered_map>
+#include <algorithm>
+#include <mutex>
+#include <cstdio>
+
+#ifdef _WIN32
+
 #include <windows.h>
 
 #pragma warning(push)
@@ -8,94 +23,486 @@
 #include <dbghelp.h>
 #pragma warning(pop)
 
+#endif
+
 namespace {
 
+// Assigns dense ids to distinct source file paths.
+struct file_table
+{
+	std::unordered_map<std::string, uint32_t> ids;
+	std::vector<std::string> names;
+
+	uint32_t intern(std::string const & name)
+	{
+		auto r = ids.emplace(name, (uint32_t)names.size());
+		if (r.second)
+			names.push_back(name);
+		return r.first->second;
+	}
+};
+
+// The lines of one module's files, sorted and aggregated.
+struct module_report
+{
+	std::vector<std::string> files;
+	std::vector<std::vector<coverage_line_info>> lines;
+};
+
 struct report_ctx
 {
-	pdb_coverage_info const * ci;
-	uint64_t base;
-	std::map<std::wstring, std::map<uint64_t, std::pair<uint64_t, uint64_t>>> rep;
-	std::exception_ptr exc;
+	file_table files;
+
+	// Indexed by file id. Each module appends its lines in order, so
+	// files shared by several modules need to be sorted again.
+	std::vector<std::vector<coverage_line_info>> lines;
+};
+
+// The rows of a line table sorted by address; the paths are moved out.
+struct table_rows
+{
+	line_table & lines;
+
+	size_t size() const { return lines.rows.size(); }
+	line_table_row row(size_t i) const { return lines.rows[i]; }
+	std::string file(uint32_t i) { return std::move(lines.files[i]); }
+};
+
+// The rows of a line cache entry, read from its mapping.
+struct cache_rows
+{
+	line_cache_entry const & entry;
+
+	size_t size() const { return entry.row_count(); }
+	line_table_row row(size_t i) const { return entry.row(i); }
+	std::string file(uint32_t i) const { return entry.file(i); }
 };
 
 }
 
-static BOOL CALLBACK SymEnumLinesProc(PSRCCODEINFOW LineInfo, PVOID UserContext) noexcept
+#ifdef _WIN32
+
+// Has dbghelp look for the PDB, including on symbol servers.
+static bool dbghelp_read_module_lines(module_lines & res, HANDLE hp, pdb_coverage_info const & pci)
 {
-	report_ctx & ctx = *static_cast<report_ctx *>(UserContext);
+	std::vector<uint8_t> buf;
+	buf.resize(sizeof(MODLOAD_CVMISC) + pci.cv.size());
+
+	MODLOAD_CVMISC * cvmisc = (MODLOAD_CVMISC *)buf.data();
+	cvmisc->oCV = sizeof(MODLOAD_CVMISC);
+	cvmisc->cCV = pci.cv.size();
+	cvmisc->oMisc = 0;
+	cvmisc->cMisc = 0;
+	cvmisc->dtImage = pci.timestamp;
+	cvmisc->cImage = pci.image_size;
+	std::copy(pci.cv.begin(), pci.cv.end(), buf.data() + sizeof(MODLOAD_CVMISC));
+
+	MODLOAD_DATA md = {};
+	md.ssize = sizeof md;
+	md.ssig = DBHHEADER_CVMISC;
+	md.data = buf.data();
+	md.size = buf.size();
 
+	uint64_t base = SymLoadModuleExW(hp, 0, L"kkk", nullptr, 0x10000, pci.image_size, &md, 0);
+	if (base == 0)
+		return false;
+
+	line_table lines;
 	try
 	{
-		bool covered = std::binary_search(ctx.ci->addrs_covered.begin(), ctx.ci->addrs_covered.end(), LineInfo->Address - ctx.base);
-
-		auto & tot_cov = ctx.rep[LineInfo->FileName][LineInfo->LineNumber];
-		++tot_cov.first;
-		if (covered)
-			++tot_cov.second;
-		return TRUE;
+		lines = dbghelp_read_line_table(hp, base);
 	}
 	catch (...)
 	{
-		ctx.exc = std::current_exception();
-		return FALSE;
+		SymUnloadModule64(hp, base);
+		throw;
 	}
+
+	IMAGEHLP_MODULEW64 im = { sizeof im };
+	if (SymGetModuleInfoW64(hp, base, &im))
+		res.filename = im.LoadedPdbName;
+
+	SymUnloadModule64(hp, base);
+
+	res.lines = std::move(lines);
+	return true;
 }
 
-coverage_report report(coverage_info const & ci, std::wstring const & sympath)
+#endif
+
+// Aggregates a module's line records, given as `table_rows` or `cache_rows`
+// sorted by address; row addresses must be relative to the module base,
+// just like `addrs_covered`. The rows are joined with the covered addresses
+// in one pass, then sorted by file and line so that each line is aggregated
+// once.
+template <typename Rows>
+static void report_lines(module_report & res, pdb_coverage_info const & pci, Rows & rows)
 {
-	HANDLE hp = (HANDLE)4;
-	SymInitializeW(hp, sympath.c_str(), FALSE);
+	struct row_hit
+	{
+		uint32_t file;
+		uint32_t line;
+		uint16_t runs;
+		uint32_t hits;
+	};
 
-	report_ctx ctx;
+	std::vector<row_hit> hits;
+	hits.reserve(rows.size());
+
+	std::vector<uint64_t> const & addrs = pci.addrs_covered;
+	size_t addr_idx = 0;
+	for (size_t i = 0; i < rows.size(); ++i)
+	{
+		line_table_row row = rows.row(i);
+		while (addr_idx != addrs.size() && addrs[addr_idx] < row.address)
+			++addr_idx;
+
+		row_hit hit = { row.file, row.line, 0, 0 };
+		if (addr_idx != addrs.size() && addrs[addr_idx] == row.address)
+		{
+			hit.runs = pci.run_counts.empty()? 1: pci.run_counts[addr_idx];
+			hit.hits = pci.hit_counts.empty()? 0: pci.hit_counts[addr_idx];
+		}
+		hits.push_back(hit);
+	}
+
+	std::sort(hits.begin(), hits.end(), [](row_hit const & lhs, row_hit const & rhs) {
+		return lhs.file != rhs.file? lhs.file < rhs.file: lhs.line < rhs.line;
+	});
+
+	for (size_t i = 0; i != hits.size();)
+	{
+		uint32_t file = hits[i].file;
+		res.files.push_back(rows.file(file));
+		res.lines.emplace_back();
+		std::vector<coverage_line_info> & file_lines = res.lines.back();
+
+		while (i != hits.size() && hits[i].file == file)
+		{
+			coverage_line_info li = {};
+			li.line = hits[i].line;
+			for (; i != hits.size() && hits[i].file == file && hits[i].line == li.line; ++i)
+			{
+				++li.total_addresses;
+				if (hits[i].runs != 0)
+					++li.covered;
+				li.runs = (std::max)(li.runs, (uint64_t)hits[i].runs);
+				li.hits = (std::max)(li.hits, (uint64_t)hits[i].hits);
+			}
+
+			file_lines.push_back(li);
+		}
+	}
+}
+
+static void add_module_report(report_ctx & ctx, module_report & mr)
+{
+	for (size_t i = 0; i < mr.files.size(); ++i)
+	{
+		uint32_t id = ctx.files.intern(mr.files[i]);
+		if (id == ctx.lines.size())
+			ctx.lines.push_back(std::move(mr.lines[i]));
+		else
+			ctx.lines[id].insert(ctx.lines[id].end(), mr.lines[i].begin(), mr.lines[i].end());
+	}
+}
+
+// Sorts the lines by number and combines the ones that several modules
+// contributed.
+static void combine_lines(std::vector<coverage_line_info> & lines)
+{
+	auto not_less = [](coverage_line_info const & lhs, coverage_line_info const & rhs) {
+		return lhs.line >= rhs.line;
+	};
+
+	if (std::adjacent_find(lines.begin(), lines.end(), not_less) == lines.end())
+		return;
+
+	std::sort(lines.begin(), lines.end(), [](coverage_line_info const & lhs, coverage_line_info const & rhs) {
+		return lhs.line < rhs.line;
+	});
+
+	size_t out = 0;
+	for (size_t i = 0; i != lines.size(); ++i)
+	{
+		if (out != 0 && lines[out - 1].line == lines[i].line)
+		{
+			coverage_line_info & li = lines[out - 1];
+			li.total_addresses += lines[i].total_addresses;
+			li.covered += lines[i].covered;
+			li.runs = (std::max)(li.runs, lines[i].runs);
+			li.hits = (std::max)(li.hits, lines[i].hits);
+		}
+		else
+		{
+			lines[out++] = lines[i];
+		}
+	}
+	lines.resize(out);
+}
+
+static void get_report_columns(coverage_info const & ci, bool & has_run_counts, bool & has_hit_counts)
+{
+	has_run_counts = false;
+	has_hit_counts = false;
 	for (auto && kv: ci.pdbs)
 	{
-		std::vector<uint8_t> buf;
-		buf.resize(sizeof(MODLOAD_CVMISC) + kv.second.cv.size());
-
-		MODLOAD_CVMISC * cvmisc = (MODLOAD_CVMISC *)buf.data();
-		cvmisc->oCV = sizeof(MODLOAD_CVMISC);
-		cvmisc->cCV = kv.second.cv.size();
-		cvmisc->oMisc = 0;
-		cvmisc->cMisc = 0;
-		cvmisc->dtImage = kv.second.timestamp;
-		cvmisc->cImage = kv.second.image_size;
-		std::copy(kv.second.cv.begin(), kv.second.cv.end(), buf.data() + sizeof(MODLOAD_CVMISC));
-
-		MODLOAD_DATA md = {};
-		md.ssize = sizeof md;
-		md.ssig = DBHHEADER_CVMISC;
-		md.data = buf.data();
-		md.size = buf.size();
-
-		uint64_t base = SymLoadModuleExW(hp, 0, L"kkk", nullptr, 0x10000, kv.second.image_size, &md, 0);
-		if (base == 0)
-			throw std::runtime_error("failed to load symbols");
-
-		ctx.ci = &kv.second;
-		ctx.base = base;
-		SymEnumLinesW(hp, base, nullptr, nullptr, &SymEnumLinesProc, &ctx);
-		if (ctx.exc != nullptr)
-			std::rethrow_exception(ctx.exc);
+		if (!kv.second.run_counts.empty())
+			has_run_counts = true;
+		if (!kv.second.hit_counts.empty())
+			has_hit_counts = true;
+	}
+}
 
-		SymUnloadModule64(hp, base);
+static void write_file_lines(json_writer & w, std::wstring const & filename,
+	coverage_line_info const * first, coverage_line_info const * last, bool has_run_counts, bool has_hit_counts)
+{
+	w.write_key(filename);
+	w.open_array();
+	for (; first != last; ++first)
+	{
+		w.open_array();
+		w.write_num(first->line);
+		w.write_num(first->total_addresses);
+		w.write_num(first->covered);
+		if (has_run_counts || has_hit_counts)
+			w.write_num(first->runs);
+		if (has_hit_counts)
+			w.write_num(first->hits);
+		w.close_array();
 	}
+	w.close_array();
+}
 
-	coverage_report cr;
-	for (auto & kv: ctx.rep)
+// A temporary file holding the partial reports of modules that were
+// already processed. Each module's files are written as one run sorted
+// by name; a record is the UTF-8 name and the file's lines, both
+// prefixed with their 32-bit size.
+struct spill_file
+{
+	FILE * f;
+	uint64_t size;
+
+	spill_file()
+		: f(std::tmpfile()), size(0)
 	{
-		coverage_file_report fr;
-		fr.filename = kv.first;
+		if (!f)
+			throw std::runtime_error("cannot create a temporary file");
+	}
+
+	~spill_file()
+	{
+		fclose(f);
+	}
 
-		for (auto & line_kv: kv.second)
+	void write(void const * p, size_t len)
+	{
+		if (fwrite(p, 1, len, f) != len)
+			throw std::runtime_error("cannot write to a temporary file");
+		size += len;
+	}
+
+	void read(uint64_t pos, void * p, size_t len)
+	{
+#ifdef _WIN32
+		int r = _fseeki64(f, (__int64)pos, SEEK_SET);
+#else
+		int r = fseeko(f, (off_t)pos, SEEK_SET);
+#endif
+		if (r != 0 || fread(p, 1, len, f) != len)
+			throw std::runtime_error("cannot read from a temporary file");
+	}
+
+private:
+	spill_file(spill_file const &);
+	spill_file & operator=(spill_file const &);
+};
+
+// Reads one run of a spill file back, one record at a time.
+struct spill_cursor
+{
+	uint64_t pos;
+	uint64_t last;
+	std::wstring filename;
+	std::vector<coverage_line_info> lines;
+
+	bool next(spill_file & spill)
+	{
+		if (pos == last)
+			return false;
+
+		uint32_t size;
+		spill.read(pos, &size, sizeof size);
+		std::string name(size, '\0');
+		if (size != 0)
+			spill.read(pos + 4, &name[0], size);
+		pos += 4 + size;
+		filename = utf8_to_utf16(name);
+
+		spill.read(pos, &size, sizeof size);
+		lines.resize(size);
+		if (size != 0)
+			spill.read(pos + 4, lines.data(), size * sizeof(coverage_line_info));
+		pos += 4 + size * sizeof(coverage_line_info);
+		return true;
+	}
+};
+
+// Reads the symbols of each module and aggregates its lines on up to
+// `opts.threads` threads, then hands the result to `sink(i, mr)`, `i`
+// being the module's index in `ci.pdbs`. The sink may be called
+// concurrently and may consume `mr`.
+template <typename F>
+static void report_modules(coverage_info const & ci, report_options const & opts, F && sink)
+{
+#ifdef _WIN32
+	HANDLE hp = (HANDLE)4;
+	SymInitializeW(hp, opts.sympath.c_str(), FALSE);
+#endif
+
+	std::vector<std::wstring> debug_dirs = split_search_path(opts.sympath);
+#ifndef _WIN32
+	debug_dirs.push_back(L"/usr/lib/debug");
+#endif
+
+	std::vector<std::pair<guid const, pdb_coverage_info> const *> modules;
+	for (auto && kv: ci.pdbs)
+		modules.push_back(&kv);
+
+	// Modules are processed in parallel; threads that would be left
+	// without a module of their own help decode the symbols instead.
+	unsigned threads = opts.threads != 0? opts.threads: (std::max)(std::thread::hardware_concurrency(), 1u);
+	unsigned reader_threads = modules.empty()? 1: (std::max)(threads / (unsigned)(std::min)((size_t)threads, modules.size()), 1u);
+
+#ifdef _WIN32
+	// dbghelp isn't thread-safe.
+	std::mutex dbghelp_mutex;
+#endif
+
+	auto read_module_lines = [&](module_lines & ml, pdb_coverage_info const & pci) {
+		string_view build_id = parse_build_id_note(pci.cv);
+		if (!build_id.empty())
+			return dwarf_read_module_lines(ml, pci.filename, build_id, debug_dirs, reader_threads);
+
+		pdb_file pdb;
+		ml.filename = open_pdb_file(pdb, pci.cv, pci.filename, debug_dirs);
+		if (!ml.filename.empty())
+		{
+			ml.lines = pdb.read_line_table(reader_threads);
+			return true;
+		}
+
+#ifdef _WIN32
+		std::lock_guard<std::mutex> lock(dbghelp_mutex);
+		return dbghelp_read_module_lines(ml, hp, pci);
+#else
+		return false;
+#endif
+	};
+
+	parallel_for(modules.size(), threads, [&](size_t i) {
+		guid const & pdb_guid = modules[i]->first;
+		pdb_coverage_info const & pci = modules[i]->second;
+
+		// A warm cache entry is aggregated straight from its mapping.
+		line_cache_entry entry;
+		module_lines ml;
+		bool cached = false;
+		{
+			stats_timer timer(opts.stats, "symbols", pci.filename);
+			if (!opts.cache_dir.empty() && entry.open(opts.cache_dir, pdb_guid, pci.cv))
+			{
+				cached = true;
+				if (opts.stats)
+					opts.stats->count(counter_line_cache_hits);
+			}
+			else
+			{
+				if (!read_module_lines(ml, pci))
+					throw std::runtime_error("failed to load symbols");
+
+				if (!opts.cache_dir.empty())
+					store_line_cache(opts.cache_dir, pdb_guid, pci.cv, ml);
+
+				std::vector<line_table_row> & rows = ml.lines.rows;
+				std::sort(rows.begin(), rows.end(), [](line_table_row const & lhs, line_table_row const & rhs) {
+					return lhs.address < rhs.address;
+				});
+			}
+		}
+
+		if (opts.stats)
+		{
+			opts.stats->count(counter_modules);
+			opts.stats->count(counter_line_addresses, cached? entry.row_count(): ml.lines.rows.size());
+			opts.stats->count(counter_covered_addresses, pci.addrs_covered.size());
+		}
+
+		module_report mr;
 		{
-			coverage_line_info li;
-			li.line = line_kv.first;
-			li.total_addresses = line_kv.second.first;
-			li.covered = line_kv.second.second;
-			fr.lines.push_back(li);
+			stats_timer timer(opts.stats, "aggregate", pci.filename);
+			if (cached)
+			{
+				cache_rows rows = { entry };
+				report_lines(mr, pci, rows);
+				entry = line_cache_entry();
+			}
+			else
+			{
+				table_rows rows = { ml.lines };
+				report_lines(mr, pci, rows);
+				ml = module_lines();
+			}
 		}
 
-		cr.files.push_back(std::move(fr));
+		sink(i, mr);
+	});
+}
+
+
+coverage_report report(coverage_info const & ci, report_options const & opts)
+{
+	std::vector<module_report> partials(ci.pdbs.size());
+	report_modules(ci, opts, [&](size_t i, module_report & mr) {
+		partials[i] = std::move(mr);
+	});
+
+	stats_timer timer(opts.stats, "combine", L"combine files");
+
+	coverage_report cr;
+	get_report_columns(ci, cr.has_run_counts, cr.has_hit_counts);
+
+	report_ctx ctx;
+	for (module_report & mr: partials)
+	{
+		add_module_report(ctx, mr);
+		mr = module_report();
+	}
+
+	std::vector<std::wstring> names;
+	names.reserve(ctx.files.names.size());
+	for (std::string const & name: ctx.files.names)
+		names.push_back(utf8_to_utf16(name));
+
+	std::vector<uint32_t> order(names.size());
+	for (uint32_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&](uint32_t lhs, uint32_t rhs) {
+		return names[lhs] < names[rhs];
+	});
+
+	cr.file_lines.push_back(0);
+	for (uint32_t id: order)
+	{
+		combine_lines(ctx.lines[id]);
+		if (opts.stats)
+			opts.stats->count(counter_files);
+
+		cr.files.push_back(std::move(names[id]));
+		cr.lines.insert(cr.lines.end(), ctx.lines[id].begin(), ctx.lines[id].end());
+		cr.file_lines.push_back(cr.lines.size());
+
+		std::vector<coverage_line_info>().swap(ctx.lines[id]);
 	}
 
 	return cr;
@@ -106,19 +513,94 @@ void coverage_report::store(std::ostream & out)
 	json_writer w(out);
 
 	w.open_object();
-	for (auto & file: files)
+	for (size_t i = 0; i < files.size(); ++i)
+		write_file_lines(w, files[i], lines.data() + file_lines[i], lines.data() + file_lines[i + 1], has_run_counts, has_hit_counts);
+	w.close_object();
+}
+
+void store_report(coverage_info const & ci, report_options const & opts, std::ostream & out)
+{
+	spill_file spill;
+	std::mutex spill_mutex;
+	std::vector<spill_cursor> runs(ci.pdbs.size());
+
+	report_modules(ci, opts, [&](size_t i, module_report & mr) {
+		std::vector<std::wstring> names;
+		for (std::string const & name: mr.files)
+			names.push_back(utf8_to_utf16(name));
+
+		std::vector<size_t> order(names.size());
+		for (size_t j = 0; j < order.size(); ++j)
+			order[j] = j;
+		std::sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+			return names[lhs] < names[rhs];
+		});
+
+		std::lock_guard<std::mutex> lock(spill_mutex);
+		runs[i].pos = spill.size;
+		for (size_t j: order)
+		{
+			uint32_t size = (uint32_t)mr.files[j].size();
+			spill.write(&size, sizeof size);
+			spill.write(mr.files[j].data(), size);
+
+			size = (uint32_t)mr.lines[j].size();
+			spill.write(&size, sizeof size);
+			spill.write(mr.lines[j].data(), size * sizeof(coverage_line_info));
+		}
+		runs[i].last = spill.size;
+	});
+
+	if (fflush(spill.f) != 0)
+		throw std::runtime_error("cannot write to a temporary file");
+
+	stats_timer timer(opts.stats, "combine", L"combine files");
+
+	// Merge the runs by file name; a file's lines are final once all runs
+	// have moved past its name.
+	auto name_greater = [](spill_cursor const * lhs, spill_cursor const * rhs) {
+		return lhs->filename > rhs->filename;
+	};
+
+	std::vector<spill_cursor *> heap;
+	for (spill_cursor & run: runs)
 	{
-		w.write_key(file.filename);
-		w.open_array();
-		for (auto & line: file.lines)
+		if (run.next(spill))
+			heap.push_back(&run);
+	}
+	std::make_heap(heap.begin(), heap.end(), name_greater);
+
+	bool has_run_counts;
+	bool has_hit_counts;
+	get_report_columns(ci, has_run_counts, has_hit_counts);
+
+	json_writer w(out);
+	w.open_object();
+
+	std::wstring filename;
+	std::vector<coverage_line_info> lines;
+	while (!heap.empty())
+	{
+		filename = heap.front()->filename;
+		lines.clear();
+
+		while (!heap.empty() && heap.front()->filename == filename)
 		{
-			w.open_array();
-			w.write_num(line.line);
-			w.write_num(line.total_addresses);
-			w.write_num(line.covered);
-			w.close_array();
+			std::pop_heap(heap.begin(), heap.end(), name_greater);
+			spill_cursor * run = heap.back();
+			lines.insert(lines.end(), run->lines.begin(), run->lines.end());
+
+			if (run->next(spill))
+				std::push_heap(heap.begin(), heap.end(), name_greater);
+			else
+				heap.pop_back();
 		}
-		w.close_array();
+
+		combine_lines(lines);
+		if (opts.stats)
+			opts.stats->count(counter_files);
+		write_file_lines(w, filename, lines.data(), lines.data() + lines.size(), has_run_counts, has_hit_counts);
 	}
+
 	w.close_object();
 }
@@ -0,0 +1,158 @@
+#include "stats.h"
+#include "json.h"
+
+static uint64_t to_us(run_stats::clock::duration d)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+static char const * const counter_names[counter_count] = {
+	"breakpoints_armed",
+	"breakpoints_rearmed",
+	"covered_addresses",
+	"execs",
+	"files",
+	"functions_expanded",
+	"line_addresses",
+	"line_cache_hits",
+	"loader_traps",
+	"memory_reads",
+	"memory_writes",
+	"modules",
+	"modules_armed",
+	"modules_read",
+	"pages_patched",
+	"patch_failures",
+	"processes",
+	"traps",
+};
+
+static char const * const histogram_names[histogram_count] = {
+	"trap_latency_us",
+};
+
+run_stats::run_stats()
+	: m_start(clock::now())
+{
+	for (auto & counter: m_counters)
+		counter.store(0, std::memory_order_relaxed);
+	for (auto & buckets: m_histograms)
+	{
+		for (auto & bucket: buckets)
+			bucket.store(0, std::memory_order_relaxed);
+	}
+}
+
+void run_stats::time(char const * name, clock::time_point start, clock::time_point end, wstring_view label)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	timer & t = m_timers[name];
+	t.total_us += to_us(end - start);
+	++t.count;
+
+	if (!label.empty())
+	{
+		auto r = m_threads.emplace(std::this_thread::get_id(), (uint32_t)m_threads.size());
+
+		span s = { name, std::wstring(label.begin(), label.end()), to_us(start - m_start), to_us(end - start), r.first->second };
+		m_spans.push_back(std::move(s));
+	}
+}
+
+void run_stats::store(std::ostream & out) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	json_writer w(out);
+	w.open_object();
+
+	w.write_key("counters");
+	w.open_object();
+	for (size_t i = 0; i < counter_count; ++i)
+	{
+		uint64_t value = m_counters[i].load(std::memory_order_relaxed);
+		if (value == 0)
+			continue;
+
+		w.write_key(counter_names[i]);
+		w.write_num(value);
+	}
+	w.close_object();
+
+	w.write_key("timers");
+	w.open_object();
+	for (auto && kv: m_timers)
+	{
+		w.write_key(kv.first);
+		w.open_object();
+		w.write_key("us");
+		w.write_num(kv.second.total_us);
+		w.write_key("count");
+		w.write_num(kv.second.count);
+		w.close_object();
+	}
+	w.close_object();
+
+	w.write_key("histograms");
+	w.open_object();
+	for (size_t h = 0; h < histogram_count; ++h)
+	{
+		uint64_t buckets[histogram_buckets];
+		size_t used = 0;
+		for (size_t i = 0; i < histogram_buckets; ++i)
+		{
+			buckets[i] = m_histograms[h][i].load(std::memory_order_relaxed);
+			if (buckets[i] != 0)
+				used = i + 1;
+		}
+
+		if (used == 0)
+			continue;
+
+		w.write_key(histogram_names[h]);
+		w.open_array();
+		for (size_t i = 0; i < used; ++i)
+		{
+			w.open_array();
+			w.write_num(i == 0? 0: (uint64_t)1 << (i - 1));
+			w.write_num(buckets[i]);
+			w.close_array();
+		}
+		w.close_array();
+	}
+	w.close_object();
+
+	w.close_object();
+}
+
+void run_stats::store_trace(std::ostream & out) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	json_writer w(out);
+	w.open_object();
+	w.write_key("traceEvents");
+	w.open_array();
+	for (span const & s: m_spans)
+	{
+		w.open_object();
+		w.write_key("name");
+		w.write_str(s.label);
+		w.write_key("cat");
+		w.write_str(s.name);
+		w.write_key("ph");
+		w.write_str("X");
+		w.write_key("ts");
+		w.write_num(s.start_us);
+		w.write_key("dur");
+		w.write_num(s.duration_us);
+		w.write_key("pid");
+		w.write_num(1);
+		w.write_key("tid");
+		w.write_num(s.thread);
+		w.close_object();
+	}
+	w.close_array();
+	w.close_object();
+}
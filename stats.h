@@ -0,0 +1,151 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "string_view.h"
+#include <map>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <iosfwd>
+#include <stdint.h>
+
+// The counters of `run_stats`, named like the enumerators
+// without the prefix when stored.
+enum run_counter
+{
+	counter_breakpoints_armed,
+	counter_breakpoints_rearmed,
+	counter_covered_addresses,
+	counter_execs,
+	counter_files,
+	counter_functions_expanded,
+	counter_line_addresses,
+	counter_line_cache_hits,
+	counter_loader_traps,
+	counter_memory_reads,
+	counter_memory_writes,
+	counter_modules,
+	counter_modules_armed,
+	counter_modules_read,
+	counter_pages_patched,
+	counter_patch_failures,
+	counter_processes,
+	counter_traps,
+
+	counter_count
+};
+
+enum run_histogram
+{
+	histogram_trap_latency_us,
+
+	histogram_count
+};
+
+// Counters, timers and a timeline of a capture or a report, to tell
+// where the time goes. Can be updated from several threads at once.
+//
+// Counters and histograms sit on the paths being measured, so they're
+// fixed slots updated without a lock; callers skip them altogether when
+// there are no stats to collect.
+struct run_stats
+{
+	typedef std::chrono::steady_clock clock;
+
+	run_stats();
+
+	// Adds `n` to the counter `c`.
+	void count(run_counter c, uint64_t n = 1)
+	{
+		m_counters[c].fetch_add(n, std::memory_order_relaxed);
+	}
+
+	// Adds the interval [start, end) to the timer `name`. If `label`
+	// isn't empty, the interval is put on the timeline as well.
+	void time(char const * name, clock::time_point start, clock::time_point end, wstring_view label = wstring_view());
+
+	// Adds `value` to the histogram `h`, whose buckets are
+	// [0, 1), [1, 2), [2, 4), [4, 8) and so on.
+	void sample(run_histogram h, uint64_t value)
+	{
+		size_t bucket = 0;
+		for (; value != 0; value >>= 1)
+			++bucket;
+		m_histograms[h][bucket].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Writes the counters that aren't zero, the timers with their total
+	// in microseconds and their number of intervals, and the histograms
+	// that aren't empty as [lower bound, count] pairs, all as JSON.
+	void store(std::ostream & out) const;
+
+	// Writes the timeline in the Chrome trace event format, which
+	// chrome://tracing and Perfetto can open.
+	void store_trace(std::ostream & out) const;
+
+private:
+	run_stats(run_stats const &);
+	run_stats & operator=(run_stats const &);
+
+	struct timer
+	{
+		uint64_t total_us;
+		uint64_t count;
+	};
+
+	struct span
+	{
+		char const * name;
+		std::wstring label;
+		uint64_t start_us;
+		uint64_t duration_us;
+		uint32_t thread;
+	};
+
+	// A bucket for zero and one for each bit length of a 64-bit value.
+	static size_t const histogram_buckets = 65;
+
+	std::atomic<uint64_t> m_counters[counter_count];
+	std::atomic<uint64_t> m_histograms[histogram_count][histogram_buckets];
+
+	// Guards the timers and the timeline.
+	mutable std::mutex m_mutex;
+	clock::time_point m_start;
+	std::map<std::string, timer> m_timers;
+	std::vector<span> m_spans;
+
+	// Threads get small ids on the timeline in the order they show up.
+	std::map<std::thread::id, uint32_t> m_threads;
+};
+
+// Adds the time from its construction to its destruction to the timer
+// `name` of `stats`, unless `stats` is null.
+struct stats_timer
+{
+	stats_timer(run_stats * stats, char const * name, wstring_view label = wstring_view())
+		: m_stats(stats), m_name(name), m_label(label.begin(), label.end())
+	{
+		if (m_stats)
+			m_start = run_stats::clock::now();
+	}
+
+	~stats_timer()
+	{
+		if (m_stats)
+			m_stats->time(m_name, m_start, run_stats::clock::now(), m_label);
+	}
+
+private:
+	stats_timer(stats_timer const &);
+	stats_timer & operator=(stats_timer const &);
+
+	run_stats * m_stats;
+	char const * m_name;
+	std::wstring m_label;
+	run_stats::clock::time_point m_start;
+};
+
+#endif // STATS_H
@@ -1,6 +1,9 @@
 #include "utf.h"
-#include <windows.h>
 #include <stdexcept>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
 
 std::string utf16_to_utf8(wstring_view s)
 {
@@ -37,3 +40,109 @@ std::wstring utf8_to_utf16(string_view s)
 	}
 	return res;
 }
+
+#else
+
+// Outside of Windows, `wchar_t` holds full UTF-32 code points.
+
+std::string utf16_to_utf8(wstring_view s)
+{
+	std::string res;
+	res.reserve(s.size());
+
+	for (wchar_t wch: s)
+	{
+		uint32_t cp = (uint32_t)wch;
+		if (cp < 0x80)
+		{
+			res.push_back((char)cp);
+		}
+		else if (cp < 0x800)
+		{
+			res.push_back((char)(0xc0 | (cp >> 6)));
+			res.push_back((char)(0x80 | (cp & 0x3f)));
+		}
+		else if (cp < 0x10000)
+		{
+			if (0xd800 <= cp && cp < 0xe000)
+				throw std::runtime_error("failed to convert to utf-8");
+			res.push_back((char)(0xe0 | (cp >> 12)));
+			res.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+			res.push_back((char)(0x80 | (cp & 0x3f)));
+		}
+		else if (cp < 0x110000)
+		{
+			res.push_back((char)(0xf0 | (cp >> 18)));
+			res.push_back((char)(0x80 | ((cp >> 12) & 0x3f)));
+			res.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+			res.push_back((char)(0x80 | (cp & 0x3f)));
+		}
+		else
+		{
+			throw std::runtime_error("failed to convert to utf-8");
+		}
+	}
+
+	return res;
+}
+
+std::wstring utf8_to_utf16(string_view s)
+{
+	std::wstring res;
+	res.reserve(s.size());
+
+	char const * cur = s.begin();
+	char const * last = s.end();
+	while (cur != last)
+	{
+		uint8_t ch = (uint8_t)*cur++;
+		if (ch < 0x80)
+		{
+			res.push_back(ch);
+			continue;
+		}
+
+		size_t trail;
+		uint32_t cp;
+		if ((ch & 0xe0) == 0xc0)
+		{
+			trail = 1;
+			cp = ch & 0x1f;
+		}
+		else if ((ch & 0xf0) == 0xe0)
+		{
+			trail = 2;
+			cp = ch & 0x0f;
+		}
+		else if ((ch & 0xf8) == 0xf0)
+		{
+			trail = 3;
+			cp = ch & 0x07;
+		}
+		else
+		{
+			throw std::runtime_error("failed to convert from utf-8");
+		}
+
+		if ((size_t)(last - cur) < trail)
+			throw std::runtime_error("failed to convert from utf-8");
+
+		for (size_t i = 0; i != trail; ++i)
+		{
+			uint8_t cont = (uint8_t)*cur++;
+			if ((cont & 0xc0) != 0x80)
+				throw std::runtime_error("failed to convert from utf-8");
+			cp = (cp << 6) | (cont & 0x3f);
+		}
+
+		static uint32_t const min_cp[] = { 0, 0x80, 0x800, 0x10000 };
+		if (cp < min_cp[trail] || cp >= 0x110000 || (0xd800 <= cp && cp < 0xe000))
+			throw std::runtime_error("failed to convert from utf-8");
+
+		res.push_back((wchar_t)cp);
+	}
+
+	return res;
+}
+
+#endif
@@ -1,4 +1,6 @@
 #include "utils.h"
+#include <algorithm>
+#include <cwctype>
 
 std::pair<wstring_view, wstring_view> split_filename(wstring_view fname)
 {
@@ -19,92 +21,64 @@ std::pair<wstring_view, wstring_view> split_filename(wstring_view fname)
 	return std::make_pair(wstring_view(), wstring_view(first, last));
 }
 
-std::string to_base64(uint8_t const * p, size_t size)
+// Symbol server elements, like `srv*<cache>*<url>`, hold colons of their own.
+static bool is_symsrv_element(wstring_view elem)
 {
-	static char const digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
-	std::string res;
-	res.reserve(size / 3 * 4 + 4);
-
-	while (size >= 3)
+	static wchar_t const * const prefixes[] = { L"srv*", L"symsrv*", L"cache*" };
+	for (wchar_t const * prefix: prefixes)
 	{
-		res.push_back(digits[p[0] >> 2]);
-		res.push_back(digits[((p[0] << 4) & 0x30) | (p[1] >> 4)]);
-		res.push_back(digits[((p[1] << 2) & 0x3c) | (p[2] >> 6)]);
-		res.push_back(digits[p[2] & 0x3f]);
-		p += 3;
-		size -= 3;
+		wstring_view p = prefix;
+		if (elem.size() >= p.size() && std::equal(p.begin(), p.end(), elem.begin(), [](wchar_t lhs, wchar_t rhs) {
+			return (wint_t)towlower(lhs) == towlower(rhs);
+		}))
+		{
+			return true;
+		}
 	}
 
-	switch (size)
-	{
-	case 1:
-		res.push_back(digits[p[0] >> 2]);
-		res.push_back(digits[(p[0] << 4) & 0x30]);
-		res.append("==");
-		break;
-	case 2:
-		res.push_back(digits[p[0] >> 2]);
-		res.push_back(digits[((p[0] << 4) & 0x30) | (p[1] >> 4)]);
-		res.push_back(digits[(p[1] << 2) & 0x3c]);
-		res.push_back('=');
-		break;
-	}
-
-	return res;
+	return false;
 }
 
-std::vector<uint8_t> from_base64(string_view s)
+std::vector<std::wstring> split_search_path(wstring_view path)
 {
-	if (s.size() % 4 != 0)
-		throw std::invalid_argument("base64 strings must be a multiple of 4 characters long");
+	std::vector<std::wstring> res;
 
-	auto extract_digit = [](char ch) -> uint8_t {
-		if ('A' <= ch && ch <= 'Z')
-			return ch - 'A';
-		if ('a' <= ch && ch <= 'z')
-			return ch - 'a' + 26;
-		if ('0' <= ch && ch <= '9')
-			return ch - '0' + 52;
-		if (ch == '+')
-			return 62;
-		if (ch == '/')
-			return 63;
-		if (ch == '=')
-			return 0;
-		throw std::invalid_argument("unexpected characters");
+	auto add = [&](wstring_view::const_iterator first, wstring_view::const_iterator last) {
+		if (first != last)
+			res.push_back(std::wstring(first, last));
 	};
 
-	char const * first = s.begin();
-	char const * last = s.end();
-
-	size_t eq_suffix = 0;
-	if (first != last && last[-1] == '=')
+	auto first = path.begin();
+	auto last = path.end();
+	while (first != last)
 	{
-		if (last[-2] == '=')
-			eq_suffix = 2;
-		else
-			eq_suffix = 1;
-	}
-
-	if (std::find(first, last - eq_suffix, '=') != last - eq_suffix)
-		throw std::invalid_argument("stray equal signs");
-
-	std::vector<uint8_t> res;
-	res.reserve(s.size() / 4 * 3);
-
-	while (!s.empty())
-	{
-		uint32_t v = 0;
-		for (int i = 0; i < 4; ++i)
-			v = (v << 6) | extract_digit(s[i]);
-		s.remove_prefix(4);
-
-		res.push_back(v >> 16);
-		res.push_back(v >> 8);
-		res.push_back(v);
+		auto sep = std::find(first, last, ';');
+
+#ifndef _WIN32
+		// Colons separate directories too, except in symbol server
+		// elements and after a drive letter.
+		if (!is_symsrv_element(wstring_view(first, sep)))
+		{
+			auto elem_first = first;
+			for (auto cur = first; cur != sep; ++cur)
+			{
+				if (*cur != ':')
+					continue;
+
+				bool drive = cur - elem_first == 1 && cur + 1 != sep && (cur[1] == '\\' || cur[1] == '/');
+				if (drive)
+					continue;
+
+				add(elem_first, cur);
+				elem_first = cur + 1;
+			}
+			first = elem_first;
+		}
+#endif
+
+		add(first, sep);
+		first = sep == last? last: sep + 1;
 	}
 
-	res.erase(res.end() - eq_suffix, res.end());
 	return res;
 }
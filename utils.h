@@ -2,13 +2,24 @@
 #define UTILS_H
 
 #include "string_view.h"
+#include "utf.h"
+#include "base64.h"
 #include <string>
 #include <vector>
 #include <utility>
 
 std::pair<wstring_view, wstring_view> split_filename(wstring_view fname);
 
-std::string to_base64(uint8_t const * p, size_t size);
-std::vector<uint8_t> from_base64(string_view s);
+// Splits a list of directories separated by semicolons, dropping empty
+// entries. Outside of Windows, colons separate directories as well, except
+// after a drive letter and in symbol server elements like `srv*<url>`.
+std::vector<std::wstring> split_search_path(wstring_view path);
+
+// Converts a path to the form accepted by the standard file streams.
+#ifdef _WIN32
+inline std::wstring const & native_path(std::wstring const & fname) { return fname; }
+#else
+inline std::string native_path(std::wstring const & fname) { return utf16_to_utf8(fname); }
+#endif
 
 #endif // UTILS_H
@@ -0,0 +1,409 @@
+#include "x86_decode.h"
+
+namespace {
+
+// Opcode properties.
+enum : uint8_t
+{
+	op_modrm = 0x01,
+	op_imm8 = 0x02,
+	op_imm16 = 0x04,
+
+	// A 16- or 32-bit immediate, depending on the operand size.
+	op_immz = 0x08,
+
+	// Like `op_immz`, but 64 bits with REX.W.
+	op_immv = 0x10,
+
+	// An absolute address, as big as the address size.
+	op_moffs = 0x20,
+
+	op_invalid = 0x40,
+	op_invalid64 = 0x80,
+};
+
+static uint8_t const M = op_modrm;
+static uint8_t const I8 = op_imm8;
+static uint8_t const IZ = op_immz;
+static uint8_t const X = op_invalid;
+static uint8_t const X64 = op_invalid64;
+
+// Prefixes and escapes are handled before the table is consulted.
+static uint8_t const one_byte[256] = {
+	M,  M,  M,  M,  I8, IZ, X64, X64, M,  M,  M,  M,  I8, IZ, X64, 0,
+	M,  M,  M,  M,  I8, IZ, X64, X64, M,  M,  M,  M,  I8, IZ, X64, X64,
+	M,  M,  M,  M,  I8, IZ, 0,  X64, M,  M,  M,  M,  I8, IZ, 0,  X64,
+	M,  M,  M,  M,  I8, IZ, 0,  X64, M,  M,  M,  M,  I8, IZ, 0,  X64,
+	0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	X64, X64, M | X64, M, 0, 0, 0,  0,  IZ, M | IZ, I8, M | I8, 0, 0, 0, 0,
+	I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8,
+	M | I8, M | IZ, M | I8 | X64, M | I8, M, M, M, M, M, M, M, M, M, M, M, M,
+	0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  op_imm16 | IZ | X64, 0, 0, 0, 0, 0,
+	op_moffs, op_moffs, op_moffs, op_moffs, 0, 0, 0, 0, I8, IZ, 0, 0, 0, 0, 0, 0,
+	I8, I8, I8, I8, I8, I8, I8, I8, op_immv, op_immv, op_immv, op_immv, op_immv, op_immv, op_immv, op_immv,
+	M | I8, M | I8, op_imm16, 0, M | X64, M | X64, M | I8, M | IZ, op_imm16 | I8, 0, op_imm16, 0, 0, I8, X64, 0,
+	M,  M,  M,  M,  I8 | X64, I8 | X64, X, 0, M, M, M, M, M, M, M, M,
+	I8, I8, I8, I8, I8, I8, I8, I8, IZ, IZ, op_imm16 | IZ | X64, I8, 0, 0, 0, 0,
+	0,  0,  0,  0,  0,  0,  M,  M,  0,  0,  0,  0,  0,  0,  M,  M,
+};
+
+// The opcodes following 0x0f; 0f 38 and 0f 3a are handled separately.
+static uint8_t const two_byte[256] = {
+	M,  M,  M,  M,  X,  0,  0,  0,  0,  0,  X,  0,  X,  M,  0,  M | I8,
+	M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,
+	M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,
+	0,  0,  0,  0,  0,  0,  0,  0,  0,  X,  0,  X,  X,  X,  X,  X,
+	M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,
+	M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,
+	M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,
+	M | I8, M | I8, M | I8, M | I8, M, M, M, 0, M, M, M, M, M, M, M, M,
+	IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ,
+	M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,
+	0,  0,  0,  M,  M | I8, M, X, X, 0, 0, 0, M, M | I8, M, M, M,
+	M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M | I8, M, M, M, M, M,
+	M,  M,  M | I8, M, M | I8, M | I8, M | I8, M, 0, 0, 0, 0, 0, 0, 0, 0,
+	M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,
+	M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,
+	M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,
+};
+
+struct reader
+{
+	uint8_t const * cur;
+	uint8_t const * last;
+
+	bool get(uint8_t & b)
+	{
+		if (cur == last)
+			return false;
+		b = *cur++;
+		return true;
+	}
+
+	bool skip(size_t n)
+	{
+		if ((size_t)(last - cur) < n)
+			return false;
+		cur += n;
+		return true;
+	}
+
+	uint8_t peek() const
+	{
+		return cur != last? *cur: 0;
+	}
+};
+
+// Skips the ModRM byte and whatever addressing bytes follow it.
+static bool skip_modrm(reader & r, bool addr16, uint8_t & modrm)
+{
+	if (!r.get(modrm))
+		return false;
+
+	uint8_t mod = modrm >> 6;
+	uint8_t rm = modrm & 7;
+	if (mod == 3)
+		return true;
+
+	if (addr16)
+	{
+		if (mod == 0)
+			return rm != 6 || r.skip(2);
+		return r.skip(mod == 1? 1: 2);
+	}
+
+	if (rm == 4)
+	{
+		uint8_t sib;
+		if (!r.get(sib))
+			return false;
+		if (mod == 0 && (sib & 7) == 5)
+			return r.skip(4);
+	}
+
+	if (mod == 0)
+		return rm != 5 || r.skip(4);
+	return r.skip(mod == 1? 1: 4);
+}
+
+static bool read_rel(reader & r, size_t size, int64_t & rel)
+{
+	uint8_t const * p = r.cur;
+	if (!r.skip(size))
+		return false;
+
+	if (size == 1)
+		rel = (int8_t)p[0];
+	else if (size == 2)
+		rel = (int16_t)(p[0] | (p[1] << 8));
+	else
+		rel = (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+	return true;
+}
+
+// Decodes the rest of a VEX, EVEX or XOP encoded instruction, starting
+// with the opcode byte; `map` is the opcode map selected by the prefix.
+static bool decode_vex(reader & r, bool addr16, unsigned map, x86_insn & insn)
+{
+	uint8_t op;
+	if (!r.get(op))
+		return false;
+
+	uint8_t props;
+	switch (map)
+	{
+	case 1:
+		// vzeroupper and vzeroall take no operands.
+		if (op == 0x77)
+			return true;
+		props = (uint8_t)(M | (two_byte[op] & I8));
+		break;
+	case 2:
+	case 5:
+	case 6:
+	case 9:
+		props = M;
+		break;
+	case 3:
+	case 8:
+		props = M | I8;
+		break;
+	case 10:
+		props = M | IZ;
+		break;
+	default:
+		return false;
+	}
+
+	uint8_t modrm;
+	if (!skip_modrm(r, addr16, modrm))
+		return false;
+
+	if ((props & I8) && !r.skip(1))
+		return false;
+	if ((props & IZ) && !r.skip(4))
+		return false;
+
+	insn.flow = x86_flow::next;
+	return true;
+}
+
+}
+
+bool x86_decode(uint8_t const * p, size_t size, bool x64, x86_insn & insn)
+{
+	reader r = { p, p + size };
+
+	bool opsize16 = false;
+	bool addrsize = false;
+	bool rex_w = false;
+
+	uint8_t op;
+	for (;;)
+	{
+		if (!r.get(op))
+			return false;
+
+		if (x64 && (op & 0xf0) == 0x40)
+		{
+			// REX only counts if the opcode follows it directly.
+			rex_w = (op & 8) != 0;
+			uint8_t next = r.peek();
+			if (next == 0x66 || next == 0x67 || next == 0xf0 || next == 0xf2 || next == 0xf3
+				|| next == 0x2e || next == 0x36 || next == 0x3e || next == 0x26 || next == 0x64 || next == 0x65
+				|| (next & 0xf0) == 0x40)
+			{
+				rex_w = false;
+			}
+			continue;
+		}
+
+		if (op == 0x66)
+			opsize16 = true;
+		else if (op == 0x67)
+			addrsize = true;
+		else if (op != 0xf0 && op != 0xf2 && op != 0xf3
+			&& op != 0x2e && op != 0x36 && op != 0x3e && op != 0x26 && op != 0x64 && op != 0x65)
+		{
+			break;
+		}
+
+		if (r.cur - p > 14)
+			return false;
+	}
+
+	bool addr16 = !x64 && addrsize;
+	size_t immz = opsize16 && !rex_w? 2: 4;
+
+	insn.flow = x86_flow::next;
+	insn.rel = 0;
+
+	// VEX, EVEX and XOP reuse opcodes that are invalid in 64-bit mode;
+	// in 32-bit mode they only do so with a register ModRM operand.
+	uint8_t next = r.peek();
+	if ((op == 0xc4 || op == 0xc5 || op == 0x62) && (x64 || (next & 0xc0) == 0xc0))
+	{
+		uint8_t p0 = 0;
+		if (!r.get(p0))
+			return false;
+
+		unsigned map = 1;
+		if (op == 0xc4)
+		{
+			map = p0 & 0x1f;
+			if (!r.skip(1))
+				return false;
+		}
+		else if (op == 0x62)
+		{
+			map = p0 & 7;
+			if (!r.skip(2))
+				return false;
+		}
+
+		if (!decode_vex(r, addr16, map, insn))
+			return false;
+		insn.length = r.cur - p;
+		return true;
+	}
+
+	if (op == 0x8f && (next & 0x38) != 0)
+	{
+		uint8_t p0 = 0;
+		if (!r.get(p0) || !r.skip(1) || !decode_vex(r, addr16, p0 & 0x1f, insn))
+			return false;
+		insn.length = r.cur - p;
+		return true;
+	}
+
+	uint8_t props;
+	bool escaped = op == 0x0f;
+	if (escaped)
+	{
+		if (!r.get(op))
+			return false;
+
+		if (op == 0x38 || op == 0x3a)
+		{
+			props = op == 0x38? M: M | I8;
+			if (!r.skip(1))
+				return false;
+		}
+		else
+		{
+			props = two_byte[op];
+			if (props & X)
+				return false;
+
+			if (op >= 0x80 && op <= 0x8f)
+			{
+				// Processors disagree on the size of the displacement
+				// of a 66-prefixed branch in 64-bit mode.
+				if (x64 && opsize16)
+					return false;
+
+				if (!read_rel(r, immz, insn.rel))
+					return false;
+				insn.flow = x86_flow::cond_jump;
+				insn.length = r.cur - p;
+				return true;
+			}
+
+			if (op == 0x0b || op == 0xb9 || op == 0xff || op == 0x07 || op == 0x35)
+				insn.flow = x86_flow::stop;
+		}
+	}
+	else
+	{
+		props = one_byte[op];
+		if ((props & X) || (x64 && (props & X64)))
+			return false;
+
+		switch (op)
+		{
+		case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x76: case 0x77:
+		case 0x78: case 0x79: case 0x7a: case 0x7b: case 0x7c: case 0x7d: case 0x7e: case 0x7f:
+		case 0xe0: case 0xe1: case 0xe2: case 0xe3:
+			if (!read_rel(r, 1, insn.rel))
+				return false;
+			insn.flow = x86_flow::cond_jump;
+			insn.length = r.cur - p;
+			return true;
+
+		case 0xeb:
+			if (!read_rel(r, 1, insn.rel))
+				return false;
+			insn.flow = x86_flow::jump;
+			insn.length = r.cur - p;
+			return true;
+
+		case 0xe8:
+		case 0xe9:
+			if (x64 && opsize16)
+				return false;
+			if (!read_rel(r, immz, insn.rel))
+				return false;
+			insn.flow = op == 0xe8? x86_flow::call: x86_flow::jump;
+			insn.length = r.cur - p;
+			return true;
+
+		case 0x9a:
+			insn.flow = x86_flow::indirect_call;
+			break;
+
+		case 0xea:
+			insn.flow = x86_flow::indirect_jump;
+			break;
+
+		case 0xc2: case 0xc3: case 0xca: case 0xcb: case 0xcf:
+		case 0xcc: case 0xf4:
+			insn.flow = x86_flow::stop;
+			break;
+		}
+	}
+
+	uint8_t modrm = 0;
+	if ((props & M) && !skip_modrm(r, addr16, modrm))
+		return false;
+
+	size_t imm = 0;
+	if (props & I8)
+		imm += 1;
+	if (props & op_imm16)
+		imm += 2;
+	if (props & IZ)
+		imm += immz;
+	if (props & op_immv)
+		imm += rex_w? 8: immz;
+	if (props & op_moffs)
+		imm += x64? (addrsize? 4: 8): (addrsize? 2: 4);
+
+	// The test instruction in group 3 is the only one with an immediate.
+	if (!escaped && (op == 0xf6 || op == 0xf7) && ((modrm >> 3) & 7) < 2)
+		imm += op == 0xf6? 1: immz;
+
+	if (!r.skip(imm))
+		return false;
+
+	// Group 5 holds the indirect calls and jumps.
+	if (!escaped && op == 0xff)
+	{
+		switch ((modrm >> 3) & 7)
+		{
+		case 2:
+		case 3:
+			insn.flow = x86_flow::indirect_call;
+			break;
+		case 4:
+		case 5:
+			insn.flow = x86_flow::indirect_jump;
+			break;
+		case 7:
+			return false;
+		}
+	}
+
+	insn.length = r.cur - p;
+	return true;
+}
@@ -0,0 +1,44 @@
+#ifndef X86_DECODE_H
+#define X86_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// How an instruction passes control on.
+enum class x86_flow
+{
+	// Continues with the next instruction.
+	next,
+
+	// A direct jump, a conditional one or a call to `next + rel`; the latter
+	// two may also continue with the next instruction.
+	jump,
+	cond_jump,
+	call,
+
+	// Jumps or calls through a register or memory.
+	indirect_jump,
+	indirect_call,
+
+	// Doesn't continue anywhere we can tell: returns, traps and halts.
+	stop,
+};
+
+struct x86_insn
+{
+	size_t length;
+	x86_flow flow;
+	int64_t rel;
+};
+
+// Decodes the length and the control flow of the instruction at `p`,
+// reading at most `size` bytes. Returns false if the bytes don't hold
+// an instruction the decoder knows, or if it's ambiguous between
+// processors.
+//
+// Only as much of the encoding is decoded as is needed to tell the two;
+// this covers the general-purpose, x87, SSE, AVX, AVX-512 and XOP
+// instruction sets.
+bool x86_decode(uint8_t const * p, size_t size, bool x64, x86_insn & insn);
+
+#endif // X86_DECODE_H